@@ -1,638 +1,4978 @@
 #include "pickle.hpp"
 #include <errno.h>
+#include <stdarg.h>
+#include <math.h>
 #include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/random.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace pickle {
 
-static void free_payload(object* o) { free(o->as_ptr); }
+// the vm that is currently inside gc(), so swept objects can be removed from its intern tables
+static pvm* sweeping_vm = NULL;
+
+static void unintern(object* o) { if (sweeping_vm) sweeping_vm->unintern(o); }
+static void unintern_and_free(object* o) { unintern(o); arena::release(STRING_HEADER(o)); }
+static void unintern_and_free_ptr(object* o) { unintern(o); arena::release(o->as_ptr); }
 static object* mark_car_only(tinobsy::vm* _, object* o) { return car(o); }
+// The car is queued instead of recursed into. While gc_step() is marking, so is the cdr, so that
+// a long list isn't marked all in one go, and when prefetching, so that it can be prefetched.
+static object* mark_cons(tinobsy::vm* vm, object* o) {
+    pvm* p = static_cast<pvm*>(vm);
+    p->shade(car(o));
+    if (!p->gc_marking && !p->gc_prefetch) return cdr(o);
+    p->shade(cdr(o));
+    return nil;
+}
+
+// how the primitives compare and hash (they're with eqcmp() further down)
+static int compare_numbers(object* a, object* b);
+static uint64_t hash_number(pvm* vm, object* o);
+static int compare_text(object* a, object* b);
+static bool equal_text(object* a, object* b);
+static uint64_t hash_text(pvm* vm, object* o);
+static int compare_pointers(object* a, object* b);
+static uint64_t hash_pointer(pvm* vm, object* o);
+static int compare_indexes(object* a, object* b);
 
 // ------------------------ core types -----------------
 // these will later be swapped for actual objects
 
 // cons = car, cdr
-const object_type cons_type("cons", tinobsy::markcons, NULL, NULL);
-const object_type obj_type("object", tinobsy::markcons, NULL, NULL);
+const value_type cons_type("cons", mark_cons, NULL, NULL);
+const value_type obj_type("object", mark_cons, NULL, NULL);
 // --------- primitive/ish types ---------------
-const object_type string_type("string", mark_car_only, free_payload, NULL);
-const object_type symbol_type("symbol", mark_car_only, free_payload, NULL);
-const object_type c_function_type("c_function", mark_car_only, NULL, NULL);
-const object_type integer_type("int", mark_car_only, NULL, NULL);
-const object_type float_type("float", mark_car_only, NULL, NULL);
-const object_type* primitives[] = { &string_type, &symbol_type, &c_function_type, &integer_type, &float_type, NULL };
+const value_type string_type("string", mark_car_only, unintern_and_free, NULL, RANK_TEXT, compare_text, equal_text, hash_text, INTERNED_STRINGS);
+const value_type symbol_type("symbol", mark_car_only, unintern_and_free, NULL, RANK_SYMBOL, compare_text, equal_identity, hash_text, INTERNED_SYMBOLS);
+const value_type c_function_type("c_function", mark_car_only, unintern, NULL, RANK_FUNCTION, compare_pointers, equal_identity, hash_pointer, INTERNED_FUNCS);
+// opcode = name symbol, index into pvm::opcodes
+const value_type opcode_type("opcode", mark_car_only, NULL, NULL, RANK_OPCODE, compare_indexes);
+// numbers are interned, so equal ones are the same object
+const value_type integer_type("int", mark_car_only, unintern, NULL, RANK_NUMBER, compare_numbers, equal_identity, hash_number, INTERNED_INTS);
+const value_type float_type("float", mark_car_only, unintern, NULL, RANK_NUMBER, compare_numbers, equal_identity, hash_number, INTERNED_FLOATS);
+// bigint = pointer to a bignum::num, only used for integers that don't fit in an int
+const value_type bigint_type("bigint", mark_car_only, unintern_and_free_ptr, NULL, RANK_NUMBER, compare_numbers, equal_identity, hash_number, INTERNED_BIGINTS);
+// rope = pointer to a rope_node
+static object* mark_rope(tinobsy::vm* vm, object* o) {
+    pvm* p = static_cast<pvm*>(vm);
+    p->shade(ROPE(o)->left);
+    p->shade(ROPE(o)->right);
+    return ROPE(o)->flat;
+}
+static void free_rope(object* o) { arena::release(o->as_ptr); }
+// a rope is equal to the string with the same chars
+const value_type rope_type("rope", mark_rope, free_rope, NULL, RANK_TEXT, compare_text, equal_text, hash_text);
 
-// ----------------- misc init functions ---------------------------
+namespace bignum {
+// magnitude in base 2^32, least significant limb first, with no leading zero limbs
+struct num {
+    size_t len;
+    bool neg;
+    uint32_t limbs[];
+};
+}
 
-void pvm::mark_globals() {
-    this->markobject(this->queue);
-    this->markobject(this->globals);
-    this->markobject(this->function_registry);
+// thread = next instruction type, pointer to a thread_state
+static object* mark_thread(tinobsy::vm* vm, object* o) {
+    pvm* p = static_cast<pvm*>(vm);
+    thread_state* t = THREAD(o);
+    for (size_t i = 0; i < t->data_len; i++) p->shade(t->data[i]);
+    for (size_t i = 0; i < t->insts_len; i++) {
+        p->shade(t->insts[i].type);
+        p->shade(t->insts[i].opcode);
+        p->shade(t->insts[i].cookie);
+    }
+    return car(o);
 }
 
-pvm::pvm() {
-    tinobsy::vm();
-    srand(time(NULL));
-    this->hash_seed = rand();
+static void free_thread(object* o) {
+    thread_state* t = THREAD(o);
+    arena::release(t->data);
+    arena::release(t->insts);
+    arena::release(t);
 }
 
+const value_type thread_type("thread", mark_thread, free_thread, NULL);
 
-//--------------- HELPER FUNCTIONS ----------------------------
+// ----------------- misc init functions ---------------------------
 
-static bool is_primitive_type(object* x) {
-    if (x == NULL) return true;
-    size_t i = 0; while (primitives[i] != NULL) { if (x->type == primitives[i]) break; i++; }
-    return primitives[i] != NULL;
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-int eqcmp(object* a, object* b) {
-    if (a == b) return 0;
-    if (a == NULL) return -1;
-    if (b == NULL) return 1;
-    if (a->type != b->type) return a->type - b->type;
-    if (!is_primitive_type(a)) return -1;
-    if (a->type->free) return strcmp(a->as_chars, b->as_chars); // String-ish type
-    if (a->type == &float_type) return a->as_double - b->as_double;
-    return a->as_big_int - b->as_big_int;
+// fills buf with bytes from the kernel's random number generator, returns false if it can't
+static bool random_bytes(void* buf, size_t len) {
+    char* out = (char*)buf;
+#ifdef __linux__
+    while (len) {
+        ssize_t got = getrandom(out, len, 0);
+        if (got < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        out += got;
+        len -= got;
+    }
+    if (!len) return true;
+#endif
+    int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    while (len) {
+        ssize_t got = read(fd, out, len);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) break;
+        out += got;
+        len -= got;
+    }
+    close(fd);
+    return !len;
 }
 
-object* assoc(object* list, object* key) {
-    for (; list; list = cdr(list)) {
-        object* pair = car(list);
-        if (!eqcmp(key, car(pair))) return pair;
-    }
-    return NULL;
+void pvm::mark_globals() {
+    this->mark_roots();
+    this->drain_grey(0);
 }
 
-object* delassoc(object** list, object* key) {
-    for (; *list; list = &cdr(*list)) {
-        object* pair = car(*list);
-        if (!eqcmp(key, car(pair))) {
-            *list = cdr(*list);
-            return pair;
-        }
+void pvm::mark_roots() {
+    this->shade(this->parked);
+    this->shade(this->globals);
+    this->shade(this->function_registry);
+    this->shade(this->patterns);
+    for (size_t i = 0; i <= SMALL_INT_MAX - SMALL_INT_MIN; i++) this->shade(this->small_ints[i]);
+    // the queue cells are relinked without a write barrier too
+    if (this->queue) {
+        object* cell = this->queue;
+        do {
+            this->markobject(cell);
+            this->rescan_thread(car(cell));
+            cell = cdr(cell);
+        } while (cell != this->queue);
     }
-    return NULL;
+    if (this->failed_thread) this->rescan_thread(this->failed_thread);
 }
 
-// ---------- STACK MACHINE --------------------------------------------
+void pvm::rescan_thread(object* thread) {
+    // even if the thread is already marked, whatever was pushed since then isn't
+    this->shade(mark_thread(this, thread));
+    this->shade(thread);
+}
 
-void pvm::start_thread()  {
-    // thread is list of (data stack, next instruction, instruction stack)
-    object* new_thread = this->cons(nil, this->cons(nil, nil));
-    if (!this->queue) {
-        this->queue = this->cons(new_thread, NULL);
-        cdr(this->queue) = this->queue;
-        return;
-    }
-    object* last = this->queue;
-    // Find last element of queue
-    while (cdr(last) != this->queue) last = cdr(last);
-    this->push(new_thread, this->queue);
-    cdr(last) = this->queue;
+void pvm::grow_grey() {
+    grow_list(&this->grey, &this->grey_cap);
 }
 
-void pvm::step() {
-    next_inst:
-    if (!this->queue) return;
-    object* next_type = cadr(this->curr_thread());
-    object* op = this->pop_inst();
-    if (!op) {
-        object* last = this->queue;
-        if (cdr(last) == last) {
-            // last thread and nothing to do
-            this->queue = nil;
-            return;
+void pvm::grow_list(object*** items, size_t* cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    *items = (object**)realloc(*items, *cap * sizeof(object*));
+}
+
+bool pvm::drain_grey(uint64_t deadline) {
+    // Marking is mostly waiting for cache misses, so objects are prefetched when they come off the stack
+    // and marked gc_prefetch objects later, by which time they're hopefully in the cache
+    object* window[GC_PREFETCH_MAX];
+    size_t distance = this->gc_prefetch < GC_PREFETCH_MAX ? this->gc_prefetch : GC_PREFETCH_MAX;
+    size_t head = 0, waiting = 0, n = 0;
+    if (!distance) {
+        while (this->grey_len) {
+            this->markobject(this->grey[--this->grey_len]);
+            // looking at the clock is much slower than marking an object
+            if (deadline && !(++n & 63) && monotonic_ns() >= deadline) return !this->grey_len;
+        }
+        return true;
+    }
+    for (;;) {
+        object* o;
+        if (this->grey_len && waiting < distance) {
+            o = this->grey[--this->grey_len];
+            __builtin_prefetch(o, 1);
+            window[(head + waiting++) % GC_PREFETCH_MAX] = o;
+            continue;
+        }
+        if (!waiting) return true;
+        o = window[head];
+        head = (head + 1) % GC_PREFETCH_MAX;
+        waiting--;
+        this->markobject(o);
+        if (deadline && !(++n & 63) && monotonic_ns() >= deadline) {
+            // put the prefetched ones back for the next slice
+            while (waiting--) this->shade(window[(head + waiting) % GC_PREFETCH_MAX]);
+            return !this->grey_len;
         }
-        while (cdr(last) != this->queue) last = cdr(last);
-        // Drop the empty thread
-        this->queue = cdr(last) = cdr(this->queue);
-        goto next_inst;
     }
-    object* type = car(op);
-    if (eqcmp(type, next_type) != 0) goto next_inst;
-    object* inst_name = cadr(op);
-    object* cookie = cddr(op);
-    object* pair = assoc(this->function_registry, inst_name);
-    ASSERT(pair, "Unknown instruction %s", this->stringof(inst_name));
-    next_type = this->fptr(cdr(pair))(this, cookie, next_type);
-    cadr(this->curr_thread()) = next_type;
-    this->queue = cdr(this->queue);
 }
 
-//--------------- PARSER --------------------------------------
-
-namespace parser {
+// ----------------------- PARALLEL GC ----------------------------
 
-typedef struct {
-    const char* data;
-    size_t i;
+// one of the threads of a parallel gc(), worker 0 is the one that called it
+struct gc_worker_state {
+    pvm* vm;
+    size_t index;
+    pthread_t thread;
+    // the last job it has run
+    size_t round;
+    // the objects it still has to mark, which only it touches
+    object** stack;
     size_t len;
-} pstate;
+    size_t cap;
+    // Objects it has put up for the others to take when they run out, under lock. spare_len is also read
+    // without the lock, to see whether there's anything worth locking for.
+    pthread_mutex_t lock;
+    object** spare;
+    size_t spare_len;
+    size_t spare_cap;
+};
 
-#define pos (s->i)
-#define advance pos +=
-#define next pos++
-#define look (s->data[pos])
-#define at(z) (&s->data[z])
-#define here at(pos)
-#define eofp  (pos >= s->len)
-#define test(f) (f(look))
+// one chunk of the sweep, which a worker fills in
+struct chunk_sweep {
+    tinobsy::chunk* c;
+    // the free slots, linked through cdr
+    object* head;
+    object* tail;
+    // the marked objects, the dead ones that still have to be freed on the calling thread, and the other dead ones
+    size_t live;
+    size_t dying;
+    size_t freed;
+};
 
-static void bufadd(char** b, char c) {
-    // super not memory efficient, it reallocs the buffer every time
-    char* ob = *b;
-    asprintf(b, "%s%c", *b ? *b : "", c);
-    free(ob);
-}
+// a worker pushes half of its stack to its spare once it has this many objects and another worker is idle
+#define GC_SHARE_MIN 64
+// how many chunks a worker takes at a time when sweeping
+#define GC_SWEEP_BATCH 16
 
-static void bufcat(char** b, const char* c, int n) {
-    char* ob = *b;
-    asprintf(b, "%s%.*s", *b ? *b : "", n, c);
-    free(ob);
+struct gc_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    // the helper threads started so far (worker 1 up to threads)
+    size_t threads;
+    // the current job, which the first workers run, and how many of the helpers have finished it
+    void (*job)(pvm* vm, size_t index);
+    size_t round;
+    size_t workers;
+    size_t finished;
+    bool quit;
+    gc_worker_state worker[GC_THREADS_MAX];
+    // while marking, how many workers have nothing left to mark
+    size_t idle;
+    // while sweeping, every chunk and the first one nobody has taken yet
+    chunk_sweep* chunks;
+    size_t num_chunks;
+    size_t chunks_cap;
+    size_t next_chunk;
+
+    static gc_pool* create(pvm* vm);
+    static void destroy(gc_pool* pool);
+    // starts helper threads until there are enough for this many workers, returns how many there can be
+    size_t start_threads(size_t workers);
+    // runs the job on this thread and the first workers - 1 helpers, and waits for them all to finish
+    void run(void (*job)(pvm* vm, size_t index), size_t workers);
+    static void* helper(void* arg);
+    static void mark_job(pvm* vm, size_t index);
+    static void sweep_job(pvm* vm, size_t index);
+    // moves the bottom half of the worker's stack (the objects pushed longest ago) to its spare
+    static void share_work(gc_worker_state* w);
+    // takes everything in from's spare, returns whether there was anything
+    static bool take_work(gc_worker_state* w, gc_worker_state* from);
+    // with nothing left to mark, waits until another worker shares some, returns false once they're all waiting
+    bool wait_for_work(gc_worker_state* w);
+    static void sweep_chunk(chunk_sweep* s);
+};
+
+// the worker this thread is, while it's marking
+static thread_local gc_worker_state* marking_worker = NULL;
+
+gc_pool* gc_pool::create(pvm* vm) {
+    gc_pool* pool = (gc_pool*)calloc(1, sizeof(gc_pool));
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    for (size_t i = 0; i < GC_THREADS_MAX; i++) {
+        pool->worker[i].vm = vm;
+        pool->worker[i].index = i;
+        pthread_mutex_init(&pool->worker[i].lock, NULL);
+    }
+    return pool;
 }
 
-static char unescape(char c) {
-    switch (c) {
-        case 'b': return '\b';
-        case 't': return '\t';
-        case 'n': return '\n';
-        case 'v': return '\v';
-        case 'f': return '\f';
-        case 'r': return '\r';
-        case 'a': return '\a';
-        case 'o': return '{';
-        case 'c': return '}';
-        case '\n': return 0;
-        default: return c;
+void gc_pool::destroy(gc_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = true;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 1; i <= pool->threads; i++) pthread_join(pool->worker[i].thread, NULL);
+    for (size_t i = 0; i < GC_THREADS_MAX; i++) {
+        free(pool->worker[i].stack);
+        free(pool->worker[i].spare);
+        pthread_mutex_destroy(&pool->worker[i].lock);
     }
+    free(pool->chunks);
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->start);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
 }
 
-static char escape(char c) {
-    switch (c) {
-        case '\b': return 'b';
-        case '\t': return 't';
-        case '\n': return 'n';
-        case '\v': return 'v';
-        case '\f': return 'f';
-        case '\r': return 'r';
-        case '\a': return 'a';
-        case '{': return 'o';
-        case '}': return 'c';
-        default: return c;
+size_t gc_pool::start_threads(size_t workers) {
+    if (workers > GC_THREADS_MAX) workers = GC_THREADS_MAX;
+    pthread_mutex_lock(&this->lock);
+    while (this->threads + 1 < workers) {
+        gc_worker_state* w = &this->worker[this->threads + 1];
+        w->round = this->round;
+        if (pthread_create(&w->thread, NULL, helper, w)) {
+            DBG("Couldn't start a gc thread, collecting with %zu", this->threads + 1);
+            workers = this->threads + 1;
+            break;
+        }
+        this->threads++;
     }
+    pthread_mutex_unlock(&this->lock);
+    return workers;
 }
 
-static char revparen(char p) {
-    const char* a = "([{}])";
-    const char* b = ")]}{[(";
-    return b[strchr(a, p) - a];
+void gc_pool::run(void (*job)(pvm* vm, size_t index), size_t workers) {
+    pthread_mutex_lock(&this->lock);
+    this->job = job;
+    this->workers = workers;
+    this->finished = 0;
+    this->round++;
+    pthread_cond_broadcast(&this->start);
+    pthread_mutex_unlock(&this->lock);
+    job(this->worker[0].vm, 0);
+    pthread_mutex_lock(&this->lock);
+    while (this->finished + 1 < workers) pthread_cond_wait(&this->done, &this->lock);
+    pthread_mutex_unlock(&this->lock);
 }
 
-static object* next_token(pvm* vm, pstate* s) {
-    char c = look;
-    char* b = NULL;
-    char* b2 = NULL;
-    object* result = nil;
-    if (isalpha(c) || c == '_') {
-        DBG("symbol");
-        size_t p = pos;
-        while (!eofp && (test(isalpha) || test(isdigit) || look == '_')) next;
-        bufcat(&b, at(p), pos - p);
-        result = vm->sym(b);
-    }
-    else if (isdigit(c)) {
-        DBG("number");
-        double d; int64_t n;
-        int num;
-        int ok = sscanf(here, "%lg%n", &d, &num);
-        if (ok) result = vm->number(d);
-        else {
-            ok = sscanf(here, "%" SCNi64 "%n", &n, &num);
-            if (ok) result = vm->integer(n);
-            else result = nil; // TODO: report error, or parse bigint?
-        }
-        DBG("ok = %i", ok);
-        if (ok) advance num;
-    }
-    else if (c == '\n' || c == '\r') {
-        DBG("newline");
-        while (look == '\n' || look == '\r') next;
-        result = vm->sym("NEWLINE");
-    }
-    else if (isspace(c) && c != '\n') {
-        DBG("space");
-        size_t p = pos;
-        while (!eofp && (test(isspace) && look != '\n' && look != '\r')) next;
-        bufcat(&b, at(p), pos - p);
-        result = vm->sym(b);
-    }
-    else if (ispunct(c)) {
-        DBG("punctuation symbol");
-        // must test for other punctuation last to allow other special cases to take precedence
-        next;
-        bufadd(&b, c);
-        result = vm->sym(b);
-    }
-    else {
-        DBG("other crap: %c (%i)", c, (int)c);
-        next;
-        result = nil;
+void* gc_pool::helper(void* arg) {
+    gc_worker_state* w = (gc_worker_state*)arg;
+    gc_pool* pool = w->vm->pool;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (pool->round == w->round && !pool->quit) pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit) break;
+        w->round = pool->round;
+        if (w->index >= pool->workers) continue;
+        pthread_mutex_unlock(&pool->lock);
+        pool->job(w->vm, w->index);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished + 1 == pool->workers) pthread_cond_signal(&pool->done);
     }
-    done:
-    free(b);
-    free(b2);
-    return result;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-// Can be called by the program
-object* tokenize(pvm* vm, object* cookie, object* inst_type) {
-    (void)cookie;
-    DBG("tokenizing");
-    object* string = vm->pop();
-    if (string->type != &string_type) {
-        vm->push_data(vm->cons(vm->string("non string to tokenize()"), nil));
-        return vm->sym("error");
+void pvm::shade_parallel(object* o) {
+    // (already marked is common, and not pushing those saves a lot of stack traffic)
+    if (__atomic_load_n(&o->flags, __ATOMIC_RELAXED) & MARKBIT) return;
+    gc_worker_state* w = marking_worker;
+    if (w->len == w->cap) grow_list(&w->stack, &w->cap);
+    w->stack[w->len++] = o;
+}
+
+void gc_pool::mark_job(pvm* vm, size_t index) {
+    gc_pool* pool = vm->pool;
+    gc_worker_state* w = &pool->worker[index];
+    // the same prefetching as drain_grey()'s, the window being this worker's as much as its stack is
+    object* window[GC_PREFETCH_MAX];
+    size_t distance = vm->gc_prefetch < GC_PREFETCH_MAX ? vm->gc_prefetch : GC_PREFETCH_MAX;
+    size_t head = 0, waiting = 0;
+    marking_worker = w;
+    for (;;) {
+        object* o;
+        if (w->len && waiting < distance) {
+            o = w->stack[--w->len];
+            __builtin_prefetch(o, 1);
+            window[(head + waiting++) % GC_PREFETCH_MAX] = o;
+            continue;
+        }
+        if (waiting) {
+            o = window[head];
+            head = (head + 1) % GC_PREFETCH_MAX;
+            waiting--;
+        }
+        else if (w->len) o = w->stack[--w->len];
+        else if (take_work(w, w) || pool->wait_for_work(w)) continue;
+        else break;
+        // markobject(), except that another worker can be marking the same object, so only the one
+        // that sets the mark bit goes on to the children
+        while (o && !(__atomic_load_n(&o->flags, __ATOMIC_RELAXED) & MARKBIT)) {
+            if (__atomic_fetch_or(&o->flags, MARKBIT, __ATOMIC_RELAXED) & MARKBIT) break;
+            if (!o->type->mark) break;
+            o = o->type->mark(vm, o);
+        }
+        if (w->len >= GC_SHARE_MIN && __atomic_load_n(&pool->idle, __ATOMIC_RELAXED)
+            && !__atomic_load_n(&w->spare_len, __ATOMIC_RELAXED)) share_work(w);
     }
-    const char* str = vm->stringof(string);
-    pstate s = { .data = str, .i = 0, .len = strlen(str) };
-    object* result = nil;
-    object** tail = &result;
-    do {
-        object* item = next_token(vm, &s);
-        DBG("Got token.");
-        *tail = vm->cons(item, nil);
-        tail = &cdr(*tail);
-    } while (s.i < s.len);
-    vm->push_data(result);
-    return nil;
+    marking_worker = NULL;
 }
 
-#undef pos
-#undef advance
-#undef next
-#undef look
-#undef at
-#undef here
-#undef eofp
-#undef test
+void gc_pool::share_work(gc_worker_state* w) {
+    pthread_mutex_lock(&w->lock);
+    size_t n = w->len / 2;
+    while (w->spare_cap < n) pvm::grow_list(&w->spare, &w->spare_cap);
+    memcpy(w->spare, w->stack, n * sizeof(object*));
+    memmove(w->stack, w->stack + n, (w->len - n) * sizeof(object*));
+    w->len -= n;
+    __atomic_store_n(&w->spare_len, n, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&w->lock);
+}
 
+bool gc_pool::take_work(gc_worker_state* w, gc_worker_state* from) {
+    if (!__atomic_load_n(&from->spare_len, __ATOMIC_ACQUIRE)) return false;
+    pthread_mutex_lock(&from->lock);
+    size_t n = from->spare_len;
+    while (w->cap < w->len + n) pvm::grow_list(&w->stack, &w->cap);
+    memcpy(w->stack + w->len, from->spare, n * sizeof(object*));
+    w->len += n;
+    __atomic_store_n(&from->spare_len, 0, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&from->lock);
+    return n;
 }
 
+bool gc_pool::wait_for_work(gc_worker_state* w) {
+    // A worker only goes idle with its spare empty, and only it adds to its spare, so once every worker
+    // is idle there's nothing left anywhere. A worker stops counting as idle before it takes anything.
+    __atomic_add_fetch(&this->idle, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        if (__atomic_load_n(&this->idle, __ATOMIC_SEQ_CST) == this->workers) return false;
+        for (size_t i = 1; i < this->workers; i++) {
+            gc_worker_state* from = &this->worker[(w->index + i) % this->workers];
+            if (!__atomic_load_n(&from->spare_len, __ATOMIC_ACQUIRE)) continue;
+            __atomic_sub_fetch(&this->idle, 1, __ATOMIC_SEQ_CST);
+            if (take_work(w, from)) return true;
+            __atomic_add_fetch(&this->idle, 1, __ATOMIC_SEQ_CST);
+        }
+        sched_yield();
+    }
+}
 
-// ------------------------- HASHMAPS (OBJECTS) -------------------------------
+void gc_pool::sweep_job(pvm* vm, size_t index) {
+    gc_pool* pool = vm->pool;
+    for (;;) {
+        size_t first = __atomic_fetch_add(&pool->next_chunk, GC_SWEEP_BATCH, __ATOMIC_RELAXED);
+        if (first >= pool->num_chunks) return;
+        size_t end = first + GC_SWEEP_BATCH < pool->num_chunks ? first + GC_SWEEP_BATCH : pool->num_chunks;
+        for (size_t i = first; i < end; i++) sweep_chunk(&pool->chunks[i]);
+    }
+}
 
-namespace hashmap {
+void gc_pool::sweep_chunk(chunk_sweep* s) {
+    // Like sweep_chunks(), but the objects with a free function are left for the calling thread, with
+    // their mark bit set (the reverse of the live ones') so it can tell them apart
+    s->head = s->tail = NULL;
+    s->live = s->dying = s->freed = 0;
+    for (size_t i = 0; i < CHUNK_SIZE; i++) {
+        object* o = &s->c->d[i];
+        if (o->type) {
+            if (o->flags & MARKBIT) {
+                o->flags &= ~MARKBIT;
+                s->live++;
+                continue;
+            }
+            if (o->type->free) {
+                o->flags |= MARKBIT;
+                s->dying++;
+                continue;
+            }
+            o->type = NULL;
+            s->freed++;
+        }
+        cdr(o) = s->head;
+        if (!s->head) s->tail = o;
+        s->head = o;
+    }
+}
 
-// Returns the found node or nil if the hash is not found.
-static object* get(pvm* vm, object* map, uint64_t hash) {
-    // Each hashmap node is a 4-cons tree ((hash . (key . value)) . (left . right))
-    // but this gets printed as ((hash key . value) left . right) when the map is printed as-is
-    uint64_t hh = hash;
-    DBG("Searching hashmap for hash %" PRId64 " {", hash);
-    recurse:
-    if (!map) {
-        DBG("Node is nil -- not found. }");
-        return nil;
+void pvm::mark_parallel() {
+    if (!this->pool) this->pool = gc_pool::create(this);
+    gc_pool* pool = this->pool;
+    size_t workers = pool->start_threads(this->gc_threads);
+    // the roots go on the grey stack as usual (which gc_step() may have left objects on too), and are dealt out
+    this->mark_roots();
+    for (size_t i = 0; i < this->grey_len; i++) {
+        gc_worker_state* w = &pool->worker[i % workers];
+        if (w->len == w->cap) grow_list(&w->stack, &w->cap);
+        w->stack[w->len++] = this->grey[i];
     }
-    object* hash_pair = car(map);
-    if (hash_pair) {
-        int64_t this_hash = vm->intof(car(hash_pair));
-        DBG("this_hash=%" PRId64, this_hash);
-        if (this_hash == hash) {
-            DBG("Found matching key for hash %" PRId64 " }", hash);
-            return map;
+    this->grey_len = 0;
+    pool->idle = 0;
+    this->marking_in_parallel = true;
+    pool->run(gc_pool::mark_job, workers);
+    this->marking_in_parallel = false;
+}
+
+size_t pvm::sweep_parallel() {
+    gc_pool* pool = this->pool;
+    pool->num_chunks = 0;
+    for (tinobsy::chunk* c = this->chunks; c; c = c->next) {
+        if (pool->num_chunks == pool->chunks_cap) {
+            pool->chunks_cap = pool->chunks_cap ? pool->chunks_cap * 2 : 1024;
+            pool->chunks = (chunk_sweep*)realloc(pool->chunks, pool->chunks_cap * sizeof(chunk_sweep));
         }
+        pool->chunks[pool->num_chunks++].c = c;
     }
-    bool ll = hh & 1;
-    object* children = cdr(map);
-    if (!children) {
-        DBG("Reached node with no children -- Not found. }");
-        return nil;
-    }
-    if (ll) map = car(children);
-    else map = cdr(children);
-    hh >>= 1;
-    DBG("Recursing on %s", ll ? "LEFT" : "RIGHT");
-    goto recurse;
-}
-
-// Returns the new node, *map is updated to point to the root node if it changed.
-static object* set(pvm* vm, object** map, object* key, uint64_t hash, object* val) {
-    DBG("Setting hash %" PRId64 " on hashmap. {", hash);
-    uint64_t hh = hash;
-    object* newnode = nil;
-    recurse:
-    if (*map == nil) {
-        DBG("Tree is terminated -- add new node. }");
-        *map = vm->cons(vm->cons(vm->integer(hash), vm->cons(key, val)), nil);
-        return *map;
-    }
-    // Map is not empty at this level. Check to see if it is a free node or the target node.
-    object* hash_pair = car(*map);
-    bool ll = hh & 1;
-    object* children = cdr(*map);
-    if (!hash_pair) {
-        DBG("Found tombstoned node. Inserting key.");
-        car(*map) = vm->cons(vm->integer(hash), vm->cons(key, val));
-        newnode = *map;
-        if (!children) return newnode; // No children to search and kill
-        goto killshadow;
-    } else {
-        // Check if the hashes match
-        int64_t z = vm->intof(car(hash_pair));
-        if (z == hash) {
-            DBG("Found matching node. Re-setting it. }");
-            if (!cdr(hash_pair)) cdr(hash_pair) = vm->cons(nil, nil);
-            cadr(hash_pair) = key;
-            cddr(hash_pair) = val;
-            return *map;
-        }
-    }
-    if (!children) {
-        DBG("Reached node with no children cons. Adding children cons.");
-        cdr(*map) = children = vm->cons(nil, nil);
-    }
-    if (ll) map = &car(children);
-    else map = &cdr(children);
-    hh >>= 1;
-    DBG("Recursing on %s", ll ? "LEFT" : "RIGHT");
-    goto recurse;
-    //-------------
-    killshadow:
-    DBG("Now searching for shadower nodes in search path and killing them.");
-    if (ll) map = &car(children);
-    else map = &cdr(children);
-    hh >>= 1;
-    DBG("Continuing on %s", ll ? "LEFT" : "RIGHT");
-    killagain:
-    if ((*map) == nil) {
-        DBG("Reached end of hash path. Done killing. }");
-        return newnode;
-    }
-    hash_pair = car(*map);
-    ll = hh & 1;
-    children = cdr(*map);
-    if (hash_pair) {
-        int64_t bad = vm->intof(car(hash_pair));
-        if (bad == hash) {
-            DBG("Found shadowing node, killing it.");
-            car(*map) = nil;
-        }
-    }
-    if (children == nil) {
-        DBG("Reached node with no children. Stopping }");
-        return newnode;
-    }
-    if (ll) map = &car(children);
-    else map = &cdr(children);
-    hh >>= 1;
-    DBG("Shadow recursing on %s", ll ? "LEFT" : "RIGHT");
-    goto killagain;
-}
-
-}
-
-object* pvm::get_property(object* obj, uint64_t hash, bool recurse) {
-    // Nil has no properties
-    if (!obj) return nil;
-    if (recurse) {
-        DBG("Inheritance requested get_property() {");
-        // Try to find it directly.
-        object* val = this->get_property(obj, hash, false);
-        if (val) {
-            DBG("Own property. }");
-            return val;
+    pool->next_chunk = 0;
+    pool->run(gc_pool::sweep_job, pool->workers);
+    // then the part that isn't safe to share: the free functions, and putting the chunks and free slots back together
+    size_t freed = 0;
+    this->freelist = NULL;
+    tinobsy::chunk** link = &this->chunks;
+    for (size_t i = 0; i < pool->num_chunks; i++) {
+        chunk_sweep* s = &pool->chunks[i];
+        freed += s->freed + s->dying;
+        this->freespace += s->freed + s->dying;
+        for (size_t j = 0; s->dying && j < CHUNK_SIZE; j++) {
+            object* o = &s->c->d[j];
+            if (!o->type || !(o->flags & MARKBIT)) continue;
+            o->type->free(o);
+            o->type = NULL;
+            o->flags &= ~MARKBIT;
+            if (!s->live) continue;
+            cdr(o) = this->freelist;
+            this->freelist = o;
         }
-        // Not found, traverse prototypes list.
-        for (object* p = car(obj); p; p = cdr(p)) {
-            val = this->get_property(car(p), hash, true);
-            if (val) {
-                DBG("Parent property. }");
-                return val;
-            }
+        if (!s->live) {
+            delete s->c;
+            this->freespace -= CHUNK_SIZE;
+            continue;
+        }
+        *link = s->c;
+        link = &s->c->next;
+        if (s->head) {
+            cdr(s->tail) = this->freelist;
+            this->freelist = s->head;
         }
-        DBG("Property not found in inheritance tree. }");
-        return nil;
     }
-    // Check if it is an object-object (primitives have no own properties)
-    if (obj->type != &obj_type) return nil;
-    // Search the hashmap.
-    object* hashmap = cdr(obj);
-    object* node = hashmap::get(this, hashmap, hash);
-    if (node) return cddar(node);
-    return nil;
+    *link = NULL;
+    return freed;
 }
 
-bool pvm::set_property(object* obj, object* key, uint64_t hash, object* value) {
-    // Nil has no properties
-    if (!obj) return false;
-    // Check if it is an object-object (primitives have no own properties)
-    if (obj->type != &obj_type) return false;
-    hashmap::set(this, &cdr(obj), key, hash, value);
-    return true;
+pvm::pvm() {
+    tinobsy::vm();
+    // the SipHash key, which is all that stops colliding keys from being precomputed
+    if (!random_bytes(this->hash_key, sizeof(this->hash_key))) {
+        DBG("No kernel randomness, the hash key is guessable");
+        this->hash_key[0] = monotonic_ns() ^ (uintptr_t)this;
+        this->hash_key[1] = (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+    }
+    this->clear_lookup_cache();
+    memset(this->property_epochs, 0, sizeof(this->property_epochs));
+    this->intern_tables[NOT_INTERNED] = NULL;
+    this->intern_tables[INTERNED_SYMBOLS] = &this->interned_symbols;
+    this->intern_tables[INTERNED_STRINGS] = &this->interned_strings;
+    this->intern_tables[INTERNED_INTS] = &this->interned_ints;
+    this->intern_tables[INTERNED_FLOATS] = &this->interned_floats;
+    this->intern_tables[INTERNED_FUNCS] = &this->interned_funcs;
+    this->intern_tables[INTERNED_BIGINTS] = &this->interned_bigints;
+    STATS(
+        this->interned_symbols.counts = &this->stats.symbols;
+        this->interned_strings.counts = &this->stats.strings;
+        this->interned_ints.counts = &this->stats.ints;
+        this->interned_floats.counts = &this->stats.floats;
+        this->interned_funcs.counts = &this->stats.funcs;
+        this->interned_bigints.counts = &this->stats.bigints;
+    )
+    for (int64_t i = SMALL_INT_MIN; i <= SMALL_INT_MAX; i++) {
+        object* o = this->alloc(&integer_type);
+        o->as_big_int = i;
+        this->small_ints[i - SMALL_INT_MIN] = o;
+    }
 }
 
-bool pvm::remove_property(object* obj, uint64_t hash) {
-    // Nil has no properties
-    if (!obj) return false;
-    // Check if it is an object-object (primitives have no own properties)
-    if (obj->type != &obj_type) return false;
-    bool had = hashmap::get(this, cdr(obj), hash) != nil;
-    // Try to set the node to nil, which will kill the shadow references
-    object* node = hashmap::set(this, &cdr(obj), nil, hash, nil);
-    // Then kill this node too
-    ASSERT(node, "hashmap_set() failed");
-    car(node) = nil;
-    return had;
+pvm::~pvm() {
+    this->stop_profile();
+    this->clear_profile();
+    free(this->profile);
+    // Sweep everything now, while the intern tables and the arena the payloads are in are still there
+    this->queue = this->queue_tail = this->parked = this->failed_thread = nil;
+    this->globals = this->function_registry = this->patterns = nil;
+    memset(this->small_ints, 0, sizeof(this->small_ints));
+    // If gc_step() is in the middle of a collection, the objects it has already marked would survive the sweep
+    // and be freed by tinobsy after the arena is gone. Abandoning it and sweeping once unmarks them all.
+    if (this->gc_marking) {
+        this->gc_marking = false;
+        this->grey_len = 0;
+        this->gc();
+    }
+    this->gc();
+    if (this->pool) gc_pool::destroy(this->pool);
+    free(this->opcodes);
+    free(this->interned_symbols.slots);
+    free(this->interned_strings.slots);
+    free(this->interned_ints.slots);
+    free(this->interned_floats.slots);
+    free(this->interned_funcs.slots);
+    free(this->interned_bigints.slots);
+    free(this->grey);
+    free(this->young);
+    free(this->remembered);
 }
 
-// ------------------ PATTERN MATCHING -----------------------------
+// ----------------------- PAYLOAD ARENA ----------------------------
 
-static object* get_best_match(pvm* vm, object* ast, object** env) {
-    return nil;
-}
+// at the start of every slab (and every big block), blocks start right after it
+struct arena_slab {
+    arena* owner;
+    // in the owner's partial, empty or released list
+    arena_slab* next;
+    arena_slab* prev;
+    void* free_blocks;
+    // the part of the slab that has never been handed out
+    char* unused;
+    // ARENA_CLASSES for a big block
+    uint32_t size_class;
+    uint32_t used;
+    uint32_t capacity;
+    // big blocks: the size asked for
+    size_t size;
+};
 
-// Eval(list) ::= apply_first_pattern(list), then eval(remaining list), else list if no patterns match
-object* eval(pvm* vm, object* cookie, object* inst_type) {
-    // object* ast = car(args);
-    // // returns Match object: 0=pattern, 1=handler body, 2=match details for splice; and updates env with bindings
-    // object* oldenv = env;
-    // object* matched_pattern = get_best_match(vm, ast, &env);
-    // if (matched_pattern != NULL) {
-    //     // do next is run body --> cont=apply match cont-> eval again -> original eval cont
-    //     vm->do_later(vm->make_partial(
-    //         NULL,//matched_pattern->body(),
-    //         NULL,
-    //         env,
-    //         vm->make_partial(
-    //             vm->wrap_func(funcs::splice_match),
-    //             vm->list(2, vm->append(ast, NULL), NULL/*matched_pattern->match_info()*/),
-    //             oldenv,
-    //             vm->make_partial(
-    //                 vm->wrap_func(funcs::eval),
-    //                 NULL,
-    //                 oldenv,
-    //                 cont,
-    //                 fail_cont
-    //             ),
-    //             fail_cont
-    //         ),
-    //         fail_cont
-    //     ));
-    // } else {
-    //     // No matches so return unchanged
-    //     vm->set_retval(vm->list(1, ast), env, cont, fail_cont);
-    // }
-    return nil;
+#define SLAB_HEADER 64
+// the header's page is kept when the rest of an empty slab is given back
+#define SLAB_KEPT_PAGE 4096
+
+static const uint32_t class_sizes[ARENA_CLASSES] = { 16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048, 3072, 4096 };
+
+static inline unsigned class_for(size_t size) {
+    unsigned c = 0;
+    while (class_sizes[c] < size) c++;
+    return c;
 }
 
-object* splice_match(pvm* vm, object* cookie, object* inst_type) {
-    // TODO(sm);
-    return nil;
+static inline arena_slab* slab_of(void* block) {
+    return (arena_slab*)((uintptr_t)block & ~(uintptr_t)(ARENA_SLAB_SIZE - 1));
 }
 
-// ------------------- Circular-reference-proof object dumper -----------------------
-// ---------- (based on https://stackoverflow.com/a/78169673/23626926) --------------
+arena::arena() {
+    memset(this->partial, 0, sizeof(this->partial));
+}
 
-namespace dumper {
+arena::~arena() {
+    for (size_t i = 0; i < this->num_segments; i++) munmap(this->segments[i].base, this->segments[i].size);
+    free(this->segments);
+}
 
-static void make_refs_list(pvm* vm, object* obj, object** alist) {
-    for (;;) {
-        if (obj == NULL || (obj->type != &cons_type && obj->type != &obj_type)) return;
-        object* entry = assoc(*alist, obj);
-        if (entry) {
-            cdr(entry) = vm->integer(2);
-            return;
-        }
-        vm->push(vm->cons(obj, vm->integer(1)), *alist);
-        if (obj->type != &obj_type) make_refs_list(vm, car(obj), alist); // hashmaps are guaranteed non disjoint, i guess
-        obj = cdr(obj);
-    }
+void arena::map_segment() {
+    size_t size = this->segment_slabs * ARENA_SLAB_SIZE;
+    // map one slab extra and trim it off, so the slabs are aligned
+    char* raw = (char*)mmap(NULL, size + ARENA_SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ASSERT(raw != MAP_FAILED, "out of memory for arena segment");
+    char* base = (char*)(((uintptr_t)raw + ARENA_SLAB_SIZE - 1) & ~(uintptr_t)(ARENA_SLAB_SIZE - 1));
+    if (base > raw) munmap(raw, base - raw);
+    munmap(base + size, raw + ARENA_SLAB_SIZE - base);
+    #ifdef MADV_HUGEPAGE
+    if (this->huge_pages) madvise(base, size, MADV_HUGEPAGE);
+    #endif
+    this->segments = (segment*)realloc(this->segments, (this->num_segments + 1) * sizeof(segment));
+    this->segments[this->num_segments].base = base;
+    this->segments[this->num_segments].size = size;
+    this->num_segments++;
+    this->bytes_mapped += size;
+    this->next_slab = base;
+    this->slabs_left = this->segment_slabs;
+    // fewer, bigger mappings the more the heap grows
+    if (this->segment_slabs < ARENA_MAX_SEGMENT) this->segment_slabs *= 2;
 }
 
-// returns zero if the object doesn't need a #N# marker
-// otherwise returns N (negative if not first time)
-static int64_t reffed(pvm* vm, object* obj, object* alist, int64_t* counter) {
-    object* entry = assoc(alist, obj);
-    if (entry) {
-        int64_t value = vm->intof(cdr(entry));
-        if (value < 0) {
-            // seen already
-            return value;
-        }
-        if (value > 1) {
-            // object with shared structure but no id yet
-            // assign id
-            int64_t my_id = (*counter)++;
-            // store entry
-            cdr(entry) = vm->integer(-my_id);
-            return my_id;
-        }
+arena_slab* arena::new_slab(unsigned size_class) {
+    arena_slab* s;
+    if (this->empty) {
+        s = this->empty;
+        this->empty = s->next;
+        this->num_empty--;
+    } else if (this->released) {
+        // its pages come back (zeroed) as they are touched
+        s = this->released;
+        this->released = s->next;
+    } else {
+        if (!this->slabs_left) this->map_segment();
+        s = (arena_slab*)this->next_slab;
+        this->next_slab += ARENA_SLAB_SIZE;
+        this->slabs_left--;
     }
-    return 0;
+    s->owner = this;
+    s->free_blocks = NULL;
+    s->unused = (char*)s + SLAB_HEADER;
+    s->size_class = size_class;
+    s->used = 0;
+    s->capacity = (ARENA_SLAB_SIZE - SLAB_HEADER) / class_sizes[size_class];
+    s->prev = NULL;
+    s->next = this->partial[size_class];
+    if (s->next) s->next->prev = s;
+    this->partial[size_class] = s;
+    this->slabs_in_use++;
+    return s;
 }
 
-static void print_with_refs(pvm*, object*, object*, int64_t*);
+void arena::unlink(arena_slab* s) {
+    if (s->prev) s->prev->next = s->next;
+    else this->partial[s->size_class] = s->next;
+    if (s->next) s->next->prev = s->prev;
+}
 
-static void print_hashmap(pvm* vm, object* node, object* alist, int64_t* counter) {
-    while (node) {
-        if (car(node)) {
-            object* hinfo = car(node);
-            print_with_refs(vm, cadr(hinfo), alist, counter);
-            printf(" -> ");
-            print_with_refs(vm, cddr(hinfo), alist, counter);
-            printf(" ;[hash=%" PRId64 "] ", vm->intof(car(hinfo)));
-        }
-        if (!cdr(node)) return;
-        print_hashmap(vm, cadr(node), alist, counter);
-        node = cddr(node);
+void* arena::alloc(size_t size) {
+    if (size > ARENA_MAX_SMALL) {
+        void* raw;
+        if (posix_memalign(&raw, ARENA_SLAB_SIZE, SLAB_HEADER + size)) ASSERT(0, "out of memory");
+        arena_slab* s = (arena_slab*)raw;
+        s->owner = this;
+        s->size_class = ARENA_CLASSES;
+        s->size = size;
+        this->bytes_in_use += size;
+        this->blocks_in_use++;
+        return (char*)s + SLAB_HEADER;
+    }
+    unsigned c = class_for(size);
+    arena_slab* s = this->partial[c];
+    if (!s) s = this->new_slab(c);
+    void* block;
+    if (s->free_blocks) {
+        block = s->free_blocks;
+        s->free_blocks = *(void**)block;
+    } else {
+        block = s->unused;
+        s->unused += class_sizes[c];
     }
+    if (++s->used == s->capacity) this->unlink(s);
+    this->bytes_in_use += class_sizes[c];
+    this->blocks_in_use++;
+    return block;
 }
 
-static void print_with_refs(pvm* vm, object* obj, object* alist, int64_t* counter) {
-    if (obj == nil) {
-        printf("NIL");
-        return;
+void* arena::resize(void* block, size_t size) {
+    if (!block) return this->alloc(size);
+    arena_slab* s = slab_of(block);
+    size_t old_size = s->size_class == ARENA_CLASSES ? s->size : class_sizes[s->size_class];
+    if (size <= old_size && (s->size_class == ARENA_CLASSES ? size > ARENA_MAX_SMALL : class_for(size) == s->size_class)) {
+        return block;
     }
-    // test if it's in the table
-    int64_t ref = reffed(vm, obj, alist, counter);
-    if (ref < 0) {
-        printf("#%" PRId64 "#", -ref);
+    void* moved = s->owner->alloc(size);
+    memcpy(moved, block, size < old_size ? size : old_size);
+    release(block);
+    return moved;
+}
+
+void arena::release(void* block) {
+    if (!block) return;
+    arena_slab* s = slab_of(block);
+    arena* a = s->owner;
+    a->blocks_in_use--;
+    if (s->size_class == ARENA_CLASSES) {
+        a->bytes_in_use -= s->size;
+        free(s);
         return;
     }
-    if (ref) {
-        printf("#%" PRId64 "=", ref);
+    a->bytes_in_use -= class_sizes[s->size_class];
+    *(void**)block = s->free_blocks;
+    s->free_blocks = block;
+    if (s->used-- == s->capacity) {
+        // it was full, so it wasn't in the partial list
+        s->prev = NULL;
+        s->next = a->partial[s->size_class];
+        if (s->next) s->next->prev = s;
+        a->partial[s->size_class] = s;
     }
-    #define PRINTTYPE(t, f, fmt) else if (obj->type == t) printf(fmt, obj->f)
-    if (obj->type == &string_type) {
-        putchar('"');
-        for (char* c = obj->as_chars; *c; c++) {
-            char e = parser::escape(*c);
-            if (e != *c) putchar('\\');
-            putchar(e);
-        }
-        putchar('"');
-    }
-    PRINTTYPE(&symbol_type, as_chars, strpbrk(obj->as_chars, "(){}[] ") ? "#|%s|" : ":%s");
-    PRINTTYPE(&integer_type, as_big_int, "%" PRId64);
-    PRINTTYPE(&float_type, as_double, "%lg");
-    PRINTTYPE(&c_function_type, as_ptr, "<function %p>");
-    PRINTTYPE(NULL, as_ptr, "<garbage %p>");
-    #undef PRINTTYPE
-    else if (obj->type == &cons_type) {
-        // it's a cons and unreffed
-        // now print the object
-        putchar('(');
-        for (;;) {
-            print_with_refs(vm, car(obj), alist, counter);
-            obj = cdr(obj);
-            int64_t ref = reffed(vm, obj, alist, counter);
-            if (ref) {
-                if (ref > 0) {
-                    // reset the ref so it will print properly
-                    cdr(assoc(alist, obj)) = vm->integer(ref);
-                    (*counter)--;
-                }
-                break;
-            }
-            if (obj && obj->type == &cons_type) putchar(' ');
-            else break;
-        }
-        if (obj) {
-            printf(" . ");
-            print_with_refs(vm, obj, alist, counter);
-        }
-        putchar(')');
+    if (!s->used) a->slab_emptied(s);
+}
+
+void arena::slab_emptied(arena_slab* s) {
+    this->unlink(s);
+    this->slabs_in_use--;
+    s->next = this->empty;
+    this->empty = s;
+    this->num_empty++;
+    if (this->num_empty <= this->keep_empty) return;
+    // Give back the pages of all but half of them. The newest empty ones are kept since they're
+    // the most likely to still be in the cache.
+    arena_slab* keep = this->empty;
+    for (size_t i = 1; i < this->keep_empty / 2 && keep; i++) keep = keep->next;
+    arena_slab* rest = keep ? keep->next : this->empty;
+    if (keep) keep->next = NULL;
+    else this->empty = NULL;
+    while (rest) {
+        arena_slab* next = rest->next;
+        madvise((char*)rest + SLAB_KEPT_PAGE, ARENA_SLAB_SIZE - SLAB_KEPT_PAGE, MADV_DONTNEED);
+        rest->next = this->released;
+        this->released = rest;
+        this->slabs_released++;
+        this->num_empty--;
+        rest = next;
     }
-    else if (obj->type == &obj_type) {
-        // Try to find the class name
-        // TODO: String/symbol/int static hash.
-        const char* nm = "object";
-        // if (car(obj) && car(car(obj))) {
-        //     object* super = car(car(obj));
-        //     object* name = vm->get_property(super, vm->static_hash(vm->string("__name__")));
-        //     if (name->type == &symbol_type) nm = vm->stringof(name);
-        // }
-        printf("%s{ ", nm);
-        print_hashmap(vm, cdr(obj), alist, counter);
-        putchar('}');
+}
+
+#undef SLAB_HEADER
+#undef SLAB_KEPT_PAGE
+
+// ----------------------- INTERN TABLES ----------------------------
+
+// marks a slot whose object was swept, so probing continues past it
+static char tombstone_marker;
+#define TOMBSTONE ((object*)&tombstone_marker)
+
+// final mixer from MurmurHash3
+static inline uint64_t fmix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+#define ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL(v1, 13); v1 ^= v0; v0 = ROTL(v0, 32); \
+    v2 += v3; v3 = ROTL(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL(v1, 17); v1 ^= v2; v2 = ROTL(v2, 32); \
+} while (0)
+
+uint64_t pvm::hash_bytes(const void* data, size_t len) {
+    // SipHash-1-3, like CPython uses: keyed, so colliding keys can't be precomputed without the key
+    uint64_t k0 = this->hash_key[0], k1 = this->hash_key[1];
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+    const unsigned char* in = (const unsigned char*)data;
+    uint64_t b = (uint64_t)len << 56;
+    for (; len >= 8; in += 8, len -= 8) {
+        uint64_t m;
+        memcpy(&m, in, 8);
+        v3 ^= m;
+        SIPROUND;
+        v0 ^= m;
     }
-    else printf("<%s: %p>", obj->type->name, obj->as_ptr);
+    for (size_t i = 0; i < len; i++) b |= (uint64_t)in[i] << (8 * i);
+    v3 ^= b;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
 }
 
+#undef SIPROUND
+#undef ROTL
+
+uint64_t pvm::hash_int(uint64_t x) {
+    return fmix64(x ^ this->hash_key[0]);
 }
 
-void pvm::dump(object* obj) {
-    object* alist = NULL;
-    int64_t counter = 1;
-    dumper::make_refs_list(this, obj, &alist);
-    dumper::print_with_refs(this, obj, alist, &counter);
+// strings and symbols have their hash stored in front of their chars
+static inline uint64_t& cached_hash(object* o) {
+    return STRING_HEADER(o)->hash;
+}
+
+char* pvm::copy_chars(const char* chs, size_t len, uint64_t hash) {
+    string_header* h = (string_header*)this->payloads.alloc(sizeof(string_header) + len + 1);
+    h->hash = hash;
+    h->len = len;
+    char* chars = (char*)(h + 1);
+    memcpy(chars, chs, len);
+    chars[len] = 0;
+    return chars;
 }
 
+uint64_t pvm::hash(object* key) {
+    if (!key) return this->hash_int(0);
+    return type_of(key)->hash(this, key);
+}
 
-size_t pvm::gc() {
-    DBG("TODO: garbage collect all of the unused hashmap nodes");
-    return tinobsy::vm::gc();
+void pvm::intern_reserve(intern_table& t) {
+    // keep the load (including tombstones) under 3/4
+    if ((t.used + 1) * 4 <= t.capacity * 3) return;
+    size_t old_capacity = t.capacity;
+    object** old_slots = t.slots;
+    // only grow if it is mostly live objects, otherwise just sweep out the tombstones
+    if (!old_capacity) t.capacity = 64;
+    else if (t.live * 2 >= old_capacity) t.capacity = old_capacity * 2;
+    t.slots = (object**)calloc(t.capacity, sizeof(object*));
+    DBG("Rehashing intern table to %zu slots", t.capacity);
+    for (size_t i = 0; i < old_capacity; i++) {
+        object* o = old_slots[i];
+        if (!o || o == TOMBSTONE) continue;
+        size_t j = this->hash(o) & (t.capacity - 1);
+        while (t.slots[j]) j = (j + 1) & (t.capacity - 1);
+        t.slots[j] = o;
+    }
+    t.used = t.live;
+    free(old_slots);
+}
+
+// tombstones are never reused, intern_reserve() clears them out when they pile up
+#define PROBE(t, hash, match) do { \
+    this->intern_reserve(t); \
+    size_t mask = t.capacity - 1; \
+    for (size_t i = hash & mask;; i = (i + 1) & mask) { \
+        object* o = t.slots[i]; \
+        if (!o) { \
+            STATS(t.counts->misses++;) \
+            return &t.slots[i]; \
+        } \
+        if (o != TOMBSTONE && (match)) { \
+            STATS(t.counts->hits++;) \
+            return &t.slots[i]; \
+        } \
+    } \
+} while (0)
+
+object** pvm::intern_lookup(intern_table& t, uint64_t hash, const char* chs, size_t len) {
+    PROBE(t, hash, cached_hash(o) == hash && STRING_HEADER(o)->len == len && !memcmp(o->as_chars, chs, len));
+}
+
+object** pvm::intern_lookup(intern_table& t, uint64_t hash, int64_t x) {
+    PROBE(t, hash, o->as_big_int == x);
+}
+
+object** pvm::intern_lookup(intern_table& t, uint64_t hash, void* ptr) {
+    PROBE(t, hash, o->as_ptr == ptr);
+}
+
+object** pvm::intern_lookup(intern_table& t, uint64_t hash, const uint32_t* limbs, size_t len, bool neg) {
+    #define N ((bignum::num*)o->as_ptr)
+    PROBE(t, hash, N->len == len && N->neg == neg && !memcmp(N->limbs, limbs, len * sizeof(uint32_t)));
+    #undef N
+}
+
+uint64_t pvm::bigint_hash(const uint32_t* limbs, size_t len, bool neg) {
+    return this->hash_bytes(limbs, len * sizeof(uint32_t)) ^ neg;
+}
+
+#undef PROBE
+
+void pvm::intern_insert(intern_table& t, object** slot, object* o) {
+    ASSERT(*slot == NULL);
+    *slot = o;
+    t.used++;
+    t.live++;
+}
+
+void pvm::unintern(object* o) {
+    intern_table* t = this->intern_tables[type_of(o)->intern_index];
+    if (!t || !t->capacity) return;
+    // only the slot's pointer is compared, other entries may already have been swept
+    size_t mask = t->capacity - 1;
+    for (size_t i = this->hash(o) & mask; t->slots[i]; i = (i + 1) & mask) {
+        if (t->slots[i] == o) {
+            t->slots[i] = TOMBSTONE;
+            t->live--;
+            return;
+        }
+    }
+}
+
+void pvm::drop_unmarked_interns() {
+    for (size_t k = 0; k < NUM_INTERN_TABLES; k++) {
+        intern_table* t = this->intern_tables[k];
+        if (!t) continue;
+        for (size_t i = 0; i < t->capacity; i++) {
+            object* o = t->slots[i];
+            if (!o || o == TOMBSTONE || (o->flags & MARKBIT)) continue;
+            t->slots[i] = TOMBSTONE;
+            t->live--;
+        }
+    }
+}
+
+#undef TOMBSTONE
+
+// ----------------------- BIGINTS ----------------------------
+
+namespace bignum {
+
+// below this many limbs, the extra additions in Karatsuba cost more than they save
+#define KARATSUBA_CUTOFF 40
+// below this many decimal digits, parsing one 9-digit group at a time beats splitting
+#define PARSE_CUTOFF 1000
+// below this many limbs, printing 9 digits at a time beats splitting
+#define PRINT_CUTOFF 60
+
+static inline size_t trim(const uint32_t* a, size_t n) {
+    while (n && !a[n - 1]) n--;
+    return n;
+}
+
+static int compare_mag(const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    if (an != bn) return an < bn ? -1 : 1;
+    while (an--) if (a[an] != b[an]) return a[an] < b[an] ? -1 : 1;
+    return 0;
+}
+
+// r = a + b, r has room for max(an, bn) + 1 limbs; returns that length
+static size_t add_mag(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
+    }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < bn; i++, carry >>= 32) r[i] = (uint32_t)(carry += (uint64_t)a[i] + b[i]);
+    for (; i < an; i++, carry >>= 32) r[i] = (uint32_t)(carry += a[i]);
+    r[i] = (uint32_t)carry;
+    return an + 1;
+}
+
+// r = a - b, requires a >= b; r has room for an limbs and may be a
+static void sub_mag(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    int64_t borrow = 0;
+    size_t i = 0;
+    for (; i < bn; i++) {
+        int64_t t = (int64_t)a[i] - b[i] - borrow;
+        r[i] = (uint32_t)t;
+        borrow = t < 0;
+    }
+    for (; i < an; i++) {
+        int64_t t = (int64_t)a[i] - borrow;
+        r[i] = (uint32_t)t;
+        borrow = t < 0;
+    }
+}
+
+// x += y, the carry out stops at the end of x
+static void add_into(uint32_t* x, size_t xn, const uint32_t* y, size_t yn) {
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < yn; i++, carry >>= 32) x[i] = (uint32_t)(carry += (uint64_t)x[i] + y[i]);
+    for (; carry && i < xn; i++, carry >>= 32) x[i] = (uint32_t)(carry += x[i]);
+}
+
+static void mul_schoolbook(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    memset(r, 0, (an + bn) * sizeof(uint32_t));
+    for (size_t i = 0; i < an; i++) {
+        uint64_t ai = a[i], carry = 0;
+        if (!ai) continue;
+        for (size_t j = 0; j < bn; j++, carry >>= 32) r[i + j] = (uint32_t)(carry += ai * b[j] + r[i + j]);
+        r[i + bn] = (uint32_t)carry;
+    }
+}
+
+// r = a * b, r has room for an + bn limbs and doesn't overlap a or b (which must not be empty)
+static void mul_mag(uint32_t* r, const uint32_t* a, size_t an, const uint32_t* b, size_t bn) {
+    if (an < bn) {
+        const uint32_t* t = a; a = b; b = t;
+        size_t tn = an; an = bn; bn = tn;
+    }
+    if (bn < KARATSUBA_CUTOFF) {
+        mul_schoolbook(r, a, an, b, bn);
+        return;
+    }
+    if (an >= 2 * bn) {
+        // lopsided, so multiply b by bn-limb slices of a
+        memset(r, 0, (an + bn) * sizeof(uint32_t));
+        uint32_t* t = (uint32_t*)malloc(2 * bn * sizeof(uint32_t));
+        for (size_t off = 0; off < an; off += bn) {
+            size_t n = an - off < bn ? an - off : bn;
+            mul_mag(t, a + off, n, b, bn);
+            add_into(r + off, an + bn - off, t, n + bn);
+        }
+        free(t);
+        return;
+    }
+    // Karatsuba: with a = a1*B^m + a0 and b = b1*B^m + b0,
+    // a*b = z2*B^2m + ((a0 + a1)*(b0 + b1) - z2 - z0)*B^m + z0 where z2 = a1*b1 and z0 = a0*b0
+    // (m <= bn/2 < bn so b1 is never empty)
+    size_t m = an / 2;
+    mul_mag(r, a, m, b, m);
+    mul_mag(r + 2 * m, a + m, an - m, b + m, bn - m);
+    size_t sn = an - m + 1, tn = (m > bn - m ? m : bn - m) + 1;
+    uint32_t* s = (uint32_t*)malloc(2 * (sn + tn) * sizeof(uint32_t));
+    uint32_t* t = s + sn;
+    uint32_t* z1 = t + tn;
+    add_mag(s, a, m, a + m, an - m);
+    add_mag(t, b, m, b + m, bn - m);
+    sn = trim(s, sn);
+    tn = trim(t, tn);
+    size_t zn = sn && tn ? sn + tn : 0;
+    if (zn) mul_mag(z1, s, sn, t, tn);
+    sub_mag(z1, z1, zn, r, trim(r, 2 * m));
+    sub_mag(z1, z1, zn, r + 2 * m, trim(r + 2 * m, an + bn - 2 * m));
+    add_into(r + m, an + bn - m, z1, trim(z1, zn));
+    free(s);
+}
+
+// a = a * m + add in place, a has room for one more limb; returns the new length
+static size_t mul_small_add(uint32_t* a, size_t n, uint32_t m, uint32_t add) {
+    uint64_t carry = add;
+    for (size_t i = 0; i < n; i++, carry >>= 32) a[i] = (uint32_t)(carry += (uint64_t)a[i] * m);
+    if (carry) a[n++] = (uint32_t)carry;
+    return n;
+}
+
+// a = a / 10^9 in place, returns the remainder (the constant lets the compiler divide with a multiply)
+static uint32_t divmod_billion(uint32_t* a, size_t n) {
+    uint64_t rem = 0;
+    while (n--) {
+        uint64_t cur = (rem << 32) | a[n];
+        a[n] = (uint32_t)(cur / 1000000000);
+        rem = cur % 1000000000;
+    }
+    return (uint32_t)rem;
+}
+
+// 10^(9 * 2^i), filled in as they are needed
+struct powers {
+    uint32_t* limbs[64];
+    size_t len[64];
+};
+
+static void power_of_ten(powers* p, size_t level) {
+    for (size_t i = 0; i <= level; i++) {
+        if (p->limbs[i]) continue;
+        if (!i) {
+            p->limbs[0] = (uint32_t*)malloc(sizeof(uint32_t));
+            p->limbs[0][0] = 1000000000;
+            p->len[0] = 1;
+            continue;
+        }
+        size_t n = p->len[i - 1];
+        p->limbs[i] = (uint32_t*)malloc(2 * n * sizeof(uint32_t));
+        mul_mag(p->limbs[i], p->limbs[i - 1], n, p->limbs[i - 1], n);
+        p->len[i] = trim(p->limbs[i], 2 * n);
+    }
+}
+
+// Parses the decimal digits into r (which has room for len / 9 + 2 limbs), returning the length.
+// Long runs are split in two so the halves are joined with one big (Karatsuba) multiply.
+static size_t from_decimal(const char* s, size_t len, uint32_t* r, powers* p) {
+    if (len <= PARSE_CUTOFF) {
+        size_t n = 0;
+        for (size_t i = 0, group = len % 9 ? len % 9 : 9; i < len; i += group, group = 9) {
+            uint32_t g = 0, scale = 1;
+            for (size_t j = 0; j < group; j++) g = g * 10 + (s[i + j] - '0'), scale *= 10;
+            n = mul_small_add(r, n, scale, g);
+        }
+        return n;
+    }
+    // the low part gets the biggest power-of-2 number of groups that is less than all of them
+    size_t level = 0;
+    while ((size_t)9 << (level + 1) < len) level++;
+    size_t low = (size_t)9 << level;
+    power_of_ten(p, level);
+    uint32_t* hi = (uint32_t*)malloc(((len - low) / 9 + 2) * sizeof(uint32_t));
+    size_t hn = from_decimal(s, len - low, hi, p);
+    size_t ln = from_decimal(s + len - low, low, r, p);
+    size_t rn = len / 9 + 2;
+    memset(r + ln, 0, (rn - ln) * sizeof(uint32_t));
+    if (hn) {
+        size_t pn = p->len[level];
+        uint32_t* t = (uint32_t*)malloc((hn + pn) * sizeof(uint32_t));
+        mul_mag(t, hi, hn, p->limbs[level], pn);
+        add_into(r, rn, t, trim(t, hn + pn));
+        free(t);
+    }
+    free(hi);
+    return trim(r, rn);
+}
+
+// q = u / v and u = u % v, for un >= vn >= 2 (Knuth's algorithm D, as in Hacker's Delight).
+// q has room for un - vn + 1 limbs.
+static void divmod_mag(uint32_t* q, uint32_t* u, size_t un, const uint32_t* v, size_t vn) {
+    // shift so the top limb of v has its high bit set, which makes the estimated quotient digits off by at most 2
+    int s = __builtin_clz(v[vn - 1]);
+    uint32_t* vs = (uint32_t*)malloc((vn + un + 1) * sizeof(uint32_t));
+    uint32_t* us = vs + vn;
+    for (size_t i = vn - 1; i > 0; i--) vs[i] = (v[i] << s) | (uint32_t)((uint64_t)v[i - 1] >> (32 - s));
+    vs[0] = v[0] << s;
+    us[un] = (uint32_t)((uint64_t)u[un - 1] >> (32 - s));
+    for (size_t i = un - 1; i > 0; i--) us[i] = (u[i] << s) | (uint32_t)((uint64_t)u[i - 1] >> (32 - s));
+    us[0] = u[0] << s;
+    for (size_t j = un - vn + 1; j--;) {
+        uint64_t num = ((uint64_t)us[j + vn] << 32) | us[j + vn - 1];
+        uint64_t qhat = num / vs[vn - 1], rhat = num % vs[vn - 1];
+        while (qhat >> 32 || qhat * vs[vn - 2] > ((rhat << 32) | us[j + vn - 2])) {
+            qhat--;
+            rhat += vs[vn - 1];
+            if (rhat >> 32) break;
+        }
+        // us[j..j+vn] -= qhat * vs
+        int64_t borrow = 0, t;
+        for (size_t i = 0; i < vn; i++) {
+            uint64_t p = qhat * vs[i];
+            t = (int64_t)us[i + j] - borrow - (int64_t)(p & 0xFFFFFFFF);
+            us[i + j] = (uint32_t)t;
+            borrow = (int64_t)(p >> 32) - (t >> 32);
+        }
+        t = (int64_t)us[j + vn] - borrow;
+        us[j + vn] = (uint32_t)t;
+        q[j] = (uint32_t)qhat;
+        if (t < 0) {
+            // qhat was one too big, add v back
+            q[j]--;
+            uint64_t carry = 0;
+            for (size_t i = 0; i < vn; i++, carry >>= 32) us[i + j] = (uint32_t)(carry += (uint64_t)us[i + j] + vs[i]);
+            us[j + vn] += (uint32_t)carry;
+        }
+    }
+    for (size_t i = 0; i < vn; i++) u[i] = (us[i] >> s) | (uint32_t)((uint64_t)us[i + 1] << (32 - s));
+    for (size_t i = vn; i < un; i++) u[i] = 0;
+    free(vs);
+}
+
+// Fills groups[0..width) with the base 10^9 digits of a (least significant first), destroying a.
+// Big numbers are split in two by dividing by 10^(9 * 2^k) so the halves are converted separately,
+// which turns most of the work into long division instead of one limb-at-a-time pass per 9 digits.
+static void to_groups(uint32_t* a, size_t n, uint32_t* groups, size_t width, powers* p) {
+    n = trim(a, n);
+    if (n <= PRINT_CUTOFF) {
+        for (size_t i = 0; i < width; i++) {
+            groups[i] = n ? divmod_billion(a, n) : 0;
+            n = trim(a, n);
+        }
+        return;
+    }
+    size_t level = 0;
+    while ((size_t)2 << level < width) level++;
+    size_t low = (size_t)1 << level;
+    power_of_ten(p, level);
+    size_t pn = p->len[level];
+    if (n < pn) {
+        // no high part, so the top groups are all 0
+        to_groups(a, n, groups, low, p);
+        memset(groups + low, 0, (width - low) * sizeof(uint32_t));
+        return;
+    }
+    uint32_t* q = (uint32_t*)malloc((n - pn + 1) * sizeof(uint32_t));
+    divmod_mag(q, a, n, p->limbs[level], pn);
+    to_groups(a, pn, groups, low, p);
+    to_groups(q, n - pn + 1, groups + low, width - low, p);
+    free(q);
+}
+
+// Writes the magnitude in base 10 after the sign, as a malloc()ed string.
+static char* to_decimal(const uint32_t* a, size_t n, bool neg) {
+    uint32_t* t = (uint32_t*)malloc((n + 1) * sizeof(uint32_t));
+    memcpy(t, a, n * sizeof(uint32_t));
+    // log2(10^9) > 29.8, so each limb makes at most 32/29.8 groups
+    size_t ng = n * 10 / 9 + 2;
+    uint32_t* groups = (uint32_t*)malloc(ng * sizeof(uint32_t));
+    powers p;
+    memset(&p, 0, sizeof(p));
+    to_groups(t, n, groups, ng, &p);
+    for (size_t i = 0; i < 64; i++) free(p.limbs[i]);
+    while (ng && !groups[ng - 1]) ng--;
+    char* out = (char*)malloc(ng * 9 + 3);
+    char* c = out;
+    if (neg) *c++ = '-';
+    if (!ng) *c++ = '0';
+    else c += sprintf(c, "%" PRIu32, groups[--ng]);
+    while (ng) c += sprintf(c, "%09" PRIu32, groups[--ng]);
+    *c = 0;
+    free(groups);
+    free(t);
+    return out;
+}
+
+// magnitude and sign of an int or bigint
+struct view {
+    const uint32_t* limbs;
+    size_t len;
+    bool neg;
+    uint32_t small[2];
+};
+
+static void unpack(object* x, view* v) {
+    if (x->type == &integer_type) {
+        int64_t i = x->as_big_int;
+        v->neg = i < 0;
+        uint64_t m = v->neg ? 0 - (uint64_t)i : (uint64_t)i;
+        v->small[0] = (uint32_t)m;
+        v->small[1] = (uint32_t)(m >> 32);
+        v->limbs = v->small;
+        v->len = trim(v->small, 2);
+        return;
+    }
+    ASSERT(x->type == &bigint_type);
+    num* n = (num*)x->as_ptr;
+    v->limbs = n->limbs;
+    v->len = n->len;
+    v->neg = n->neg;
+}
+
+static int compare(object* a, object* b) {
+    view x, y;
+    unpack(a, &x);
+    unpack(b, &y);
+    if (x.neg != y.neg) return x.neg ? -1 : 1;
+    int c = compare_mag(x.limbs, x.len, y.limbs, y.len);
+    return x.neg ? -c : c;
+}
+
+// compares an int or bigint with a double exactly (NaN is bigger than any number), 0 if they're the same number
+static int compare_double(object* a, double d) {
+    if (d != d) return -1;
+    double t = trunc(d);
+    if (isinf(t)) return t > 0 ? -1 : 1;
+    view x;
+    unpack(a, &x);
+    bool neg = t < 0;
+    if (x.neg != neg && (x.len || t != 0)) return x.neg ? -1 : 1;
+    // the whole part of d as limbs: its 53 bit mantissa shifted by the exponent
+    uint32_t limbs[1024 / 32 + 2] = {};
+    size_t len = 0;
+    if (t != 0) {
+        int e;
+        uint64_t m = (uint64_t)ldexp(frexp(fabs(t), &e), 53);
+        e -= 53;
+        if (e < 0) m >>= -e;
+        size_t shift = e > 0 ? e : 0;
+        size_t at = shift / 32;
+        unsigned bits = shift % 32;
+        uint64_t low = m << bits;
+        limbs[at] = (uint32_t)low;
+        limbs[at + 1] = (uint32_t)(low >> 32);
+        limbs[at + 2] = bits ? (uint32_t)(m >> (64 - bits)) : 0;
+        len = trim(limbs, at + 3);
+    }
+    int c = compare_mag(x.limbs, x.len, limbs, len);
+    if (x.neg) c = -c;
+    if (c) return c;
+    double frac = d - t;
+    return frac > 0 ? -1 : frac < 0 ? 1 : 0;
+}
+
+}
+
+object* pvm::bigint(const uint32_t* limbs, size_t len, bool neg) {
+    len = bignum::trim(limbs, len);
+    // a cancelled sum can come in with neg set, but there is only one zero
+    if (!len) return this->integer(0);
+    if (len <= 2) {
+        uint64_t m = len ? limbs[0] | (len > 1 ? (uint64_t)limbs[1] << 32 : 0) : 0;
+        if (!neg && m <= INT64_MAX) return this->integer((int64_t)m);
+        if (neg && m - 1 <= INT64_MAX) return this->integer(-(int64_t)(m - 1) - 1);
+    }
+    object** slot = this->intern_lookup(this->interned_bigints, this->bigint_hash(limbs, len, neg), limbs, len, neg);
+    if (*slot) return *slot;
+    bignum::num* n = (bignum::num*)this->payloads.alloc(sizeof(bignum::num) + len * sizeof(uint32_t));
+    n->len = len;
+    n->neg = neg;
+    memcpy(n->limbs, limbs, len * sizeof(uint32_t));
+    object* o = this->alloc(&bigint_type);
+    o->as_ptr = (void*)n;
+    this->intern_insert(this->interned_bigints, slot, o);
+    return o;
+}
+
+object* pvm::parse_integer(const char* digits, size_t len, int base) {
+    ASSERT(base == 10 || base == 16);
+    uint32_t* r;
+    size_t n = 0;
+    if (base == 16) {
+        // 8 hex digits per limb, starting from the end
+        r = (uint32_t*)calloc(len / 8 + 1, sizeof(uint32_t));
+        for (size_t i = 0; i < len; i++) {
+            char c = digits[len - 1 - i];
+            uint32_t d = isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10;
+            r[i / 8] |= d << (4 * (i % 8));
+        }
+        n = len / 8 + 1;
+    }
+    else {
+        bignum::powers p;
+        memset(&p, 0, sizeof(p));
+        r = (uint32_t*)malloc((len / 9 + 2) * sizeof(uint32_t));
+        n = bignum::from_decimal(digits, len, r, &p);
+        for (size_t i = 0; i < 64; i++) free(p.limbs[i]);
+    }
+    object* result = this->bigint(r, n, false);
+    free(r);
+    return result;
+}
+
+// signed a + b, or a - b if negate_b
+object* pvm::bigint_add(object* a, object* b, bool negate_b) {
+    bignum::view x, y;
+    bignum::unpack(a, &x);
+    bignum::unpack(b, &y);
+    y.neg ^= negate_b;
+    size_t n = (x.len > y.len ? x.len : y.len) + 1;
+    uint32_t* r = (uint32_t*)malloc(n * sizeof(uint32_t));
+    bool neg = x.neg;
+    if (x.neg == y.neg) bignum::add_mag(r, x.limbs, x.len, y.limbs, y.len);
+    else if (bignum::compare_mag(x.limbs, x.len, y.limbs, y.len) >= 0) {
+        bignum::sub_mag(r, x.limbs, x.len, y.limbs, y.len);
+        n = x.len;
+    }
+    else {
+        bignum::sub_mag(r, y.limbs, y.len, x.limbs, x.len);
+        n = y.len;
+        neg = y.neg;
+    }
+    object* result = this->bigint(r, n, neg);
+    free(r);
+    return result;
+}
+
+object* pvm::int_add(object* a, object* b) {
+    int64_t r;
+    if (a->type == &integer_type && b->type == &integer_type && !__builtin_add_overflow(a->as_big_int, b->as_big_int, &r)) return this->integer(r);
+    return this->bigint_add(a, b, false);
+}
+
+object* pvm::int_sub(object* a, object* b) {
+    int64_t r;
+    if (a->type == &integer_type && b->type == &integer_type && !__builtin_sub_overflow(a->as_big_int, b->as_big_int, &r)) return this->integer(r);
+    return this->bigint_add(a, b, true);
+}
+
+object* pvm::int_mul(object* a, object* b) {
+    int64_t r;
+    if (a->type == &integer_type && b->type == &integer_type && !__builtin_mul_overflow(a->as_big_int, b->as_big_int, &r)) return this->integer(r);
+    bignum::view x, y;
+    bignum::unpack(a, &x);
+    bignum::unpack(b, &y);
+    if (!x.len || !y.len) return this->integer(0);
+    uint32_t* p = (uint32_t*)malloc((x.len + y.len) * sizeof(uint32_t));
+    bignum::mul_mag(p, x.limbs, x.len, y.limbs, y.len);
+    object* result = this->bigint(p, x.len + y.len, x.neg != y.neg);
+    free(p);
+    return result;
+}
+
+object* pvm::int_neg(object* a) {
+    return this->int_sub(this->integer(0), a);
+}
+
+char* pvm::int_to_string(object* x) {
+    bignum::view v;
+    bignum::unpack(x, &v);
+    return bignum::to_decimal(v.limbs, v.len, v.neg);
+}
+
+#undef KARATSUBA_CUTOFF
+#undef PARSE_CUTOFF
+#undef PRINT_CUTOFF
+
+
+// ----------------------- ROPES ----------------------------
+
+namespace rope {
+
+static inline size_t height(object* o) {
+    return o->type == &rope_type ? ROPE(o)->height : 0;
+}
+
+static inline size_t length(object* o) {
+    return o->type == &rope_type ? ROPE(o)->len : STRING_HEADER(o)->len;
+}
+
+// writes all of the chars to out
+static void copy(object* o, char* out) {
+    while (o->type == &rope_type && !ROPE(o)->flat) {
+        copy(ROPE(o)->left, out);
+        out += length(ROPE(o)->left);
+        o = ROPE(o)->right;
+    }
+    if (o->type == &rope_type) o = ROPE(o)->flat;
+    memcpy(out, o->as_chars, STRING_HEADER(o)->len);
+}
+
+static object* node(pvm* vm, object* left, object* right) {
+    rope_node* n = (rope_node*)vm->payloads.alloc(sizeof(rope_node));
+    n->left = left;
+    n->right = right;
+    n->len = length(left) + length(right);
+    size_t hl = height(left), hr = height(right);
+    n->height = (hl > hr ? hl : hr) + 1;
+    n->flat = nil;
+    object* o = vm->alloc(&rope_type);
+    o->as_ptr = (void*)n;
+    return o;
+}
+
+// Nodes are never changed once made (other ropes may share them), so the rotations make new ones.
+// Only nodes at least one higher than the leaves are rotated, and those always have children.
+static object* rotate_left(pvm* vm, object* o) {
+    object* r = ROPE(o)->right;
+    return node(vm, node(vm, ROPE(o)->left, ROPE(r)->left), ROPE(r)->right);
+}
+
+static object* rotate_right(pvm* vm, object* o) {
+    object* l = ROPE(o)->left;
+    return node(vm, ROPE(l)->left, node(vm, ROPE(l)->right, ROPE(o)->right));
+}
+
+// two neighbouring leaves are merged instead of getting a node of their own if they're short enough
+static object* pair(pvm* vm, object* left, object* right) {
+    if (!height(left) && !height(right) && length(left) + length(right) <= ROPE_LEAF_MAX) return vm->concat(left, right);
+    return node(vm, left, right);
+}
+
+// The AVL join: goes down the spine of the higher tree until the heights are within one, and rebalances
+// on the way back up, so it takes time proportional to the difference in height.
+static object* join_right(pvm* vm, object* l, object* r) {
+    object* a = ROPE(l)->left;
+    object* c = ROPE(l)->right;
+    if (height(c) <= height(r) + 1) {
+        object* t = pair(vm, c, r);
+        if (height(t) <= height(a) + 1) return node(vm, a, t);
+        return rotate_left(vm, node(vm, a, rotate_right(vm, t)));
+    }
+    object* t = join_right(vm, c, r);
+    object* joined = node(vm, a, t);
+    if (height(t) <= height(a) + 1) return joined;
+    return rotate_left(vm, joined);
+}
+
+static object* join_left(pvm* vm, object* l, object* r) {
+    object* c = ROPE(r)->left;
+    object* b = ROPE(r)->right;
+    if (height(c) <= height(l) + 1) {
+        object* t = pair(vm, l, c);
+        if (height(t) <= height(b) + 1) return node(vm, t, b);
+        return rotate_right(vm, node(vm, rotate_left(vm, t), b));
+    }
+    object* t = join_left(vm, l, c);
+    object* joined = node(vm, t, b);
+    if (height(t) <= height(b) + 1) return joined;
+    return rotate_right(vm, joined);
+}
+
+static object* join(pvm* vm, object* l, object* r) {
+    size_t hl = height(l), hr = height(r);
+    if (hl > hr + 1) return join_right(vm, l, r);
+    if (hr > hl + 1) return join_left(vm, l, r);
+    return pair(vm, l, r);
+}
+
+// compares the chars of two strings or ropes (without a vm to flatten them with)
+static int compare(object* a, object* b) {
+    size_t la = length(a), lb = length(b);
+    const char* ca = a->type == &rope_type && ROPE(a)->flat ? ROPE(a)->flat->as_chars : a->as_chars;
+    const char* cb = b->type == &rope_type && ROPE(b)->flat ? ROPE(b)->flat->as_chars : b->as_chars;
+    char* tmp_a = NULL;
+    char* tmp_b = NULL;
+    if (a->type == &rope_type && !ROPE(a)->flat) {
+        ca = tmp_a = (char*)malloc(la + 1);
+        copy(a, tmp_a);
+    }
+    if (b->type == &rope_type && !ROPE(b)->flat) {
+        cb = tmp_b = (char*)malloc(lb + 1);
+        copy(b, tmp_b);
+    }
+    int cmp = memcmp(ca, cb, la < lb ? la : lb);
+    if (!cmp) cmp = (la > lb) - (la < lb);
+    free(tmp_a);
+    free(tmp_b);
+    return cmp;
+}
+
+}
+
+object* pvm::concat(object* a, object* b) {
+    size_t la = rope::length(a), lb = rope::length(b);
+    if (!lb) return a;
+    if (!la) return b;
+    if (la + lb > ROPE_LEAF_MAX) return rope::join(this, a, b);
+    char buf[ROPE_LEAF_MAX];
+    rope::copy(a, buf);
+    rope::copy(b, buf + la);
+    return this->string(buf, la + lb);
+}
+
+object* pvm::flatten(object* s) {
+    if (s->type != &rope_type) return s;
+    rope_node* n = ROPE(s);
+    if (n->flat) return n->flat;
+    char* buf = (char*)malloc(n->len + 1);
+    rope::copy(s, buf);
+    object* flat = this->string(buf, n->len);
+    free(buf);
+    this->write_barrier(flat);
+    // the children stay: other ropes can share this node, and joining them rotates through it
+    n->flat = flat;
+    return flat;
+}
+
+//--------------- HELPER FUNCTIONS ----------------------------
+
+template <typename T>
+static inline int three_way(T a, T b) {
+    return (a > b) - (a < b);
+}
+
+int compare_identity(object* a, object* b) {
+    if (a->type != b->type) return three_way((uintptr_t)a->type, (uintptr_t)b->type);
+    return three_way((uintptr_t)a, (uintptr_t)b);
+}
+
+bool equal_identity(object* a, object* b) {
+    return a == b;
+}
+
+// objects never move
+uint64_t hash_identity(pvm* vm, object* o) {
+    return vm->hash_int((uintptr_t)o);
+}
+
+static int compare_floats(double x, double y) {
+    if (x < y) return -1;
+    if (x > y) return 1;
+    bool nx = x != x, ny = y != y;
+    if (nx != ny) return nx ? 1 : -1;
+    // -0.0 before 0.0, and NaNs by their bits
+    int64_t bx, by;
+    memcpy(&bx, &x, sizeof(bx));
+    memcpy(&by, &y, sizeof(by));
+    return three_way(bx, by);
+}
+
+static int compare_numbers(object* a, object* b) {
+    bool fa = a->type == &float_type, fb = b->type == &float_type;
+    if (fa && fb) return compare_floats(a->as_double, b->as_double);
+    // an int or bigint comes before a float with the same value
+    if (fa) {
+        int c = bignum::compare_double(b, a->as_double);
+        return c ? -c : 1;
+    }
+    if (fb) {
+        int c = bignum::compare_double(a, b->as_double);
+        return c ? c : -1;
+    }
+    if (a->type == &integer_type && b->type == &integer_type) return three_way(a->as_big_int, b->as_big_int);
+    return bignum::compare(a, b);
+}
+
+// ints and floats are hashed by their bits, like the intern tables do
+static uint64_t hash_number(pvm* vm, object* o) {
+    if (o->type != &bigint_type) return vm->hash_int(o->as_big_int);
+    bignum::num* n = (bignum::num*)o->as_ptr;
+    return vm->bigint_hash(n->limbs, n->len, n->neg);
+}
+
+static int compare_text(object* a, object* b) {
+    return rope::compare(a, b);
+}
+
+// strings are interned, so two strings are never equal, but a rope can be equal to a string or another rope
+static bool equal_text(object* a, object* b) {
+    if (a->type == &string_type && b->type == &string_type) return false;
+    return rope::length(a) == rope::length(b) && !rope::compare(a, b);
+}
+
+static uint64_t hash_text(pvm* vm, object* o) {
+    if (o->type == &rope_type) o = vm->flatten(o);
+    return cached_hash(o);
+}
+
+static int compare_pointers(object* a, object* b) {
+    return three_way((uintptr_t)a->as_ptr, (uintptr_t)b->as_ptr);
+}
+
+static uint64_t hash_pointer(pvm* vm, object* o) {
+    return vm->hash_int((uintptr_t)o->as_ptr);
+}
+
+static int compare_indexes(object* a, object* b) {
+    return three_way(a->as_big_int, b->as_big_int);
+}
+
+int eqcmp(object* a, object* b) {
+    if (a == b) return 0;
+    if (a == NULL) return -1;
+    if (b == NULL) return 1;
+    const value_type* ta = type_of(a);
+    const value_type* tb = type_of(b);
+    if (ta->rank != tb->rank) return ta->rank < tb->rank ? -1 : 1;
+    return ta->compare(a, b);
+}
+
+object* assoc(object* list, object* key) {
+    // most keys are only equal to themselves, which doesn't need any calls
+    if (!key || type_of(key)->equal == equal_identity) {
+        for (; list; list = cdr(list)) if (car(car(list)) == key) return car(list);
+        return NULL;
+    }
+    for (; list; list = cdr(list)) {
+        object* pair = car(list);
+        if (equal(key, car(pair))) return pair;
+    }
+    return NULL;
+}
+
+object* delassoc(object** list, object* key) {
+    for (; *list; list = &cdr(*list)) {
+        object* pair = car(*list);
+        if (equal(key, car(pair))) {
+            *list = cdr(*list);
+            return pair;
+        }
+    }
+    return NULL;
+}
+
+// ---------- STACK MACHINE --------------------------------------------
+
+object* pvm::opcode(object* name) {
+    if (name->type == &opcode_type) return name;
+    ASSERT(name->type == &symbol_type, "instruction name is not a symbol");
+    // The symbol's car caches its opcode so this is O(1) after the first time
+    if (car(name)) return car(name);
+    DBG("Assigning opcode %zu to %s", this->num_opcodes, this->stringof(name));
+    if (this->num_opcodes == this->opcodes_cap) {
+        this->opcodes_cap = this->opcodes_cap ? this->opcodes_cap * 2 : 16;
+        this->opcodes = (func_ptr*)realloc(this->opcodes, this->opcodes_cap * sizeof(func_ptr));
+        STATS(this->stats.reserve_ops(this->opcodes_cap);)
+    }
+    object* op = this->alloc(&opcode_type);
+    car(op) = name;
+    op->as_big_int = this->num_opcodes;
+    this->opcodes[this->num_opcodes++] = NULL;
+    car(name) = op;
+    this->push(this->cons(name, op), this->function_registry);
+    return op;
+}
+
+void pvm::start_thread()  {
+    object* new_thread = this->alloc(&thread_type);
+    car(new_thread) = nil;
+    new_thread->as_ptr = this->payloads.alloc(sizeof(thread_state));
+    memset(new_thread->as_ptr, 0, sizeof(thread_state));
+    object* prev = this->queue_tail;
+    this->enqueue(new_thread);
+    // then back up one so the new thread is the current one, and gets pushed to
+    if (prev) {
+        this->queue = this->queue_tail;
+        this->queue_tail = prev;
+    }
+    this->slice_used = 0;
+}
+
+void pvm::grow_data(thread_state* t) {
+    t->data_cap = t->data_cap ? t->data_cap * 2 : 16;
+    t->data = (object**)this->payloads.resize(t->data, t->data_cap * sizeof(object*));
+}
+
+void pvm::grow_insts(thread_state* t) {
+    t->insts_cap = t->insts_cap ? t->insts_cap * 2 : 16;
+    t->insts = (inst_record*)this->payloads.resize(t->insts, t->insts_cap * sizeof(inst_record));
+}
+
+object* pvm::data_stack(object* thread) {
+    thread_state* t = THREAD(thread);
+    object* list = nil;
+    for (size_t i = 0; i < t->data_len; i++) this->push(t->data[i], list);
+    return list;
+}
+
+object* pvm::inst_stack(object* thread) {
+    thread_state* t = THREAD(thread);
+    object* list = nil;
+    for (size_t i = 0; i < t->insts_len; i++) {
+        inst_record* r = &t->insts[i];
+        this->push(this->cons(r->type, this->cons(r->opcode, r->cookie)), list);
+    }
+    return list;
+}
+
+object* pvm::thread_as_list(object* thread) {
+    return this->cons(this->data_stack(thread), this->cons(car(thread), this->inst_stack(thread)));
+}
+
+void pvm::enqueue(object* thread) {
+    // the new cell goes at the end (just before the current thread), so it runs last in this round
+    object* cell = this->cons(thread, this->queue);
+    STATS(
+        if (++this->stats.queue_length > this->stats.max_queue_length)
+            this->stats.max_queue_length = this->stats.queue_length;
+    )
+    if (!this->queue) {
+        cdr(cell) = cell;
+        this->queue = this->queue_tail = cell;
+        return;
+    }
+    cdr(this->queue_tail) = cell;
+    this->queue_tail = cell;
+}
+
+void pvm::dequeue() {
+    STATS(this->stats.queue_length--;)
+    if (this->queue_tail == this->queue) {
+        this->queue = this->queue_tail = nil;
+        return;
+    }
+    this->queue = cdr(this->queue_tail) = cdr(this->queue);
+    this->slice_used = 0;
+}
+
+// how many instructions run_for() runs between looking at the clock
+#define DEADLINE_CHECK_INTERVAL 16
+
+template <pvm::profile_mode mode>
+run_status pvm::run_loop(size_t fuel, uint64_t deadline) {
+    size_t until_check = 0;
+    while (this->queue) {
+        if (!fuel) return RUN_OUT_OF_FUEL;
+        if (deadline && !until_check--) {
+            if (monotonic_ns() >= deadline) return RUN_DEADLINE;
+            until_check = DEADLINE_CHECK_INTERVAL - 1;
+        }
+        object* cell = this->queue;
+        object* thread = car(cell);
+        thread_state* t = THREAD(thread);
+        if (!t->insts_len) {
+            // Drop the finished thread, and report it if it ended with a condition nothing handled
+            this->dequeue();
+            if (car(thread)) {
+                this->failed_thread = thread;
+                return RUN_ERROR;
+            }
+            continue;
+        }
+        inst_record* r = &t->insts[--t->insts_len];
+        object* next_type = car(thread);
+        // types are symbols (or nil), which are interned, so eqcmp() isn't needed
+        if (r->type != next_type) continue;
+        object* opc = r->opcode;
+        // (the instruction can push onto the stack and move r)
+        object* cookie = r->cookie;
+        func_ptr fun = this->opcodes[opc->as_big_int];
+        ASSERT(fun, "Unknown instruction %s", this->stringof(car(opc)));
+        if (!this->slice_used++ && this->time_slice) this->slice_start = monotonic_ns();
+        size_t depth = mode != PROFILE_OFF ? t->insts_len : 0;
+        STATS(uint64_t op_start = monotonic_ns();)
+        car(thread) = fun(this, cookie, next_type);
+        STATS(
+            this->stats.op_counts[opc->as_big_int]++;
+            this->stats.op_ns[opc->as_big_int] += monotonic_ns() - op_start;
+        )
+        if (mode == PROFILE_EVERY && !--this->profile_countdown) this->take_sample(t, depth, opc, next_type);
+        if (mode == PROFILE_TIMER && this->profile_ticked) this->take_sample(t, depth, opc, next_type);
+        fuel--;
+        if (this->auto_gc) {
+            if (this->incremental_gc) this->gc_step();
+            else this->maybe_gc();
+        }
+        // if the instruction parked its thread or started a new one, whatever is current now goes next
+        if (this->queue != cell) continue;
+        if (this->slice_used >= this->quantum || (this->time_slice && monotonic_ns() - this->slice_start >= this->time_slice)) {
+            this->queue_tail = cell;
+            this->queue = cdr(cell);
+            this->slice_used = 0;
+        }
+    }
+    return RUN_IDLE;
+}
+
+#undef DEADLINE_CHECK_INTERVAL
+
+run_status pvm::run_until(size_t fuel, uint64_t deadline) {
+    if (this->profiling == PROFILE_EVERY) return this->run_loop<PROFILE_EVERY>(fuel, deadline);
+    if (this->profiling == PROFILE_TIMER) return this->run_loop<PROFILE_TIMER>(fuel, deadline);
+    return this->run_loop<PROFILE_OFF>(fuel, deadline);
+}
+
+run_status pvm::run(size_t fuel) {
+    return this->run_until(fuel, 0);
+}
+
+run_status pvm::run_for(uint64_t ns) {
+    return this->run_until(SIZE_MAX, monotonic_ns() + ns);
+}
+
+void pvm::step() {
+    this->run(1);
+}
+
+//--------------- PARSER --------------------------------------
+
+namespace parser {
+
+typedef struct {
+    const char* data;
+    size_t i;
+    size_t len;
+} pstate;
+
+#define pos (s->i)
+#define advance pos +=
+#define next pos++
+#define look (s->data[pos])
+#define at(z) (&s->data[z])
+#define here at(pos)
+#define eofp  (pos >= s->len)
+#define test(f) (f(look))
+
+// Character classes for the scanner, one table lookup per char instead of a chain of isxxx() calls.
+enum {
+    C_IDSTART = 1, // letters and _
+    C_DIGIT = 2,
+    C_SPACE = 4, // whitespace other than newlines
+    C_NEWLINE = 8,
+    C_PUNCT = 16,
+};
+#define C_IDENT (C_IDSTART | C_DIGIT)
+
+static const struct char_classes {
+    uint8_t of[256];
+    char_classes() {
+        memset(this->of, 0, sizeof(this->of));
+        for (int c = 0; c < 128; c++) {
+            if (isalpha(c) || c == '_') this->of[c] = C_IDSTART;
+            else if (isdigit(c)) this->of[c] = C_DIGIT;
+            else if (c == '\n' || c == '\r') this->of[c] = C_NEWLINE;
+            else if (isspace(c)) this->of[c] = C_SPACE;
+            else if (ispunct(c)) this->of[c] = C_PUNCT;
+        }
+    }
+} classes;
+
+#define cls(c) (classes.of[(unsigned char)(c)])
+
+// Returns the position of the first char at or after p that is not in the class.
+// The string must be NUL terminated at len (NUL is in no class).
+static size_t skip_class(const char* data, size_t p, size_t len, uint8_t mask) {
+    #ifdef __SSE2__
+    // 16 chars at a time for long runs of spaces and identifier chars
+    if (mask == C_SPACE) {
+        const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+        for (; p + 16 <= len; p += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(data + p));
+            unsigned in = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, space), _mm_cmpeq_epi8(chunk, tab)));
+            if (in != 0xFFFF) {
+                p += __builtin_ctz(~in);
+                break;
+            }
+        }
+    }
+    else if (mask == C_IDENT) {
+        // the ranges are tested with signed compares, chars >= 128 are negative so they are never in range
+        const __m128i a = _mm_set1_epi8('a' - 1), z = _mm_set1_epi8('z' + 1);
+        const __m128i A = _mm_set1_epi8('A' - 1), Z = _mm_set1_epi8('Z' + 1);
+        const __m128i d0 = _mm_set1_epi8('0' - 1), d9 = _mm_set1_epi8('9' + 1);
+        const __m128i us = _mm_set1_epi8('_');
+        #define RANGE(lo, hi) _mm_and_si128(_mm_cmpgt_epi8(chunk, lo), _mm_cmplt_epi8(chunk, hi))
+        for (; p + 16 <= len; p += 16) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(data + p));
+            __m128i ok = _mm_or_si128(_mm_or_si128(RANGE(a, z), RANGE(A, Z)), _mm_or_si128(RANGE(d0, d9), _mm_cmpeq_epi8(chunk, us)));
+            unsigned in = _mm_movemask_epi8(ok);
+            if (in != 0xFFFF) {
+                p += __builtin_ctz(~in);
+                break;
+            }
+        }
+        #undef RANGE
+    }
+    #endif
+    while (cls(data[p]) & mask) p++;
+    return p;
+}
+
+static const double powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+    1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+// Scans a number starting at a digit. Integers without a fraction or exponent become ints, the rest floats.
+static object* scan_number(pvm* vm, pstate* s) {
+    const char* start = here;
+    // (the ctype functions are undefined for negative chars, which bytes >= 0x80 are)
+    if (look == '0' && (s->data[pos + 1] == 'x' || s->data[pos + 1] == 'X') && isxdigit((unsigned char)s->data[pos + 2])) {
+        DBG("hex integer");
+        advance 2;
+        uint64_t n = 0;
+        bool overflow = false;
+        for (; isxdigit((unsigned char)look); next) {
+            if (n >> 60) overflow = true;
+            n = (n << 4) | (cls(look) == C_DIGIT ? look - '0' : (look | 0x20) - 'a' + 10);
+        }
+        if (overflow || n > INT64_MAX) return vm->parse_integer(start + 2, here - start - 2, 16);
+        return vm->integer((int64_t)n);
+    }
+    // only the first 19 significant digits are kept, which always fit
+    uint64_t mantissa = 0;
+    int digits = 0, exp10 = 0;
+    for (; cls(look) == C_DIGIT; next) {
+        if (digits < 19) mantissa = mantissa * 10 + (look - '0'), digits += mantissa != 0;
+        else exp10++;
+    }
+    bool is_float = false;
+    if (look == '.' && cls(s->data[pos + 1]) == C_DIGIT) {
+        is_float = true;
+        next;
+        for (; cls(look) == C_DIGIT; next) {
+            if (digits < 19) mantissa = mantissa * 10 + (look - '0'), digits += mantissa != 0, exp10--;
+        }
+    }
+    if ((look == 'e' || look == 'E') && (cls(s->data[pos + 1]) == C_DIGIT
+        || ((s->data[pos + 1] == '+' || s->data[pos + 1] == '-') && cls(s->data[pos + 2]) == C_DIGIT))) {
+        is_float = true;
+        next;
+        bool neg = look == '-';
+        if (look == '+' || look == '-') next;
+        int e = 0;
+        for (; cls(look) == C_DIGIT; next) if (e < 100000) e = e * 10 + (look - '0');
+        exp10 += neg ? -e : e;
+    }
+    if (!is_float) {
+        if (mantissa > INT64_MAX || exp10) return vm->parse_integer(start, here - start, 10);
+        return vm->integer((int64_t)mantissa);
+    }
+    // Exact when the mantissa and power of ten are both exactly representable
+    if (mantissa < (1ULL << 53) && exp10 >= -22 && exp10 <= 22) {
+        double d = (double)mantissa;
+        return vm->number(exp10 < 0 ? d / powers_of_ten[-exp10] : d * powers_of_ten[exp10]);
+    }
+    // Otherwise let strtod do the correct rounding (on a copy, so it stops at the same place we did)
+    char buf[64];
+    size_t n = here - start;
+    if (n < sizeof(buf)) {
+        memcpy(buf, start, n);
+        buf[n] = 0;
+        return vm->number(strtod(buf, NULL));
+    }
+    char* big = strndup(start, n);
+    double d = strtod(big, NULL);
+    free(big);
+    return vm->number(d);
+}
+
+static char unescape(char c) {
+    switch (c) {
+        case 'b': return '\b';
+        case 't': return '\t';
+        case 'n': return '\n';
+        case 'v': return '\v';
+        case 'f': return '\f';
+        case 'r': return '\r';
+        case 'a': return '\a';
+        case 'o': return '{';
+        case 'c': return '}';
+        case '\n': return 0;
+        default: return c;
+    }
+}
+
+static char escape(char c) {
+    switch (c) {
+        case '\b': return 'b';
+        case '\t': return 't';
+        case '\n': return 'n';
+        case '\v': return 'v';
+        case '\f': return 'f';
+        case '\r': return 'r';
+        case '\a': return 'a';
+        case '{': return 'o';
+        case '}': return 'c';
+        default: return c;
+    }
+}
+
+static char revparen(char p) {
+    const char* a = "([{}])";
+    const char* b = ")]}{[(";
+    return b[strchr(a, p) - a];
+}
+
+static object* next_token(pvm* vm, pstate* s) {
+    char c = look;
+    size_t p = pos;
+    switch (cls(c)) {
+        case C_IDSTART:
+            DBG("symbol");
+            pos = skip_class(s->data, pos, s->len, C_IDENT);
+            return vm->sym(at(p), pos - p);
+        case C_DIGIT:
+            DBG("number");
+            return scan_number(vm, s);
+        case C_NEWLINE:
+            DBG("newline");
+            pos = skip_class(s->data, pos, s->len, C_NEWLINE);
+            return vm->sym("NEWLINE");
+        case C_SPACE:
+            DBG("space");
+            pos = skip_class(s->data, pos, s->len, C_SPACE);
+            return vm->sym(at(p), pos - p);
+        case C_PUNCT:
+            DBG("punctuation symbol");
+            next;
+            return vm->sym(at(p), 1);
+        default:
+            DBG("other crap: %c (%i)", c, (int)c);
+            next;
+            return nil;
+    }
+}
+
+// Can be called by the program
+object* tokenize(pvm* vm, object* cookie, object* inst_type) {
+    (void)cookie;
+    DBG("tokenizing");
+    object* string = vm->pop();
+    if (!string || (string->type != &string_type && string->type != &rope_type)) {
+        vm->push_data(vm->cons(vm->string("non string to tokenize()"), nil));
+        return vm->sym("error");
+    }
+    const char* str = vm->stringof(string);
+    pstate s = { .data = str, .i = 0, .len = vm->string_length(string) };
+    object* result = nil;
+    object** tail = &result;
+    do {
+        object* item = next_token(vm, &s);
+        DBG("Got token.");
+        *tail = vm->cons(item, nil);
+        tail = &cdr(*tail);
+    } while (s.i < s.len);
+    vm->push_data(result);
+    return nil;
+}
+
+// ---- streaming ----
+
+struct stream {
+    // where the source comes from: the fd if map is NULL, else the mapped file
+    int fd;
+    const char* map;
+    size_t map_len;
+    size_t map_pos;
+    // the unconsumed source is buf[start..end), always NUL terminated at end
+    char* buf;
+    size_t cap;
+    size_t start;
+    size_t end;
+    size_t chunk_size;
+    bool eof;
+    // errno of the read() that failed, which also sets eof
+    int error;
+};
+
+static void free_stream(object* o) {
+    stream* st = (stream*)o->as_ptr;
+    if (st->map) munmap((void*)st->map, st->map_len);
+    free(st->buf);
+    free(st);
+}
+
+const value_type stream_type("stream", mark_car_only, free_stream, NULL);
+
+static object* make_stream(pvm* vm, int fd, const char* map, size_t map_len, size_t chunk_size) {
+    stream* st = (stream*)calloc(1, sizeof(stream));
+    st->fd = fd;
+    st->map = map;
+    st->map_len = map_len;
+    st->chunk_size = chunk_size;
+    st->cap = chunk_size + 1;
+    st->buf = (char*)malloc(st->cap);
+    st->buf[0] = 0;
+    object* o = vm->alloc(&stream_type);
+    o->as_ptr = (void*)st;
+    return o;
+}
+
+object* open_stream(pvm* vm, int fd, size_t chunk_size) {
+    return make_stream(vm, fd, NULL, 0, chunk_size);
+}
+
+object* map_file(pvm* vm, const char* path, size_t chunk_size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return nil;
+    struct stat sb;
+    if (fstat(fd, &sb) < 0) {
+        close(fd);
+        return nil;
+    }
+    const char* map = NULL;
+    if (sb.st_size > 0) {
+        void* m = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            return nil;
+        }
+        madvise(m, sb.st_size, MADV_SEQUENTIAL);
+        map = (const char*)m;
+    }
+    // the mapping stays valid after the fd is closed
+    close(fd);
+    object* o = make_stream(vm, -1, map, sb.st_size, chunk_size);
+    if (!map) ((stream*)o->as_ptr)->eof = true;
+    return o;
+}
+
+// Moves the unconsumed source to the front of the buffer and appends the next chunk.
+static void refill(stream* st) {
+    memmove(st->buf, st->buf + st->start, st->end - st->start);
+    st->end -= st->start;
+    st->start = 0;
+    if (st->end + st->chunk_size + 1 > st->cap) {
+        // a single token is longer than a chunk
+        st->cap = st->end + st->chunk_size + 1;
+        st->buf = (char*)realloc(st->buf, st->cap);
+    }
+    size_t got;
+    if (st->map) {
+        got = st->map_len - st->map_pos;
+        if (got > st->chunk_size) got = st->chunk_size;
+        memcpy(st->buf + st->end, st->map + st->map_pos, got);
+        st->map_pos += got;
+    } else {
+        ssize_t n;
+        do n = read(st->fd, st->buf + st->end, st->chunk_size);
+        while (n < 0 && errno == EINTR);
+        if (n < 0) st->error = errno;
+        got = n > 0 ? n : 0;
+    }
+    DBG("Read %zu bytes of source", got);
+    if (!got) st->eof = true;
+    st->end += got;
+    st->buf[st->end] = 0;
+}
+
+// A token that ends this close to the end of the buffer might continue in the next chunk
+// (the longest lookahead is a number's "e+" followed by a digit)
+#define LOOKAHEAD 3
+
+// Can be called by the program
+object* tokenize_stream(pvm* vm, object* cookie, object* inst_type) {
+    // cookie is nil the first time, then (stream . (tokens . last cons of tokens))
+    if (!cookie) {
+        object* src = vm->pop();
+        if (!src || src->type != &stream_type) {
+            vm->push_data(vm->cons(vm->string("non stream to tokenize_stream()"), nil));
+            return vm->sym("error");
+        }
+        cookie = vm->cons(src, vm->cons(nil, nil));
+    }
+    stream* st = (stream*)car(cookie)->as_ptr;
+    object* tokens = cdr(cookie);
+    for (size_t n = 0; n < TOKENIZE_BATCH;) {
+        if (!st->eof && st->end - st->start <= LOOKAHEAD) {
+            refill(st);
+            if (st->error) {
+                // the tokens so far are dropped, a truncated program shouldn't look like a whole one
+                vm->push_data(vm->cons(vm->string("read failed in tokenize_stream()"), vm->cons(vm->integer(st->error), nil)));
+                return vm->sym("error");
+            }
+            continue;
+        }
+        if (st->start >= st->end) break;
+        pstate s = { .data = st->buf, .i = st->start, .len = st->end };
+        object* item = next_token(vm, &s);
+        if (!st->eof && s.i + LOOKAHEAD >= st->end) {
+            DBG("Token might straddle the chunk boundary");
+            refill(st);
+            continue;
+        }
+        st->start = s.i;
+        object* cell = vm->cons(item, nil);
+        if (cddr(cookie)) cdr(cddr(cookie)) = cell;
+        else car(tokens) = cell;
+        cdr(tokens) = cell;
+        // (the cookie has been through a collection if this thread has yielded)
+        vm->write_barrier(cell);
+        n++;
+    }
+    if (st->eof && st->start >= st->end) {
+        DBG("Done streaming tokens");
+        vm->push_data(car(tokens));
+        return nil;
+    }
+    // Yield so the other threads get a turn, and pick up here next time
+    vm->push_inst("tokenize_stream", nil, cookie);
+    return nil;
+}
+
+#undef LOOKAHEAD
+#undef cls
+#undef C_IDENT
+
+#undef pos
+#undef advance
+#undef next
+#undef look
+#undef at
+#undef here
+#undef eofp
+#undef test
+
+}
+
+
+// ------------------------- HASHMAPS (OBJECTS) -------------------------------
+
+namespace hashmap {
+
+// Each map node is a 32-way hash array mapped trie node. At depth d the slot for a hash is bits 5d..5d+4
+// of the hash. The bitmap says which slots are in use and entries[] only has room for those, so a slot's
+// index in entries[] is the number of bitmap bits below it. A slot holds either one property, or (if its
+// bit is also set in subnodes) the next node down in value.
+#define BITS 5
+#define FANOUT (1 << BITS)
+
+struct entry {
+    uint64_t hash;
+    object* key;
+    object* value;
+};
+
+struct node {
+    uint32_t bitmap;
+    uint32_t subnodes;
+    // set once more than one object or node points here: it must be copied before it is changed
+    bool shared;
+    // set if this node holds different keys that have the exact same hash. The entries are just
+    // searched in order and the bitmaps are unused.
+    bool collision;
+    uint32_t count;
+    entry entries[];
+};
+
+static inline node* N(object* o) {
+    return (node*)o->as_ptr;
+}
+
+static inline uint32_t bit_for(uint64_t hash, size_t depth) {
+    return 1u << ((hash >> (depth * BITS)) & (FANOUT - 1));
+}
+
+static inline entry* entry_for(node* n, uint32_t bit) {
+    return &n->entries[__builtin_popcount(n->bitmap & (bit - 1))];
+}
+
+// Most keys are interned or only equal to themselves, so equal keys are usually the same object
+static inline bool same_key(entry* e, object* key, uint64_t hash) {
+    return e->hash == hash && equal(e->key, key);
+}
+
+static object* mark_node(tinobsy::vm* vm, object* o) {
+    pvm* p = static_cast<pvm*>(vm);
+    node* n = N(o);
+    for (size_t i = 0; i < n->count; i++) {
+        p->shade(n->entries[i].key);
+        p->shade(n->entries[i].value);
+    }
+    return nil;
+}
+
+static void free_node(object* o) { arena::release(o->as_ptr); }
+
+const value_type node_type("hashmap_node", mark_node, free_node, NULL);
+
+static object* make_node(pvm* vm, size_t count, bool collision = false) {
+    node* n = (node*)vm->payloads.alloc(sizeof(node) + count * sizeof(entry));
+    n->bitmap = n->subnodes = 0;
+    n->shared = false;
+    n->collision = collision;
+    n->count = 0;
+    object* o = vm->alloc(&node_type);
+    o->as_ptr = (void*)n;
+    return o;
+}
+
+// Makes the node in *ref safe to change in place, copying it first if it is shared.
+static node* unshare(pvm* vm, object** ref) {
+    node* n = N(*ref);
+    if (!n->shared) return n;
+    DBG("Copying shared hashmap node");
+    object* copy = make_node(vm, n->count);
+    node* c = N(copy);
+    memcpy(c, n, sizeof(node) + n->count * sizeof(entry));
+    c->shared = false;
+    // The children now have two parents
+    for (uint32_t bits = n->subnodes; bits; bits &= bits - 1) N(entry_for(n, bits & -bits)->value)->shared = true;
+    *ref = copy;
+    vm->write_barrier(copy);
+    return c;
+}
+
+// Makes room for one more entry at index i and fills it.
+static void insert_index(pvm* vm, object* o, size_t i, uint64_t hash, object* key, object* val) {
+    node* n = N(o);
+    n = (node*)vm->payloads.resize(n, sizeof(node) + (n->count + 1) * sizeof(entry));
+    o->as_ptr = (void*)n;
+    memmove(&n->entries[i + 1], &n->entries[i], (n->count - i) * sizeof(entry));
+    n->entries[i].hash = hash;
+    n->entries[i].key = key;
+    n->entries[i].value = val;
+    n->count++;
+}
+
+static void insert_at(pvm* vm, object* o, uint32_t bit, uint64_t hash, object* key, object* val) {
+    node* n = N(o);
+    insert_index(vm, o, entry_for(n, bit) - n->entries, hash, key, val);
+    N(o)->bitmap |= bit;
+}
+
+static void remove_index(node* n, size_t i) {
+    memmove(&n->entries[i], &n->entries[i + 1], (n->count - i - 1) * sizeof(entry));
+    n->count--;
+}
+
+static void remove_at(node* n, uint32_t bit) {
+    remove_index(n, entry_for(n, bit) - n->entries);
+    n->bitmap &= ~bit;
+    n->subnodes &= ~bit;
+}
+
+// Returns the entry for the key, or NULL if it is not in the map.
+static entry* get(object* map, object* key, uint64_t hash) {
+    DBG("Searching hashmap for hash %" PRId64, hash);
+    for (size_t depth = 0; map; depth++) {
+        node* n = N(map);
+        if (n->collision) {
+            for (size_t i = 0; i < n->count; i++) {
+                if (same_key(&n->entries[i], key, hash)) return &n->entries[i];
+            }
+            return NULL;
+        }
+        uint32_t bit = bit_for(hash, depth);
+        if (!(n->bitmap & bit)) return NULL;
+        entry* e = entry_for(n, bit);
+        if (!(n->subnodes & bit)) return same_key(e, key, hash) ? e : NULL;
+        map = e->value;
+    }
+    return NULL;
+}
+
+// Adds or replaces the property. *map is updated if the root node changed.
+static void set(pvm* vm, object** map, object* key, uint64_t hash, object* val) {
+    DBG("Setting hash %" PRId64 " on hashmap.", hash);
+    // the nodes changed in place can be old, so everything new stored into them goes through the write barrier
+    vm->write_barrier(key);
+    vm->write_barrier(val);
+    for (size_t depth = 0;; depth++) {
+        if (!*map) {
+            *map = make_node(vm, 1);
+            vm->write_barrier(*map);
+        }
+        node* n = unshare(vm, map);
+        if (n->collision) {
+            for (size_t i = 0; i < n->count; i++) {
+                if (same_key(&n->entries[i], key, hash)) {
+                    n->entries[i].key = key;
+                    n->entries[i].value = val;
+                    return;
+                }
+            }
+            DBG("Adding another colliding key.");
+            insert_index(vm, *map, n->count, hash, key, val);
+            return;
+        }
+        uint32_t bit = bit_for(hash, depth);
+        if (!(n->bitmap & bit)) {
+            insert_at(vm, *map, bit, hash, key, val);
+            return;
+        }
+        entry* e = entry_for(n, bit);
+        if (n->subnodes & bit) {
+            node* child = N(e->value);
+            if (child->collision && child->entries[0].hash != hash) {
+                DBG("Different hash reached a collision node, putting a node in between.");
+                object* between = make_node(vm, 1);
+                uint32_t cbit = bit_for(child->entries[0].hash, depth + 1);
+                insert_at(vm, between, cbit, 0, nil, e->value);
+                N(between)->subnodes |= cbit;
+                e->value = between;
+                vm->write_barrier(between);
+            }
+        }
+        else if (same_key(e, key, hash)) {
+            e->key = key;
+            e->value = val;
+            return;
+        }
+        else {
+            // Push the existing property down into a new child node and try again there
+            object* child;
+            if (e->hash == hash) {
+                DBG("Full hash collision at depth %zu, making collision node.", depth);
+                child = make_node(vm, 2, true);
+                insert_index(vm, child, 0, e->hash, e->key, e->value);
+            } else {
+                DBG("Slot collision at depth %zu, pushing existing property down.", depth);
+                child = make_node(vm, 2);
+                insert_at(vm, child, bit_for(e->hash, depth + 1), e->hash, e->key, e->value);
+            }
+            e->hash = 0;
+            e->key = nil;
+            e->value = child;
+            vm->write_barrier(child);
+            n->subnodes |= bit;
+        }
+        map = &e->value;
+    }
+}
+
+// Removes the property, returns false if it wasn't there. Nodes left with a single property are folded into their parent.
+static bool remove(pvm* vm, object** map, object* key, uint64_t hash) {
+    if (!get(*map, key, hash)) return false;
+    // 13 normal nodes + 1 collision node at most
+    object** path[(64 + BITS - 1) / BITS + 1];
+    size_t depth = 0;
+    for (;; depth++) {
+        node* n = unshare(vm, map);
+        path[depth] = map;
+        if (n->collision) {
+            size_t i = 0;
+            while (!same_key(&n->entries[i], key, hash)) i++;
+            remove_index(n, i);
+            break;
+        }
+        uint32_t bit = bit_for(hash, depth);
+        if (!(n->subnodes & bit)) {
+            remove_at(n, bit);
+            break;
+        }
+        map = &entry_for(n, bit)->value;
+    }
+    for (; depth > 0; depth--) {
+        node* n = N(*path[depth]);
+        if (n->count > 1 || n->subnodes) break;
+        node* parent = N(*path[depth - 1]);
+        uint32_t bit = bit_for(hash, depth - 1);
+        if (n->count == 0) remove_at(parent, bit);
+        else {
+            DBG("Folding single property up into parent node");
+            *entry_for(parent, bit) = n->entries[0];
+            parent->subnodes &= ~bit;
+        }
+    }
+    if (N(*path[0])->count == 0) *path[0] = nil;
+    return true;
+}
+
+// Marks the whole map as shared, so it can be pointed to by another object.
+static void share(object* map) {
+    if (map) N(map)->shared = true;
+}
+
+// Walks the map and calls f(key, value, hash) for every property, in trie order.
+template <typename F>
+static void each(object* map, F f) {
+    if (!map) return;
+    node* n = N(map);
+    if (n->collision) {
+        for (size_t i = 0; i < n->count; i++) f(n->entries[i].key, n->entries[i].value, n->entries[i].hash);
+        return;
+    }
+    size_t i = 0;
+    for (uint32_t bits = n->bitmap; bits; bits &= bits - 1, i++) {
+        entry* e = &n->entries[i];
+        if (n->subnodes & (bits & -bits)) each(e->value, f);
+        else f(e->key, e->value, e->hash);
+    }
+}
+
+// Adds up the size of the map for benchmarking.
+static void measure(object* map, size_t depth, size_t* max_depth, size_t* bytes) {
+    if (!map) return;
+    node* n = N(map);
+    if (depth + 1 > *max_depth) *max_depth = depth + 1;
+    *bytes += sizeof(object) + sizeof(node) + n->count * sizeof(entry);
+    size_t i = 0;
+    for (uint32_t bits = n->bitmap; bits; bits &= bits - 1, i++) {
+        if (n->subnodes & (bits & -bits)) measure(n->entries[i].value, depth + 1, max_depth, bytes);
+    }
+}
+
+#undef BITS
+#undef FANOUT
+
+}
+
+object* pvm::find_property(object* obj, object* key, uint64_t hash, object** holder) {
+    // Try to find it directly.
+    object* val = this->get_own_property(obj, key, hash);
+    if (val) {
+        DBG("Own property.");
+        *holder = obj;
+        return val;
+    }
+    // Not found, traverse prototypes list (only object-objects have one).
+    *holder = nil;
+    if (obj->type != &obj_type) return nil;
+    for (object* p = car(obj); p; p = cdr(p)) {
+        if (!car(p)) continue;
+        val = this->find_property(car(p), key, hash, holder);
+        if (val) {
+            DBG("Parent property.");
+            return val;
+        }
+    }
+    return nil;
+}
+
+object* pvm::get_own_property(object* obj, object* key, uint64_t hash) {
+    // Check if it is an object-object (primitives have no own properties)
+    if (!obj || obj->type != &obj_type) return nil;
+    // Search the hashmap.
+    hashmap::entry* e = hashmap::get(cdr(obj), key, hash);
+    if (e) return e->value;
+    return nil;
+}
+
+object* pvm::get_property(object* obj, object* key, bool recurse) {
+    // Nil has no properties
+    if (!obj) return nil;
+    uint64_t hash = this->hash(key);
+    if (recurse) {
+        DBG("Inheritance requested get_property() {");
+        uint32_t epoch = this->property_epochs[hash & (PROPERTY_EPOCHS - 1)];
+        lookup_cache_entry* c = &this->lookup_cache[fmix64((uintptr_t)obj ^ hash) & (LOOKUP_CACHE_SIZE - 1)];
+        // Keys are interned, so the same key is the same pointer
+        if (c->obj == obj && c->key == key && c->epoch == epoch && c->generation == this->lookup_generation) {
+            DBG("Lookup cache hit. }");
+            this->lookup_cache_hits++;
+            return c->value;
+        }
+        this->lookup_cache_misses++;
+        c->value = this->find_property(obj, key, hash, &c->holder);
+        c->obj = obj;
+        c->key = key;
+        c->epoch = epoch;
+        c->generation = this->lookup_generation;
+        DBG("Property %sfound in inheritance tree. }", c->value ? "" : "not ");
+        return c->value;
+    }
+    return this->get_own_property(obj, key, hash);
+}
+
+double pvm::lookup_cache_hit_rate() {
+    size_t total = this->lookup_cache_hits + this->lookup_cache_misses;
+    return total ? (double)this->lookup_cache_hits / total : 0;
+}
+
+void pvm::clear_lookup_cache() {
+    memset(this->lookup_cache, 0, sizeof(this->lookup_cache));
+    this->drop_match_cache();
+}
+
+void pvm::drop_match_cache() {
+    free(this->match_cache);
+    this->match_cache = NULL;
+    this->match_cache_sets = 0;
+}
+
+void pvm::set_prototypes(object* obj, object* prototypes) {
+    if (!obj || obj->type != &obj_type) return;
+    car(obj) = prototypes;
+    this->write_barrier(prototypes);
+    // Any cached lookup could have gone through obj, and checking each of them costs more than starting over
+    this->lookup_generation++;
+    this->drop_match_cache();
+}
+
+bool pvm::set_property(object* obj, object* key, object* value) {
+    // Nil has no properties
+    if (!obj) return false;
+    // Check if it is an object-object (primitives have no own properties)
+    if (obj->type != &obj_type) return false;
+    uint64_t hash = this->hash(key);
+    // This may change what any inherited lookup of the hash finds
+    this->property_epochs[hash & (PROPERTY_EPOCHS - 1)]++;
+    hashmap::set(this, &cdr(obj), key, hash, value);
+    return true;
+}
+
+bool pvm::remove_property(object* obj, object* key) {
+    // Nil has no properties
+    if (!obj) return false;
+    // Check if it is an object-object (primitives have no own properties)
+    if (obj->type != &obj_type) return false;
+    uint64_t hash = this->hash(key);
+    this->property_epochs[hash & (PROPERTY_EPOCHS - 1)]++;
+    return hashmap::remove(this, &cdr(obj), key, hash);
+}
+
+object* pvm::clone_object(object* obj) {
+    if (!obj || obj->type != &obj_type) return nil;
+    object* copy = this->newobject(car(obj));
+    hashmap::share(cdr(obj));
+    cdr(copy) = cdr(obj);
+    return copy;
+}
+
+// Parked threads are kept in a hashmap (used as a set) keyed by the thread, so they are still marked but
+// the queue never sees them
+
+object* pvm::park_thread() {
+    object* thread = this->curr_thread();
+    if (!thread) return nil;
+    this->dequeue();
+    // the roots are rescanned through the queue, so the thread's stacks have to be shaded on the way out
+    // (or for a minor collection, looked through again however old the thread is)
+    if (this->gc_marking) this->rescan_thread(thread);
+    else if (this->generational_gc) {
+        if (this->remembered_len == this->remembered_cap) grow_list(&this->remembered, &this->remembered_cap);
+        this->remembered[this->remembered_len++] = thread;
+    }
+    hashmap::set(this, &this->parked, thread, this->hash(thread), thread);
+    this->num_parked++;
+    return thread;
+}
+
+bool pvm::unpark_thread(object* thread) {
+    if (!hashmap::remove(this, &this->parked, thread, this->hash(thread))) return false;
+    this->num_parked--;
+    this->enqueue(thread);
+    return true;
+}
+
+// ------------------ PATTERN MATCHING -----------------------------
+
+// Each pattern is compiled into a pattern object, and they are all indexed together in a discrimination tree.
+// A pattern starts with a run of elements that each match exactly one token (tokens, (any), type tests, and
+// captures of one of those), which are the edges of the tree, so patterns that start the same way share a path.
+// Matching walks the tree from each token of the statement, following the edge for the token (a hashmap lookup)
+// and the type tests it passes, so only the patterns that could match there are looked at. The rest of a pattern
+// (repetitions, alternations and longer captures) is matched by backtracking, and is indexed at the node it
+// hangs off by the tokens it can start with.
+//
+// Backtracking alone takes exponential time on patterns like (a+)+b, by trying every way of splitting the tokens
+// between the repetitions, and all of them end up in the same few places at the same token. What can match
+// from a place in the rest of a pattern only depends on the counts of the repetitions around it and on the
+// tokens from there on, so the places are numbered when a pattern is compiled, and the packrat cache remembers
+// which (place, counts, token) has failed, so none of them is tried twice. Only failures are kept: the first
+// success ends the search. The tokens are known by their cons cells, so the entries for the tokens after a
+// match are still good for the statement splice_match() makes of it, which shares them.
+
+// entries in each set of the packrat cache
+#define MATCH_CACHE_WAYS 4
+
+// a set of the packrat cache, most recently used first: the keys are a place (which is never 0) and the counts
+// there, and the cells are the statement's cells the rest was matched from (nil for after the last token)
+struct match_cache_set {
+    uint64_t keys[MATCH_CACHE_WAYS];
+    object* cells[MATCH_CACHE_WAYS];
+};
+
+namespace matcher {
+
+enum elem_kind {
+    // these match one token each
+    LITERAL,
+    ANY,
+    IS,
+    MATCHES,
+    // and these any number
+    CAPTURE,
+    REPEAT,
+    ALT
+};
+
+struct elem;
+
+struct seq {
+    elem* elems;
+    size_t len;
+};
+
+struct elem {
+    elem_kind kind;
+    bool lazy;
+    // how many times a REPEAT's body has to match (max is SIZE_MAX for no limit)
+    size_t min;
+    size_t max;
+    // the token, the type, the function, or the capture name
+    object* value;
+    // what a CAPTURE or REPEAT matches
+    seq body;
+    // the alternatives of an ALT
+    seq* alts;
+    size_t num_alts;
+    // places in the packrat cache (0 if they aren't cached): the rest of the sequence after a CAPTURE, REPEAT or
+    // ALT, and a REPEAT going around again; and which bit its count starts at in context::counts
+    uint32_t rest_point;
+    uint32_t repeat_point;
+    unsigned shift;
+};
+
+struct pattern {
+    object* handler;
+    int64_t precedence;
+    size_t specificity;
+    // the number it was defined as, later ones win ties
+    size_t order;
+    // elems[0..prefix_len) are the one token elements that make up its path through the tree
+    size_t prefix_len;
+    seq elems;
+    // the place in the packrat cache of the rest after the prefix
+    uint32_t tail_point;
+};
+
+static inline pattern* P(object* o) {
+    return (pattern*)o->as_ptr;
+}
+
+static inline bool is_test(const elem* e) {
+    return e->kind <= MATCHES;
+}
+
+// whether the element always matches exactly one token, and so can be an edge of the tree
+static inline bool is_single(const elem* e) {
+    return is_test(e) || (e->kind == CAPTURE && e->body.len == 1 && is_test(e->body.elems));
+}
+
+// the test a single token element does
+static inline const elem* test_of(const elem* e) {
+    return e->kind == CAPTURE ? e->body.elems : e;
+}
+
+static void shade_seq(pvm* vm, const seq* s) {
+    for (size_t i = 0; i < s->len; i++) {
+        const elem* e = &s->elems[i];
+        vm->shade(e->value);
+        shade_seq(vm, &e->body);
+        for (size_t j = 0; j < e->num_alts; j++) shade_seq(vm, &e->alts[j]);
+    }
+}
+
+static void free_seq(seq* s) {
+    for (size_t i = 0; i < s->len; i++) {
+        elem* e = &s->elems[i];
+        free_seq(&e->body);
+        for (size_t j = 0; j < e->num_alts; j++) free_seq(&e->alts[j]);
+        arena::release(e->alts);
+    }
+    arena::release(s->elems);
+}
+
+static object* mark_pattern(tinobsy::vm* vm, object* o) {
+    shade_seq(static_cast<pvm*>(vm), &P(o)->elems);
+    return P(o)->handler;
+}
+
+static void free_pattern(object* o) {
+    free_seq(&P(o)->elems);
+    arena::release(o->as_ptr);
+}
+
+const value_type pattern_type("pattern", mark_pattern, free_pattern, NULL);
+
+// ---- compiling ----
+
+// the length of a proper list, or SIZE_MAX if it isn't one
+static size_t list_length(object* list) {
+    size_t n = 0;
+    for (; list; list = cdr(list), n++) {
+        if (list->type != &cons_type) return SIZE_MAX;
+    }
+    return n;
+}
+
+static bool compile_seq(pvm* vm, object* list, seq* s);
+
+// Fills in e (which starts out zeroed) from the element x. If it returns false e may be half built, but free_seq() can still free it.
+static bool compile_elem(pvm* vm, object* x, elem* e) {
+    if (!x) return false;
+    if (x->type != &cons_type) {
+        e->kind = LITERAL;
+        e->value = x;
+        return true;
+    }
+    object* tag = car(x);
+    object* args = cdr(x);
+    size_t nargs = list_length(args);
+    if (nargs == SIZE_MAX) return false;
+    if (tag == vm->sym("any")) {
+        e->kind = ANY;
+        return nargs == 0;
+    }
+    if (tag == vm->sym("is") || tag == vm->sym("matches")) {
+        e->kind = tag == vm->sym("is") ? IS : MATCHES;
+        if (nargs != 1 || !car(args)) return false;
+        e->value = car(args);
+        if (e->kind == IS) return e->value->type == &obj_type || e->value->type == &symbol_type;
+        return e->value->type == &c_function_type;
+    }
+    if (tag == vm->sym("capture")) {
+        e->kind = CAPTURE;
+        if (nargs < 2 || !car(args) || car(args)->type != &symbol_type) return false;
+        e->value = car(args);
+        return compile_seq(vm, cdr(args), &e->body);
+    }
+    if (tag == vm->sym("repeat") || tag == vm->sym("lazy")) {
+        e->kind = REPEAT;
+        e->lazy = tag == vm->sym("lazy");
+        if (nargs < 3) return false;
+        object* min = car(args);
+        object* max = car(cdr(args));
+        if (!min || min->type != &integer_type || min->as_big_int < 0) return false;
+        if (max && (max->type != &integer_type || max->as_big_int < min->as_big_int || !max->as_big_int)) return false;
+        e->min = min->as_big_int;
+        e->max = max ? max->as_big_int : SIZE_MAX;
+        return compile_seq(vm, cdr(cdr(args)), &e->body);
+    }
+    if (tag == vm->sym("alt")) {
+        e->kind = ALT;
+        if (!nargs) return false;
+        e->alts = (seq*)vm->payloads.alloc(nargs * sizeof(seq));
+        memset(e->alts, 0, nargs * sizeof(seq));
+        e->num_alts = nargs;
+        for (size_t i = 0; i < nargs; i++, args = cdr(args)) {
+            if (!compile_seq(vm, car(args), &e->alts[i])) return false;
+        }
+        return true;
+    }
+    return false;
+}
+
+static bool compile_seq(pvm* vm, object* list, seq* s) {
+    size_t n = list_length(list);
+    if (n == SIZE_MAX) return false;
+    if (!n) return true;
+    s->elems = (elem*)vm->payloads.alloc(n * sizeof(elem));
+    memset(s->elems, 0, n * sizeof(elem));
+    s->len = n;
+    for (size_t i = 0; i < n; i++, list = cdr(list)) {
+        if (!compile_elem(vm, car(list), &s->elems[i])) return false;
+    }
+    return true;
+}
+
+// tokens count 2 and type tests 1, for as many as any match of the elements has to have
+static size_t specificity(const seq* s) {
+    size_t n = 0;
+    for (size_t i = 0; i < s->len; i++) {
+        const elem* e = &s->elems[i];
+        switch (e->kind) {
+            case LITERAL: n += 2; break;
+            case IS: case MATCHES: n += 1; break;
+            case ANY: break;
+            case CAPTURE: n += specificity(&e->body); break;
+            case REPEAT: n += e->min * specificity(&e->body); break;
+            case ALT: {
+                size_t least = SIZE_MAX;
+                for (size_t j = 0; j < e->num_alts; j++) {
+                    size_t k = specificity(&e->alts[j]);
+                    if (k < least) least = k;
+                }
+                n += least;
+                break;
+            }
+        }
+    }
+    return n;
+}
+
+// a new place for the packrat cache, or 0 when they have run out
+static uint32_t new_point(uint32_t* points) {
+    return *points == UINT32_MAX ? 0 : ++*points;
+}
+
+// The bits a REPEAT's count takes in context::counts. Without a limit the counts past min make no difference to
+// what can match, so they all count as min, otherwise they go up to max.
+static unsigned count_bits(const elem* e) {
+    size_t most = e->max == SIZE_MAX ? e->min : e->max;
+    unsigned bits = 0;
+    while (bits < 64 && most >> bits) bits++;
+    return bits;
+}
+
+// Numbers the places in the sequence for the packrat cache. The counts of the REPEATs around a place are packed
+// into 32 bits from shift up; inside one that doesn't fit (or when cached is false) nothing is cached.
+static void assign_points(uint32_t* points, seq* s, unsigned shift, bool cached) {
+    for (size_t i = 0; i < s->len; i++) {
+        elem* e = &s->elems[i];
+        if (is_test(e)) continue;
+        if (cached) e->rest_point = new_point(points);
+        switch (e->kind) {
+            case CAPTURE:
+                assign_points(points, &e->body, shift, cached);
+                break;
+            case REPEAT: {
+                unsigned bits = count_bits(e);
+                bool fits = cached && shift + bits <= 32;
+                if (fits) {
+                    e->repeat_point = new_point(points);
+                    e->shift = shift;
+                }
+                assign_points(points, &e->body, shift + bits, fits && e->repeat_point);
+                break;
+            }
+            default:
+                for (size_t j = 0; j < e->num_alts; j++) assign_points(points, &e->alts[j], shift, cached);
+        }
+    }
+}
+
+// ---- the tree ----
+
+struct node {
+    // the child for each token, a hashmap
+    object* literals;
+    // alists of (type . child) and (function . child), for the IS and MATCHES edges
+    object* types;
+    object* predicates;
+    object* any;
+    // the patterns that have matched once the path to here has, best first
+    object* ends;
+    // The patterns with more to match whose rest can start with something other than a token (or with nothing
+    // at all), best first. The ones whose rest has to start with a token are in firsts of the child for it,
+    // so the lookup that follows the edge finds them too.
+    object* rest_others;
+    // the patterns of the parent whose rest starts with the token that leads here, best first
+    object* firsts;
+};
+
+static inline node* N(object* o) {
+    return (node*)o->as_ptr;
+}
+
+static object* mark_node(tinobsy::vm* vm, object* o) {
+    pvm* p = static_cast<pvm*>(vm);
+    node* n = N(o);
+    p->shade(n->literals);
+    p->shade(n->types);
+    p->shade(n->predicates);
+    p->shade(n->any);
+    p->shade(n->ends);
+    p->shade(n->rest_others);
+    return n->firsts;
+}
+
+static void free_node(object* o) { arena::release(o->as_ptr); }
+
+const value_type node_type("pattern_node", mark_node, free_node, NULL);
+
+static object* make_node(pvm* vm) {
+    node* n = (node*)vm->payloads.alloc(sizeof(node));
+    memset(n, 0, sizeof(node));
+    object* o = vm->alloc(&node_type);
+    o->as_ptr = (void*)n;
+    return o;
+}
+
+// Everything the tree is changed to point to is either newly allocated or reachable from the new pattern,
+// which alloc() shades if a collection is marking. The nodes can be old though, so for minor collections
+// what is stored into them goes through the write barrier.
+
+// the child of the node along the edge for the token, made if it isn't there yet
+static object* literal_child(pvm* vm, object* n, object* token) {
+    uint64_t hash = vm->hash(token);
+    hashmap::entry* e = hashmap::get(N(n)->literals, token, hash);
+    if (e) return e->value;
+    object* c = make_node(vm);
+    hashmap::set(vm, &N(n)->literals, token, hash, c);
+    return c;
+}
+
+// the same for the edge for any test
+static object* child(pvm* vm, object* n, const elem* test) {
+    switch (test->kind) {
+        case LITERAL:
+            return literal_child(vm, n, test->value);
+        case IS:
+        case MATCHES: {
+            object** edges = test->kind == IS ? &N(n)->types : &N(n)->predicates;
+            object* pair = assoc(*edges, test->value);
+            if (pair) return cdr(pair);
+            object* c = make_node(vm);
+            vm->push(vm->cons(test->value, c), *edges);
+            vm->write_barrier(*edges);
+            return c;
+        }
+        default:
+            if (!N(n)->any) {
+                N(n)->any = make_node(vm);
+                vm->write_barrier(N(n)->any);
+            }
+            return N(n)->any;
+    }
+}
+
+// whether a should be picked over b when they match at the same place
+static inline bool outranks(pattern* a, pattern* b) {
+    if (a->precedence != b->precedence) return a->precedence > b->precedence;
+    if (a->specificity != b->specificity) return a->specificity > b->specificity;
+    return a->order > b->order;
+}
+
+static void insert_sorted(pvm* vm, object** list, object* pat) {
+    while (*list && !outranks(P(pat), P(car(*list)))) list = &cdr(*list);
+    *list = vm->cons(pat, *list);
+    vm->write_barrier(*list);
+}
+
+// Adds the tokens the elements from s[from] on can start with to tokens, and sets *others if they can start
+// with a type test or (any). Returns whether they can match nothing at all.
+static bool first(pvm* vm, const seq* s, size_t from, object** tokens, bool* others) {
+    for (size_t i = from; i < s->len; i++) {
+        const elem* e = &s->elems[i];
+        bool empty = false;
+        switch (e->kind) {
+            case LITERAL:
+                if (!assoc(*tokens, e->value)) vm->push(vm->cons(e->value, nil), *tokens);
+                break;
+            case ANY: case IS: case MATCHES: *others = true; break;
+            case CAPTURE: empty = first(vm, &e->body, 0, tokens, others); break;
+            case REPEAT: empty = first(vm, &e->body, 0, tokens, others) || !e->min; break;
+            case ALT:
+                for (size_t j = 0; j < e->num_alts; j++) empty |= first(vm, &e->alts[j], 0, tokens, others);
+                break;
+        }
+        if (!empty) return false;
+    }
+    return true;
+}
+
+// puts the pattern at the node its prefix leads to
+static void add(pvm* vm, object* n, object* pat) {
+    pattern* p = P(pat);
+    if (p->prefix_len == p->elems.len) {
+        insert_sorted(vm, &N(n)->ends, pat);
+        return;
+    }
+    object* tokens = nil;
+    bool others = false;
+    if (first(vm, &p->elems, p->prefix_len, &tokens, &others) || others) {
+        insert_sorted(vm, &N(n)->rest_others, pat);
+        return;
+    }
+    for (; tokens; tokens = cdr(tokens)) insert_sorted(vm, &N(literal_child(vm, n, car(car(tokens))))->firsts, pat);
+}
+
+// ---- matching ----
+
+// the tokenizer's runs of spaces and tabs (newlines are tokens of their own)
+static inline bool is_space(object* t) {
+    return t && t->type == &symbol_type && (parser::classes.of[(unsigned char)t->as_chars[0]] & parser::C_SPACE);
+}
+
+// whether x is the object type or inherits from it, or has the type named by the symbol type
+static bool is_a(object* x, object* type) {
+    if (!x) return false;
+    if (type->type == &symbol_type) return !strcmp(x->type->name, type->as_chars);
+    if (x == type) return true;
+    if (x->type != &obj_type) return false;
+    for (object* p = car(x); p; p = cdr(p)) {
+        if (car(p) && is_a(car(p), type)) return true;
+    }
+    return false;
+}
+
+static inline bool test(pvm* vm, const elem* e, object* token) {
+    switch (e->kind) {
+        case LITERAL: return token && equal(e->value, token);
+        case IS: return is_a(token, e->value);
+        case MATCHES: return vm->fptr(e->value)(vm, token, nil) != nil;
+        default: return true;
+    }
+}
+
+// statements shorter than this don't need anything malloc()ed
+#define MATCH_INLINE 32
+
+struct capture {
+    const elem* e;
+    size_t start;
+    size_t end;
+};
+
+// Where in a pattern's rest the matcher is, besides the place: the counts of the REPEATs around it (packed as
+// assign_points() says), and the token the innermost one's time around started at (NO_ROUND outside of them).
+// A time around that matches nothing ends the repetition, so what can match depends on that start until a token
+// has been matched after it, and till then the places aren't cached.
+struct context {
+    uint32_t counts;
+    size_t round_start;
+};
+
+#define NO_ROUND SIZE_MAX
+
+// the context of the start of a pattern's rest
+static const context outside = { 0, NO_ROUND };
+
+// What is left to match after the elements being matched: the rest of a sequence, the end of a capture, or the
+// next time around a repetition. Each one goes on with the one at index next (NO_CONT is the end of the pattern).
+struct cont {
+    enum { SEQ, CAPTURE_END, REPEAT_NEXT } kind;
+    // SEQ: the sequence and the index to go on from (after the element e)
+    const seq* s;
+    size_t i;
+    // CAPTURE_END: the capture and where it started; REPEAT_NEXT: the repetition, the times it has matched
+    // (counting the one that just did) and where that one started
+    const elem* e;
+    size_t count;
+    size_t from;
+    // SEQ and REPEAT_NEXT: the context of the sequence
+    context ctx;
+    size_t next;
+};
+
+#define NO_CONT SIZE_MAX
+
+// Where to go back to when what is being tried fails: the next alternative of an ALT, the other way on from a
+// REPEAT (leaving it, or going around again), or a place in the packrat cache that has failed once everything
+// tried after it has. The captures and continuations made since it was pushed are dropped on the way back.
+struct choice {
+    enum { ALT, LEAVE, AGAIN, FAILED } kind;
+    const elem* e;
+    // ALT: the alternative to try; AGAIN: the times the repetition has matched
+    size_t n;
+    size_t pos;
+    size_t k;
+    context ctx;
+    // FAILED: the place and counts
+    uint64_t key;
+    size_t caps_len;
+    size_t conts_len;
+};
+
+// what get_best_match() keeps while it looks
+struct search {
+    pvm* vm;
+    // the statement's tokens without the spaces, their hashes, and where each one is in the statement
+    object** tokens;
+    uint64_t* hashes;
+    size_t* index;
+    size_t len;
+    // the cons cell each token is the car of (and nil after the last), which the packrat cache knows them by
+    object** cells;
+    // the packrat cache (NULL if it is off), and its number of sets minus 1
+    match_cache_set* cache;
+    size_t cache_mask;
+    // the captures made so far by the rest of the pattern being matched, undone as it backtracks
+    capture* caps;
+    size_t caps_len;
+    size_t caps_cap;
+    // and its continuations and choice points
+    cont* conts;
+    size_t conts_len;
+    size_t conts_cap;
+    choice* choices;
+    size_t choices_len;
+    size_t choices_cap;
+    // the best match so far
+    object* best;
+    size_t best_start;
+    size_t best_end;
+};
+
+// makes room for one more on one of the search's stacks (the first MATCH_INLINE are on get_best_match()'s stack)
+static void* reserve(void* items, size_t len, size_t* cap, size_t size) {
+    if (len < *cap) return items;
+    void* bigger = malloc(2 * *cap * size);
+    memcpy(bigger, items, len * size);
+    if (*cap > MATCH_INLINE) free(items);
+    *cap *= 2;
+    return bigger;
+}
+
+static void push_capture(search* s, const elem* e, size_t start, size_t end) {
+    s->caps = (capture*)reserve(s->caps, s->caps_len, &s->caps_cap, sizeof(capture));
+    capture* c = &s->caps[s->caps_len++];
+    c->e = e;
+    c->start = start;
+    c->end = end;
+}
+
+static size_t push_cont(search* s, const cont& c) {
+    s->conts = (cont*)reserve(s->conts, s->conts_len, &s->conts_cap, sizeof(cont));
+    s->conts[s->conts_len] = c;
+    return s->conts_len++;
+}
+
+static void push_choice(search* s, choice c) {
+    c.caps_len = s->caps_len;
+    c.conts_len = s->conts_len;
+    s->choices = (choice*)reserve(s->choices, s->choices_len, &s->choices_cap, sizeof(choice));
+    s->choices[s->choices_len++] = c;
+}
+
+// the place and counts, if what can match from them at pos can be cached, otherwise 0
+static inline uint64_t cache_key(search* s, uint32_t point, uint32_t counts, context ctx, size_t pos) {
+    if (!point || !s->cache || (ctx.round_start != NO_ROUND && pos == ctx.round_start)) return 0;
+    return (uint64_t)point << 32 | counts;
+}
+
+static inline match_cache_set* cache_set(search* s, uint64_t key, object* cell) {
+    uint64_t h = (key ^ (uint64_t)(uintptr_t)cell) * 0x9e3779b97f4a7c15ull;
+    return &s->cache[(h ^ h >> 32) & s->cache_mask];
+}
+
+// whether the rest has already failed to match from pos there, which makes that entry the most recently used
+static bool failed_before(search* s, uint64_t key, size_t pos) {
+    object* cell = s->cells[pos];
+    match_cache_set* set = cache_set(s, key, cell);
+    for (size_t j = 0; j < MATCH_CACHE_WAYS; j++) {
+        if (set->keys[j] != key || set->cells[j] != cell) continue;
+        memmove(&set->keys[1], &set->keys[0], j * sizeof(uint64_t));
+        memmove(&set->cells[1], &set->cells[0], j * sizeof(object*));
+        set->keys[0] = key;
+        set->cells[0] = cell;
+        s->vm->match_cache_hits++;
+        return true;
+    }
+    return false;
+}
+
+// remembers that it has, in place of the least recently used entry of the set
+static void remember_failure(search* s, uint64_t key, size_t pos) {
+    object* cell = s->cells[pos];
+    match_cache_set* set = cache_set(s, key, cell);
+    if (set->keys[MATCH_CACHE_WAYS - 1]) s->vm->match_cache_evictions++;
+    memmove(&set->keys[1], &set->keys[0], (MATCH_CACHE_WAYS - 1) * sizeof(uint64_t));
+    memmove(&set->cells[1], &set->cells[0], (MATCH_CACHE_WAYS - 1) * sizeof(object*));
+    set->keys[0] = key;
+    set->cells[0] = cell;
+}
+
+// Whether the place (key 0 for one that isn't cached) has failed from pos before. If it hasn't, a choice point
+// is pushed to remember it if it does this time.
+static bool cached_failure(search* s, uint64_t key, size_t pos) {
+    if (!key) return false;
+    if (failed_before(s, key, pos)) return true;
+    choice c = { choice::FAILED, NULL, 0, pos, NO_CONT, outside, key, 0, 0 };
+    push_choice(s, c);
+    return false;
+}
+
+// the count of the repetition as it goes in context::counts
+static inline uint32_t saturate(const elem* e, size_t count) {
+    return (uint32_t)(e->max == SIZE_MAX && count > e->min ? e->min : count) << e->shift;
+}
+
+// starts another time around the repetition, which has matched count times, from pos: its body is matched with
+// *ctx changed to the context inside it and *k to what comes after that time around
+static void go_around(search* s, const elem* e, size_t count, size_t pos, size_t* k, context* ctx) {
+    cont again = { cont::REPEAT_NEXT, NULL, 0, e, count + 1, pos, *ctx, *k };
+    *k = push_cont(s, again);
+    ctx->counts = e->repeat_point ? ctx->counts | saturate(e, count + 1) : 0;
+    ctx->round_start = pos;
+}
+
+// Matches q->elems[i..] from the token at pos, and then the rest of the pattern. point is their place in the
+// packrat cache (0 to not look it up). If it all matches, *end is where it ended and s->caps has the captures.
+// It backtracks through the choice points on s->choices instead of the C stack, so a repetition can go around
+// as many times as there are tokens.
+static bool match_rest(search* s, uint32_t point, const seq* q, size_t i, size_t pos, size_t* end) {
+    s->caps_len = s->conts_len = s->choices_len = 0;
+    enum { MATCHING, RESUMING, REPEATING, FAILING } op = MATCHING;
+    size_t k = NO_CONT;
+    context ctx = outside;
+    // REPEAT: the repetition and the times it has matched
+    const elem* e = NULL;
+    size_t count = 0;
+    if (cached_failure(s, cache_key(s, point, 0, ctx, pos), pos)) return false;
+    for (;;) {
+        switch (op) {
+            // the tests up to the next element that isn't one, which is started
+            case MATCHING: {
+                s->vm->match_steps++;
+                for (; i < q->len && is_test(&q->elems[i]); i++, pos++) {
+                    if (pos == s->len || !test(s->vm, &q->elems[i], s->tokens[pos])) break;
+                }
+                if (i == q->len) {
+                    op = RESUMING;
+                    break;
+                }
+                e = &q->elems[i];
+                if (is_test(e)) {
+                    op = FAILING;
+                    break;
+                }
+                cont rest = { cont::SEQ, q, i + 1, e, 0, 0, ctx, k };
+                k = push_cont(s, rest);
+                i = 0;
+                if (e->kind == CAPTURE) {
+                    cont close = { cont::CAPTURE_END, NULL, 0, e, 0, pos, ctx, k };
+                    k = push_cont(s, close);
+                    q = &e->body;
+                } else if (e->kind == REPEAT) {
+                    count = 0;
+                    op = REPEATING;
+                } else {
+                    if (e->num_alts > 1) {
+                        choice c = { choice::ALT, e, 1, pos, k, ctx, 0, 0, 0 };
+                        push_choice(s, c);
+                    }
+                    q = &e->alts[0];
+                }
+                break;
+            }
+            // goes on with k
+            case RESUMING: {
+                if (k == NO_CONT) {
+                    *end = pos;
+                    return true;
+                }
+                const cont* c = &s->conts[k];
+                k = c->next;
+                if (c->kind == cont::SEQ) {
+                    q = c->s;
+                    i = c->i;
+                    ctx = c->ctx;
+                    op = cached_failure(s, cache_key(s, c->e->rest_point, ctx.counts, ctx, pos), pos) ? FAILING : MATCHING;
+                } else if (c->kind == cont::CAPTURE_END) {
+                    push_capture(s, c->e, c->from, pos);
+                } else if (pos != c->from) {
+                    // (a time around that matched nothing would match nothing forever, so that's enough of them)
+                    e = c->e;
+                    count = c->count;
+                    ctx = c->ctx;
+                    op = REPEATING;
+                }
+                break;
+            }
+            // matches the repetition e when it has matched count times already, then goes on with k
+            case REPEATING: {
+                s->vm->match_steps++;
+                if (cached_failure(s, cache_key(s, e->repeat_point, ctx.counts | saturate(e, count), ctx, pos), pos)) {
+                    op = FAILING;
+                    break;
+                }
+                bool more = count < e->max;
+                bool enough = count >= e->min;
+                if (e->lazy && enough) {
+                    if (more) {
+                        choice c = { choice::AGAIN, e, count, pos, k, ctx, 0, 0, 0 };
+                        push_choice(s, c);
+                    }
+                    op = RESUMING;
+                } else if (more) {
+                    if (enough) {
+                        choice c = { choice::LEAVE, e, 0, pos, k, ctx, 0, 0, 0 };
+                        push_choice(s, c);
+                    }
+                    go_around(s, e, count, pos, &k, &ctx);
+                    q = &e->body;
+                    i = 0;
+                    op = MATCHING;
+                } else {
+                    op = enough ? RESUMING : FAILING;
+                }
+                break;
+            }
+            // backtracks to the last choice point
+            case FAILING: {
+                if (!s->choices_len) return false;
+                choice c = s->choices[--s->choices_len];
+                s->caps_len = c.caps_len;
+                s->conts_len = c.conts_len;
+                pos = c.pos;
+                k = c.k;
+                ctx = c.ctx;
+                if (c.kind == choice::FAILED) {
+                    remember_failure(s, c.key, pos);
+                } else if (c.kind == choice::ALT) {
+                    q = &c.e->alts[c.n];
+                    i = 0;
+                    if (++c.n < c.e->num_alts) push_choice(s, c);
+                    op = MATCHING;
+                } else if (c.kind == choice::LEAVE) {
+                    op = RESUMING;
+                } else {
+                    go_around(s, c.e, c.n, pos, &k, &ctx);
+                    q = &c.e->body;
+                    i = 0;
+                    op = MATCHING;
+                }
+                break;
+            }
+        }
+    }
+}
+
+// whether the pattern matching at start would beat the best match so far
+static inline bool could_win(search* s, pattern* p, size_t start) {
+    if (!s->best) return true;
+    pattern* b = P(s->best);
+    if (p->precedence != b->precedence) return p->precedence > b->precedence;
+    if (p->specificity != b->specificity) return p->specificity > b->specificity;
+    return start == s->best_start && p->order > b->order;
+}
+
+// Tries the patterns in the list (best first) whose rest starts at pos. Once one can't win, none of the ones after it can.
+static void try_rests(search* s, object* list, size_t start, size_t pos) {
+    for (; list; list = cdr(list)) {
+        pattern* p = P(car(list));
+        if (!could_win(s, p, start)) return;
+        size_t end;
+        if (match_rest(s, p->tail_point, &p->elems, p->prefix_len, pos, &end) && end > start) {
+            s->best = car(list);
+            s->best_start = start;
+            s->best_end = end;
+            return;
+        }
+    }
+}
+
+// follows every edge the token at pos passes from the node, where the path to it matched the tokens from start
+static void walk(search* s, object* n, size_t start, size_t pos) {
+    node* d = N(n);
+    if (d->ends && could_win(s, P(car(d->ends)), start)) {
+        s->best = car(d->ends);
+        s->best_start = start;
+        s->best_end = pos;
+    }
+    try_rests(s, d->rest_others, start, pos);
+    if (pos == s->len) return;
+    object* token = s->tokens[pos];
+    if (token && d->literals) {
+        hashmap::entry* e = hashmap::get(d->literals, token, s->hashes[pos]);
+        if (e) {
+            try_rests(s, N(e->value)->firsts, start, pos);
+            walk(s, e->value, start, pos + 1);
+        }
+    }
+    for (object* l = d->types; l; l = cdr(l)) {
+        if (is_a(token, car(car(l)))) walk(s, cdr(car(l)), start, pos + 1);
+    }
+    for (object* l = d->predicates; l; l = cdr(l)) {
+        if (s->vm->fptr(car(car(l)))(s->vm, token, nil)) walk(s, cdr(car(l)), start, pos + 1);
+    }
+    if (d->any) walk(s, d->any, start, pos + 1);
+}
+
+}
+
+object* pvm::define_pattern(object* elements, object* handler, int64_t precedence) {
+    if (!handler || (handler->type != &symbol_type && handler->type != &opcode_type)) return nil;
+    matcher::pattern* p = (matcher::pattern*)this->payloads.alloc(sizeof(matcher::pattern));
+    memset(p, 0, sizeof(matcher::pattern));
+    if (!matcher::compile_seq(this, elements, &p->elems) || !p->elems.len) {
+        DBG("Not a valid pattern");
+        matcher::free_seq(&p->elems);
+        arena::release(p);
+        return nil;
+    }
+    p->handler = handler;
+    p->precedence = precedence;
+    p->specificity = matcher::specificity(&p->elems);
+    p->order = this->num_patterns++;
+    while (p->prefix_len < p->elems.len && matcher::is_single(&p->elems.elems[p->prefix_len])) p->prefix_len++;
+    if (p->prefix_len < p->elems.len) p->tail_point = matcher::new_point(&this->match_points);
+    matcher::assign_points(&this->match_points, &p->elems, 0, true);
+    object* pat = this->alloc(&matcher::pattern_type);
+    pat->as_ptr = (void*)p;
+    if (!this->patterns) this->patterns = matcher::make_node(this);
+    object* n = this->patterns;
+    for (size_t i = 0; i < p->prefix_len; i++) n = matcher::child(this, n, matcher::test_of(&p->elems.elems[i]));
+    matcher::add(this, n, pat);
+    return pat;
+}
+
+object* get_best_match(pvm* vm, object* statement, pattern_match* m) {
+    memset(m, 0, sizeof(pattern_match));
+    if (!vm->patterns) return nil;
+    size_t n = 0;
+    for (object* t = statement; t; t = cdr(t)) n++;
+    object* tokens[MATCH_INLINE];
+    uint64_t hashes[MATCH_INLINE];
+    size_t index[MATCH_INLINE];
+    object* cells[MATCH_INLINE + 1];
+    matcher::capture caps[MATCH_INLINE];
+    matcher::cont conts[MATCH_INLINE];
+    matcher::choice choices[MATCH_INLINE];
+    matcher::search s;
+    s.vm = vm;
+    s.tokens = n <= MATCH_INLINE ? tokens : (object**)malloc(n * sizeof(object*));
+    s.hashes = n <= MATCH_INLINE ? hashes : (uint64_t*)malloc(n * sizeof(uint64_t));
+    s.index = n <= MATCH_INLINE ? index : (size_t*)malloc(n * sizeof(size_t));
+    s.cells = n <= MATCH_INLINE ? cells : (object**)malloc((n + 1) * sizeof(object*));
+    s.len = 0;
+    if (!vm->match_cache && vm->match_cache_size >= MATCH_CACHE_WAYS) {
+        size_t sets = 1;
+        while (sets * 2 * MATCH_CACHE_WAYS <= vm->match_cache_size) sets *= 2;
+        vm->match_cache = (match_cache_set*)calloc(sets, sizeof(match_cache_set));
+        vm->match_cache_sets = sets;
+    }
+    s.cache = vm->match_cache;
+    s.cache_mask = vm->match_cache_sets - 1;
+    s.caps = caps;
+    s.caps_len = 0;
+    s.caps_cap = MATCH_INLINE;
+    s.conts = conts;
+    s.conts_len = 0;
+    s.conts_cap = MATCH_INLINE;
+    s.choices = choices;
+    s.choices_len = 0;
+    s.choices_cap = MATCH_INLINE;
+    s.best = nil;
+    s.best_start = s.best_end = 0;
+    size_t i = 0;
+    for (object* t = statement; t; t = cdr(t), i++) {
+        object* token = car(t);
+        if (matcher::is_space(token)) continue;
+        s.tokens[s.len] = token;
+        s.hashes[s.len] = token ? vm->hash(token) : 0;
+        s.cells[s.len] = t;
+        s.index[s.len++] = i;
+    }
+    s.cells[s.len] = nil;
+    for (size_t start = 0; start < s.len; start++) matcher::walk(&s, vm->patterns, start, start);
+    if (s.best) {
+        matcher::pattern* p = matcher::P(s.best);
+        // the captures in the rest of the pattern are only kept for the winner, by matching its rest again
+        size_t end;
+        matcher::match_rest(&s, 0, &p->elems, p->prefix_len, s.best_start + p->prefix_len, &end);
+        ASSERT(end == s.best_end);
+        object* bindings = nil;
+        // pushed in the order they were made, so later captures with the same name are found first
+        for (size_t j = 0; j < p->prefix_len; j++) {
+            const matcher::elem* e = &p->elems.elems[j];
+            if (e->kind == matcher::CAPTURE) vm->push(vm->cons(e->value, s.tokens[s.best_start + j]), bindings);
+        }
+        for (size_t j = 0; j < s.caps_len; j++) {
+            matcher::capture* c = &s.caps[j];
+            object* value = nil;
+            if (matcher::is_single(c->e)) value = s.tokens[c->start];
+            else {
+                for (size_t k = c->end; k > c->start; k--) vm->push(s.tokens[k - 1], value);
+            }
+            vm->push(vm->cons(c->e->value, value), bindings);
+        }
+        m->pattern = s.best;
+        m->handler = p->handler;
+        m->bindings = bindings;
+        m->start = s.index[s.best_start];
+        m->end = s.index[s.best_end - 1] + 1;
+    }
+    if (n > MATCH_INLINE) {
+        free(s.tokens);
+        free(s.hashes);
+        free(s.index);
+        free(s.cells);
+    }
+    if (s.caps_cap > MATCH_INLINE) free(s.caps);
+    if (s.conts_cap > MATCH_INLINE) free(s.conts);
+    if (s.choices_cap > MATCH_INLINE) free(s.choices);
+    return m->pattern;
+}
+
+#undef MATCH_INLINE
+#undef MATCH_CACHE_WAYS
+#undef NO_ROUND
+#undef NO_CONT
+
+// Eval(list) ::= apply the best matching pattern to the list and eval the result, else the list if no patterns match
+object* eval(pvm* vm, object* cookie, object* inst_type) {
+    (void)cookie;
+    (void)inst_type;
+    object* statement = vm->pop();
+    pattern_match m;
+    if (!get_best_match(vm, statement, &m)) {
+        DBG("No patterns match");
+        vm->push_data(statement);
+        return nil;
+    }
+    // the handler runs first, then what it leaves is spliced into the statement, and that is evaluated again
+    vm->push_inst("eval");
+    vm->push_inst("splice_match", nil, vm->cons(statement, vm->cons(vm->integer(m.start), vm->integer(m.end))));
+    vm->push_inst(m.handler);
+    vm->push_data(m.bindings);
+    return nil;
+}
+
+object* splice_match(pvm* vm, object* cookie, object* inst_type) {
+    (void)inst_type;
+    object* result = vm->pop();
+    object* statement = car(cookie);
+    int64_t start = vm->intof(car(cdr(cookie)));
+    int64_t end = vm->intof(cdr(cdr(cookie)));
+    // the tokens before the match are copied, the ones after it are shared with the old statement
+    object* spliced = nil;
+    object** tail = &spliced;
+    for (int64_t i = 0; i < end; i++, statement = cdr(statement)) {
+        if (i < start) {
+            *tail = vm->cons(car(statement), nil);
+            tail = &cdr(*tail);
+        }
+    }
+    if (result) {
+        *tail = vm->cons(result, nil);
+        tail = &cdr(*tail);
+    }
+    *tail = statement;
+    vm->push_data(spliced);
+    return nil;
+}
+
+// ------------------------- POINTER TABLE -------------------------------
+
+// Open addressing map from objects to int64_t, for walks over the heap that have to know
+// which objects they have already been to (the dumper and heap images).
+struct pointer_table {
+    struct slot_t {
+        object* key;
+        int64_t value;
+    };
+    slot_t* slots;
+    size_t mask;
+    size_t count = 0;
+
+    pointer_table() {
+        this->mask = 255;
+        this->slots = (slot_t*)calloc(this->mask + 1, sizeof(slot_t));
+    }
+    ~pointer_table() { free(this->slots); }
+
+    slot_t* slot(object* key) {
+        size_t i = ((uintptr_t)key * 0x9E3779B97F4A7C15ULL) >> 20;
+        for (;; i++) {
+            slot_t* s = &this->slots[i & this->mask];
+            if (s->key == key || s->key == NULL) return s;
+        }
+    }
+
+    // the key's value, or NULL if it isn't there
+    int64_t* find(object* key) {
+        slot_t* s = this->slot(key);
+        return s->key ? &s->value : NULL;
+    }
+
+    // the key's value, added as 0 if it isn't there yet (*added says which)
+    int64_t* get(object* key, bool* added) {
+        if ((this->count + 1) * 2 > this->mask) this->grow();
+        slot_t* s = this->slot(key);
+        *added = !s->key;
+        if (*added) {
+            s->key = key;
+            s->value = 0;
+            this->count++;
+        }
+        return &s->value;
+    }
+
+    void grow() {
+        slot_t* old = this->slots;
+        size_t old_size = this->mask + 1;
+        this->mask = old_size * 2 - 1;
+        this->slots = (slot_t*)calloc(this->mask + 1, sizeof(slot_t));
+        for (size_t i = 0; i < old_size; i++) {
+            if (old[i].key) *this->slot(old[i].key) = old[i];
+        }
+        free(old);
+    }
+};
+
+// ------------------------- BUFFERED OUTPUT -------------------------------
+
+sink::sink() {
+    this->cap = 256;
+    this->buf = (char*)malloc(this->cap);
+}
+
+sink::sink(FILE* f) {
+    this->file = f;
+    this->cap = SINK_BUFFER_SIZE;
+    this->buf = (char*)malloc(this->cap);
+}
+
+sink::sink(int fd) {
+    this->fd = fd;
+    this->cap = SINK_BUFFER_SIZE;
+    this->buf = (char*)malloc(this->cap);
+}
+
+sink::~sink() {
+    this->flush();
+    free(this->buf);
+}
+
+// writes straight to the file or fd
+void sink::write_out(const char* s, size_t n) {
+    size_t done = 0;
+    while (done < n && !this->failed) {
+        ssize_t wrote;
+        if (this->file) wrote = (ssize_t)fwrite(s + done, 1, n - done, this->file);
+        else wrote = ::write(this->fd, s + done, n - done);
+        if (wrote < 0 && errno == EINTR) continue;
+        if (wrote <= 0) this->failed = true;
+        else done += wrote;
+    }
+}
+
+void sink::flush() {
+    if (!this->file && this->fd < 0) return;
+    this->write_out(this->buf, this->len);
+    this->len = 0;
+}
+
+// makes room for at least n more bytes (and the NUL data() adds), by flushing or growing
+void sink::make_room(size_t n) {
+    if (this->len + n < this->cap) return;
+    if (this->file || this->fd >= 0) {
+        this->flush();
+        if (n < this->cap) return;
+    }
+    while (this->len + n >= this->cap) this->cap *= 2;
+    this->buf = (char*)realloc(this->buf, this->cap);
+}
+
+void sink::write(const char* s, size_t n) {
+    if ((this->file || this->fd >= 0) && n >= this->cap) {
+        // too big to be worth copying, write it straight through
+        this->flush();
+        this->write_out(s, n);
+        return;
+    }
+    this->make_room(n);
+    memcpy(this->buf + this->len, s, n);
+    this->len += n;
+}
+
+void sink::format(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    char small[64];
+    int n = vsnprintf(small, sizeof(small), fmt, args);
+    va_end(args);
+    if (n < 0) return;
+    if ((size_t)n < sizeof(small)) {
+        this->write(small, n);
+        return;
+    }
+    this->make_room(n + 1);
+    va_start(args, fmt);
+    vsnprintf(this->buf + this->len, n + 1, fmt, args);
+    va_end(args);
+    this->len += n;
+}
+
+const char* sink::data() {
+    this->make_room(1);
+    this->buf[this->len] = 0;
+    return this->buf;
+}
+
+char* sink::take() {
+    this->data();
+    char* out = this->buf;
+    this->cap = 256;
+    this->buf = (char*)malloc(this->cap);
+    this->len = 0;
+    return out;
+}
+
+// ------------------- Circular-reference-proof object dumper -----------------------
+// ---------- (based on https://stackoverflow.com/a/78169673/23626926) --------------
+
+namespace dumper {
+
+// The shared structure table has every cons and obj reached: 1 if reached once, 2 if more than
+// once (so it needs a #N= label), and -N once label N has been printed.
+typedef pointer_table seen_table;
+
+// what's left to do, in a stack so deep lists don't use up the C stack
+enum task_kind { PRINT, TEXT, LIST_REST, HASH };
+
+struct task {
+    task_kind kind;
+    object* obj;
+    const char* text;
+    uint64_t hash;
+};
+
+struct task_stack {
+    task* items = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+
+    ~task_stack() { free(this->items); }
+    void push(task_kind kind, object* obj, const char* text = NULL, uint64_t hash = 0) {
+        if (this->len == this->cap) {
+            this->cap = this->cap ? this->cap * 2 : 64;
+            this->items = (task*)realloc(this->items, this->cap * sizeof(task));
+        }
+        task* t = &this->items[this->len++];
+        t->kind = kind;
+        t->obj = obj;
+        t->text = text;
+        t->hash = hash;
+    }
+};
+
+static void find_shared(pvm* vm, object* root, seen_table* seen, task_stack* todo) {
+    todo->push(PRINT, root);
+    while (todo->len) {
+        object* obj = todo->items[--todo->len].obj;
+        // threads are printed as their list view, which is made fresh each time but has the same contents
+        if (obj && obj->type == &thread_type) obj = vm->thread_as_list(obj);
+        for (;;) {
+            if (obj && obj->type == &hashmap::node_type) {
+                hashmap::each(obj, [&](object* key, object* value, uint64_t hash) {
+                    todo->push(PRINT, key);
+                    todo->push(PRINT, value);
+                });
+                break;
+            }
+            if (obj == NULL || (obj->type != &cons_type && obj->type != &obj_type)) break;
+            bool added;
+            int64_t* count = seen->get(obj, &added);
+            if (!added) {
+                *count = 2;
+                break;
+            }
+            *count = 1;
+            if (obj->type != &obj_type) todo->push(PRINT, car(obj)); // hashmaps are guaranteed non disjoint, i guess
+            obj = cdr(obj);
+        }
+    }
+}
+
+// whether the object gets a #N= or #N# marker, without giving it a number yet
+static bool is_shared(object* obj, seen_table* seen) {
+    int64_t* entry = seen->find(obj);
+    return entry && *entry != 1;
+}
+
+// returns zero if the object doesn't need a #N# marker
+// otherwise returns N (negative if not first time)
+static int64_t reffed(object* obj, seen_table* seen, int64_t* counter) {
+    // only conses and objs are in the table
+    if (obj->type != &cons_type && obj->type != &obj_type) return 0;
+    int64_t* entry = seen->find(obj);
+    if (!entry || *entry == 1) return 0;
+    if (*entry < 0) return *entry; // seen already
+    // object with shared structure but no id yet
+    int64_t my_id = (*counter)++;
+    *entry = -my_id;
+    return my_id;
+}
+
+static void print_atom(pvm* vm, object* obj, sink* out) {
+    #define PRINTTYPE(t, f, fmt) else if (obj->type == t) out->format(fmt, obj->f)
+    if (obj->type == &string_type || obj->type == &rope_type) {
+        out->put('"');
+        const char* c = vm->stringof(obj);
+        for (size_t i = 0, len = vm->string_length(obj); i < len; i++) {
+            char e = parser::escape(c[i]);
+            if (e != c[i]) out->put('\\');
+            out->put(e);
+        }
+        out->put('"');
+    }
+    PRINTTYPE(&symbol_type, as_chars, strpbrk(obj->as_chars, "(){}[] ") ? "#|%s|" : ":%s");
+    else if (obj->type == &integer_type) {
+        // cheaper than going through format() for every element of a list of numbers
+        char digits[24];
+        char* p = digits + sizeof(digits);
+        int64_t x = obj->as_big_int;
+        uint64_t mag = x < 0 ? -(uint64_t)x : x;
+        do *--p = '0' + mag % 10; while (mag /= 10);
+        if (x < 0) *--p = '-';
+        out->write(p, digits + sizeof(digits) - p);
+    }
+    PRINTTYPE(&float_type, as_double, "%lg");
+    PRINTTYPE(&c_function_type, as_ptr, "<function %p>");
+    else if (obj->type == &bigint_type) {
+        char* digits = vm->int_to_string(obj);
+        out->write(digits);
+        free(digits);
+    }
+    PRINTTYPE(NULL, as_ptr, "<garbage %p>");
+    #undef PRINTTYPE
+    else if (obj->type == &opcode_type) out->format(":%s", vm->stringof(car(obj)));
+    else out->format("<%s: %p>", obj->type->name, obj->as_ptr);
+}
+
+static void print_with_refs(pvm* vm, object* root, sink* out, seen_table* seen, task_stack* todo) {
+    int64_t counter = 1;
+    todo->push(PRINT, root);
+    while (todo->len) {
+        task t = todo->items[--todo->len];
+        object* obj = t.obj;
+        switch (t.kind) {
+            case TEXT:
+                out->write(t.text);
+                continue;
+            case HASH:
+                out->format(" ;[hash=%" PRId64 "] ", t.hash);
+                continue;
+            case LIST_REST:
+                // the car of obj has been printed, now the rest of the list
+                obj = cdr(obj);
+                if (obj && obj->type == &cons_type && !is_shared(obj, seen)) {
+                    out->put(' ');
+                    todo->push(LIST_REST, obj);
+                    todo->push(PRINT, car(obj));
+                }
+                else if (obj) {
+                    out->write(" . ", 3);
+                    todo->push(TEXT, NULL, ")");
+                    todo->push(PRINT, obj);
+                }
+                else out->put(')');
+                continue;
+            case PRINT:
+                break;
+        }
+        if (obj == nil) {
+            out->write("NIL", 3);
+            continue;
+        }
+        // test if it's in the table
+        int64_t ref = reffed(obj, seen, &counter);
+        if (ref < 0) {
+            out->format("#%" PRId64 "#", -ref);
+            continue;
+        }
+        if (ref) out->format("#%" PRId64 "=", ref);
+        if (obj->type == &thread_type) {
+            out->write("<thread ");
+            todo->push(TEXT, NULL, ">");
+            todo->push(PRINT, vm->thread_as_list(obj));
+        }
+        else if (obj->type == &cons_type) {
+            out->put('(');
+            todo->push(LIST_REST, obj);
+            todo->push(PRINT, car(obj));
+        }
+        else if (obj->type == &obj_type) {
+            // Try to find the class name
+            const char* nm = "object";
+            if (car(obj) && car(car(obj))) {
+                object* name = vm->get_property(car(car(obj)), vm->sym("__name__"));
+                if (name && name->type == &symbol_type) nm = vm->stringof(name);
+            }
+            out->format("%s{ ", nm);
+            todo->push(TEXT, NULL, "}");
+            // pushed in order and then reversed, so the first property comes off the stack first
+            size_t first = todo->len;
+            hashmap::each(cdr(obj), [&](object* key, object* value, uint64_t hash) {
+                todo->push(PRINT, key);
+                todo->push(TEXT, NULL, " -> ");
+                todo->push(PRINT, value);
+                todo->push(HASH, NULL, NULL, hash);
+            });
+            for (size_t i = first, j = todo->len - 1; i < j; i++, j--) {
+                task swap = todo->items[i];
+                todo->items[i] = todo->items[j];
+                todo->items[j] = swap;
+            }
+        }
+        else print_atom(vm, obj, out);
+    }
+}
+
+}
+
+void pvm::dump(object* obj) {
+    sink out(stdout);
+    this->dump(obj, &out);
+}
+
+void pvm::dump(object* obj, sink* out) {
+    dumper::seen_table seen;
+    dumper::task_stack todo;
+    dumper::find_shared(this, obj, &seen, &todo);
+    dumper::print_with_refs(this, obj, out, &seen, &todo);
+}
+
+// ------------------------- HEAP IMAGES -------------------------------
+
+namespace image {
+
+#define IMAGE_VERSION 1
+// written as it is, so an image from a machine with the other byte order is refused
+#define IMAGE_BYTE_ORDER 0x01020304
+
+// An image is the header, the records, and then the data they point into. Everything is a uint64_t
+// (or padded to one), and objects refer to each other by ref: their record's index + 1, with 0 for nil.
+struct header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t num_records;
+    uint64_t data_size;
+    uint64_t globals;
+    // data offsets of the refs of the instruction names (oldest first) and of the threads (queued, then parked)
+    uint64_t names;
+    uint64_t num_names;
+    uint64_t threads;
+    uint64_t num_queued;
+    uint64_t num_parked;
+};
+
+static const char magic[8] = { 'P', 'I', 'C', 'K', 'L', 'E', 'I', 'M' };
+
+enum kind {
+    CONS,       // a = car, b = cdr
+    OBJ,        // a = prototypes, b = data offset of the count and then the key and value of every property
+    STRING,     // a = data offset of the chars, b = length
+    SYMBOL,     // same
+    INTEGER,    // a = the value
+    FLOAT,      // a = the bits
+    BIGINT,     // a = data offset of the limbs, b = number of limbs, extra = negative
+    C_FUNCTION, // a = the name it is registered under
+    OPCODE,     // a = its name
+    ROPE,       // a = the string it is equal to
+    THREAD      // a = data offset of the next instruction type, the data stack and the instruction stack
+};
+
+struct record {
+    uint32_t kind;
+    uint32_t extra;
+    uint64_t a;
+    uint64_t b;
+};
+
+// numbers the objects reachable from the roots, and makes their records in that order
+struct writer {
+    pvm* vm;
+    pointer_table refs;
+    object** objects = NULL;
+    record* records = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    sink data;
+    bool failed = false;
+
+    writer(pvm* vm) : vm(vm) {}
+    ~writer() {
+        free(this->objects);
+        free(this->records);
+    }
+
+    uint64_t ref(object* o) {
+        if (!o) return 0;
+        bool added;
+        int64_t* r = this->refs.get(o, &added);
+        if (added) {
+            if (this->len == this->cap) {
+                this->cap = this->cap ? this->cap * 2 : 1024;
+                this->objects = (object**)realloc(this->objects, this->cap * sizeof(object*));
+                this->records = (record*)realloc(this->records, this->cap * sizeof(record));
+            }
+            this->objects[this->len] = o;
+            *r = ++this->len;
+        }
+        return *r;
+    }
+
+    // appends to the data, padded so the next thing is aligned, and returns where it went
+    uint64_t put(const void* p, size_t n) {
+        uint64_t offset = this->data.size();
+        this->data.write((const char*)p, n);
+        static const char zeros[8] = { 0 };
+        if (n % 8) this->data.write(zeros, 8 - n % 8);
+        return offset;
+    }
+
+    uint64_t put(uint64_t x) { return this->put(&x, sizeof(x)); }
+
+    // the name the function is registered under, or nil
+    object* name_of(func_ptr f) {
+        for (object* e = this->vm->function_registry; e; e = cdr(e)) {
+            if (this->vm->opcodes[cdar(e)->as_big_int] == f) return caar(e);
+        }
+        return nil;
+    }
+
+    // makes the records of everything ref() has numbered and not made yet (which numbers more of them)
+    void fill() {
+        for (size_t i = 0; i < this->len && !this->failed; i++) {
+            object* o = this->objects[i];
+            record r = { 0, 0, 0, 0 };
+            if (o->type == &cons_type) {
+                r.kind = CONS;
+                r.a = this->ref(car(o));
+                r.b = this->ref(cdr(o));
+            }
+            else if (o->type == &obj_type) {
+                r.kind = OBJ;
+                r.a = this->ref(car(o));
+                // the property maps are rebuilt on loading, the hashes are seeded differently in every vm
+                uint64_t count = 0;
+                hashmap::each(cdr(o), [&](object* key, object* value, uint64_t hash) { count++; });
+                r.b = this->put(count);
+                hashmap::each(cdr(o), [&](object* key, object* value, uint64_t hash) {
+                    this->put(this->ref(key));
+                    this->put(this->ref(value));
+                });
+            }
+            else if (o->type == &string_type || o->type == &symbol_type) {
+                r.kind = o->type == &string_type ? STRING : SYMBOL;
+                r.b = STRING_HEADER(o)->len;
+                r.a = this->put(o->as_chars, r.b);
+            }
+            else if (o->type == &integer_type || o->type == &float_type) {
+                r.kind = o->type == &integer_type ? INTEGER : FLOAT;
+                r.a = (uint64_t)o->as_big_int;
+            }
+            else if (o->type == &bigint_type) {
+                bignum::num* n = (bignum::num*)o->as_ptr;
+                r.kind = BIGINT;
+                r.extra = n->neg;
+                r.b = n->len;
+                r.a = this->put(n->limbs, n->len * sizeof(uint32_t));
+            }
+            else if (o->type == &c_function_type) {
+                object* name = this->name_of(this->vm->fptr(o));
+                if (!name) {
+                    DBG("Can't save a c_function that isn't registered");
+                    this->failed = true;
+                }
+                r.kind = C_FUNCTION;
+                r.a = this->ref(name);
+            }
+            else if (o->type == &opcode_type) {
+                r.kind = OPCODE;
+                r.a = this->ref(car(o));
+            }
+            else if (o->type == &rope_type) {
+                r.kind = ROPE;
+                r.a = this->ref(this->vm->flatten(o));
+            }
+            else if (o->type == &thread_type) {
+                thread_state* t = THREAD(o);
+                r.kind = THREAD;
+                r.a = this->put(this->ref(car(o)));
+                this->put(t->data_len);
+                for (size_t j = 0; j < t->data_len; j++) this->put(this->ref(t->data[j]));
+                this->put(t->insts_len);
+                for (size_t j = 0; j < t->insts_len; j++) {
+                    this->put(this->ref(t->insts[j].type));
+                    this->put(this->ref(t->insts[j].opcode));
+                    this->put(this->ref(t->insts[j].cookie));
+                }
+            }
+            else {
+                DBG("Can't save a %s", o->type->name);
+                this->failed = true;
+            }
+            this->records[i] = r;
+        }
+    }
+};
+
+// builds the objects of an image, which is checked as it goes (it's only trusted to be from this version)
+struct reader {
+    pvm* vm;
+    const record* records;
+    const char* data;
+    uint64_t num_records;
+    uint64_t data_size;
+    object** objects;
+    bool failed = false;
+
+    reader(pvm* vm, const header* h) : vm(vm) {
+        this->records = (const record*)(h + 1);
+        this->data = (const char*)(this->records + h->num_records);
+        this->num_records = h->num_records;
+        this->data_size = h->data_size;
+        this->objects = (object**)calloc(h->num_records ? h->num_records : 1, sizeof(object*));
+    }
+    ~reader() { free(this->objects); }
+
+    // whether n bytes at the offset are in the data
+    bool has(uint64_t offset, uint64_t n) {
+        if (offset > this->data_size || n > this->data_size - offset) this->failed = true;
+        return !this->failed;
+    }
+
+    // the object for a ref, with a type it has to be (NULL = any)
+    object* at(uint64_t ref, const object_type* type = NULL) {
+        if (!ref) return nil;
+        if (ref > this->num_records || !this->objects[ref - 1]) {
+            this->failed = true;
+            return nil;
+        }
+        object* o = this->objects[ref - 1];
+        if (type && o->type != type) {
+            this->failed = true;
+            return nil;
+        }
+        return o;
+    }
+
+    uint64_t word(uint64_t offset) {
+        uint64_t x = 0;
+        if (this->has(offset, sizeof(uint64_t))) memcpy(&x, this->data + offset, sizeof(x));
+        return x;
+    }
+
+    void build(const header* h) {
+        // first the objects that don't point to other objects, and empty ones for those that do
+        for (uint64_t i = 0; i < this->num_records && !this->failed; i++) {
+            const record* r = &this->records[i];
+            object* o = nil;
+            switch (r->kind) {
+                case STRING:
+                case SYMBOL:
+                    if (!this->has(r->a, r->b)) break;
+                    if (r->kind == STRING) o = this->vm->string(this->data + r->a, r->b);
+                    else o = this->vm->sym(this->data + r->a, r->b);
+                    break;
+                case INTEGER: o = this->vm->integer((int64_t)r->a); break;
+                case FLOAT: {
+                    double x;
+                    memcpy(&x, &r->a, sizeof(x));
+                    o = this->vm->number(x);
+                    break;
+                }
+                case BIGINT:
+                    if (r->a % sizeof(uint32_t) || r->b > this->data_size / sizeof(uint32_t)) this->failed = true;
+                    if (!this->has(r->a, r->b * sizeof(uint32_t))) break;
+                    o = this->vm->bigint((const uint32_t*)(this->data + r->a), r->b, r->extra);
+                    break;
+                case CONS: o = this->vm->cons(nil, nil); break;
+                case OBJ: o = this->vm->newobject(); break;
+                case THREAD:
+                    o = this->vm->alloc(&thread_type);
+                    car(o) = nil;
+                    o->as_ptr = this->vm->payloads.alloc(sizeof(thread_state));
+                    memset(o->as_ptr, 0, sizeof(thread_state));
+                    break;
+                case C_FUNCTION:
+                case OPCODE:
+                case ROPE:
+                    continue;
+                default: this->failed = true;
+            }
+            this->objects[i] = o;
+        }
+        // then the instruction names are registered in the same order, before anything else can make opcodes
+        if (h->num_names > this->data_size || !this->has(h->names, h->num_names * sizeof(uint64_t))) return;
+        for (uint64_t i = 0; i < h->num_names && !this->failed; i++) {
+            object* name = this->at(this->word(h->names + i * sizeof(uint64_t)), &symbol_type);
+            if (name) this->vm->opcode(name);
+        }
+        // the objects that stand for something this vm has its own of
+        for (uint64_t i = 0; i < this->num_records && !this->failed; i++) {
+            const record* r = &this->records[i];
+            if (r->kind == OPCODE || r->kind == C_FUNCTION) {
+                object* name = this->at(r->a, &symbol_type);
+                if (!name) {
+                    this->failed = true;
+                    break;
+                }
+                object* op = this->vm->opcode(name);
+                if (r->kind == OPCODE) this->objects[i] = op;
+                else {
+                    func_ptr f = this->vm->opcodes[op->as_big_int];
+                    if (!f) {
+                        DBG("Can't load c_function %s, it isn't registered", this->vm->stringof(name));
+                        this->failed = true;
+                        break;
+                    }
+                    this->objects[i] = this->vm->func(f);
+                }
+            }
+            else if (r->kind == ROPE) {
+                // ropes are saved as the string they are equal to
+                this->objects[i] = this->at(r->a, &string_type);
+            }
+        }
+        // then the pointers are filled in
+        for (uint64_t i = 0; i < this->num_records && !this->failed; i++) {
+            const record* r = &this->records[i];
+            object* o = this->objects[i];
+            if (r->kind == CONS) {
+                car(o) = this->at(r->a);
+                cdr(o) = this->at(r->b);
+            }
+            else if (r->kind == OBJ) car(o) = this->at(r->a);
+            else if (r->kind == THREAD) this->build_thread(o, r->a);
+        }
+        // and the property maps last, because hashing a key can look into it
+        for (uint64_t i = 0; i < this->num_records && !this->failed; i++) {
+            const record* r = &this->records[i];
+            if (r->kind != OBJ) continue;
+            uint64_t count = this->word(r->b);
+            if (count > this->data_size || !this->has(r->b, (count * 2 + 1) * sizeof(uint64_t))) break;
+            object* o = this->objects[i];
+            for (uint64_t j = 0, offset = r->b + sizeof(uint64_t); j < count && !this->failed; j++, offset += 2 * sizeof(uint64_t)) {
+                object* key = this->at(this->word(offset));
+                hashmap::set(this->vm, &cdr(o), key, this->vm->hash(key), this->at(this->word(offset + sizeof(uint64_t))));
+            }
+        }
+    }
+
+    void build_thread(object* o, uint64_t offset) {
+        thread_state* t = THREAD(o);
+        car(o) = this->at(this->word(offset));
+        uint64_t n = this->word(offset += sizeof(uint64_t));
+        if (n > this->data_size || !this->has(offset += sizeof(uint64_t), n * sizeof(uint64_t))) return;
+        t->data_cap = n > 16 ? n : 16;
+        t->data = (object**)this->vm->payloads.alloc(t->data_cap * sizeof(object*));
+        for (; t->data_len < n; offset += sizeof(uint64_t)) t->data[t->data_len++] = this->at(this->word(offset));
+        n = this->word(offset);
+        if (n > this->data_size || !this->has(offset += sizeof(uint64_t), n * 3 * sizeof(uint64_t))) return;
+        t->insts_cap = n > 16 ? n : 16;
+        t->insts = (inst_record*)this->vm->payloads.alloc(t->insts_cap * sizeof(inst_record));
+        for (; t->insts_len < n; offset += 3 * sizeof(uint64_t)) {
+            inst_record* ir = &t->insts[t->insts_len++];
+            ir->type = this->at(this->word(offset));
+            ir->opcode = this->at(this->word(offset + sizeof(uint64_t)), &opcode_type);
+            ir->cookie = this->at(this->word(offset + 2 * sizeof(uint64_t)));
+        }
+    }
+};
+
+}
+
+bool pvm::save_image(const char* path, bool with_threads) {
+    image::writer w(this);
+    image::header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, image::magic, sizeof(h.magic));
+    h.version = IMAGE_VERSION;
+    h.byte_order = IMAGE_BYTE_ORDER;
+    h.globals = w.ref(this->globals);
+    // the registry is newest first
+    for (object* e = this->function_registry; e; e = cdr(e)) h.num_names++;
+    uint64_t* names = (uint64_t*)malloc((h.num_names + 1) * sizeof(uint64_t));
+    uint64_t i = h.num_names;
+    for (object* e = this->function_registry; e; e = cdr(e)) names[--i] = w.ref(caar(e));
+    h.names = w.put(names, h.num_names * sizeof(uint64_t));
+    free(names);
+    h.threads = w.data.size();
+    if (with_threads) {
+        object* cell = this->queue;
+        if (cell) do {
+            w.put(w.ref(car(cell)));
+            h.num_queued++;
+            cell = cdr(cell);
+        } while (cell != this->queue);
+        hashmap::each(this->parked, [&](object* thread, object* _, uint64_t hash) {
+            w.put(w.ref(thread));
+            h.num_parked++;
+        });
+    }
+    w.fill();
+    if (w.failed) return false;
+    h.num_records = w.len;
+    h.data_size = w.data.size();
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok;
+    {
+        sink out(fd);
+        out.write((const char*)&h, sizeof(h));
+        out.write((const char*)w.records, w.len * sizeof(image::record));
+        out.write(w.data.data(), w.data.size());
+        out.flush();
+        ok = !out.failed;
+    }
+    if (close(fd) < 0) ok = false;
+    if (!ok) unlink(path);
+    return ok;
+}
+
+bool pvm::load_image(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(image::header)) {
+        close(fd);
+        return false;
+    }
+    size_t size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    const image::header* h = (const image::header*)map;
+    size_t room = size - sizeof(image::header);
+    bool ok = memcmp(h->magic, image::magic, sizeof(h->magic)) == 0
+        && h->version == IMAGE_VERSION && h->byte_order == IMAGE_BYTE_ORDER
+        && h->num_records <= room / sizeof(image::record)
+        && h->data_size == room - h->num_records * sizeof(image::record);
+    if (ok) {
+        image::reader r(this, h);
+        r.build(h);
+        // check the roots before any of them are touched, so a bad image leaves the vm as it was
+        object* globals = r.at(h->globals);
+        uint64_t num_threads = h->num_queued + h->num_parked;
+        if (num_threads < h->num_queued || num_threads > h->data_size
+            || !r.has(h->threads, num_threads * sizeof(uint64_t))) r.failed = true;
+        for (uint64_t i = 0; i < num_threads && !r.failed; i++) r.at(r.word(h->threads + i * sizeof(uint64_t)), &thread_type);
+        ok = !r.failed;
+        if (ok) {
+            this->globals = globals;
+            for (uint64_t i = 0; i < num_threads; i++) {
+                object* thread = r.at(r.word(h->threads + i * sizeof(uint64_t)));
+                if (i < h->num_queued) {
+                    this->enqueue(thread);
+                    continue;
+                }
+                hashmap::set(this, &this->parked, thread, this->hash(thread), thread);
+                this->num_parked++;
+            }
+        }
+    }
+    munmap(map, size);
+    return ok;
+}
+
+
+size_t pvm::gc() {
+    uint64_t start = monotonic_ns();
+    // the marks gc_step() hasn't swept away yet would stop this marking short, and so would the old objects'
+    if (this->gc_sweeping) this->sweep_chunks(0, false);
+    this->forget_generations();
+    // The lookup cache (and the match cache) doesn't keep its objects alive, and their addresses can be reused after this
+    this->clear_lookup_cache();
+    // Not reentrant across VMs: only one pvm can be sweeping at a time
+    sweeping_vm = this;
+    // (if gc_step() was marking, this finishes its collection)
+    size_t freed;
+    if (this->gc_threads > 1) {
+        this->mark_parallel();
+        freed = this->sweep_parallel();
+    }
+    else freed = tinobsy::vm::gc();
+    sweeping_vm = NULL;
+    this->gc_marking = false;
+    this->collected(freed);
+    this->record_pause(monotonic_ns() - start);
+    return freed;
+}
+
+void pvm::collected(size_t freed) {
+    this->freed_total += freed;
+    this->live_objects = this->allocations - this->freed_total;
+    this->allocations_at_gc = this->allocations;
+    this->gc_count++;
+}
+
+bool pvm::sweep_chunks(uint64_t deadline, bool until_free) {
+    // the same as tinobsy's sweep, a chunk at a time
+    for (size_t n = 0; *this->sweep_link; n++) {
+        if (until_free && this->freelist) return false;
+        if (deadline && n && monotonic_ns() >= deadline) return false;
+        tinobsy::chunk* c = *this->sweep_link;
+        size_t used = 0;
+        for (size_t i = 0; i < CHUNK_SIZE; i++) {
+            object* o = &c->d[i];
+            if (!o->type) continue;
+            if (o->flags & MARKBIT) {
+                if (!this->sweep_keeps_marks) o->flags &= ~MARKBIT;
+                used++;
+                continue;
+            }
+            if (o->type->free) o->type->free(o);
+            o->type = NULL;
+            this->sweep_freed++;
+            this->freespace++;
+        }
+        if (!used) {
+            *this->sweep_link = c->next;
+            delete c;
+            this->freespace -= CHUNK_SIZE;
+            continue;
+        }
+        for (size_t i = 0; i < CHUNK_SIZE; i++) {
+            if (c->d[i].type) continue;
+            cdr(&c->d[i]) = this->freelist;
+            this->freelist = &c->d[i];
+        }
+        this->sweep_link = &c->next;
+    }
+    this->gc_sweeping = false;
+    this->collected(this->sweep_freed);
+    return true;
+}
+
+void pvm::record_pause(uint64_t ns) {
+    this->gc_total_ns += ns;
+    if (ns > this->gc_max_ns) this->gc_max_ns = ns;
+    this->gc_pauses[this->gc_pause_count++ % GC_PAUSE_LOG] = ns;
+    STATS(this->stats.pause_histogram[ns ? 63 - __builtin_clzll(ns) : 0]++;)
+}
+
+size_t pvm::gc_budget() {
+    size_t budget = this->live_objects * this->gc_growth;
+    if (budget < this->gc_min_budget) budget = this->gc_min_budget;
+    return budget;
+}
+
+bool pvm::maybe_gc() {
+    if (this->generational_gc && !this->gc_marking && !this->gc_sweeping) {
+        if (this->young_len < this->gc_nursery && this->remembered_len < this->gc_nursery) return false;
+        if (this->promoted >= this->gc_budget()) this->major_gc();
+        else this->minor_gc();
+        return true;
+    }
+    if (this->allocations - this->allocations_at_gc < this->gc_budget()) return false;
+    this->gc();
+    return true;
+}
+
+void pvm::minor_gc() {
+    uint64_t start = monotonic_ns();
+    // the caches don't keep their objects alive, and the young objects' slots are about to be reused
+    this->clear_lookup_cache();
+    // Marking stops at the old objects, which are still marked, so it only goes through the young ones that are
+    // reachable from the roots, or from an old object (the barrier saw them stored), or from a parked thread
+    this->mark_roots();
+    for (size_t i = 0; i < this->remembered_len; i++) {
+        object* o = this->remembered[i];
+        if ((o->flags & MARKBIT) && o->type->mark) this->shade(o->type->mark(this, o));
+        this->shade(o);
+    }
+    this->drain_grey(0);
+    // then the young objects left unmarked are garbage, and the others keep their marks and are old now
+    sweeping_vm = this;
+    size_t freed = 0;
+    for (size_t i = 0; i < this->young_len; i++) {
+        object* o = this->young[i];
+        if (o->flags & MARKBIT) continue;
+        if (o->type->free) o->type->free(o);
+        o->type = NULL;
+        cdr(o) = this->freelist;
+        this->freelist = o;
+        this->freespace++;
+        freed++;
+    }
+    sweeping_vm = NULL;
+    this->promoted += this->young_len - freed;
+    this->young_len = this->remembered_len = 0;
+    this->marks_kept = true;
+    this->collected(freed);
+    uint64_t pause = monotonic_ns() - start;
+    this->gc_minor_count++;
+    this->gc_minor_total_ns += pause;
+    if (pause > this->gc_minor_max_ns) this->gc_minor_max_ns = pause;
+    this->record_pause(pause);
+}
+
+void pvm::major_gc() {
+    uint64_t start = monotonic_ns();
+    this->forget_generations();
+    this->clear_lookup_cache();
+    this->mark_globals();
+    // the same sweep as gc_step()'s, all at once, and the survivors stay marked as the old generation
+    sweeping_vm = this;
+    this->sweep_link = &this->chunks;
+    this->sweep_freed = 0;
+    this->freelist = NULL;
+    this->sweep_keeps_marks = true;
+    this->sweep_chunks(0, false);
+    this->sweep_keeps_marks = false;
+    sweeping_vm = NULL;
+    this->marks_kept = true;
+    this->record_pause(monotonic_ns() - start);
+}
+
+void pvm::forget_generations() {
+    if (this->marks_kept) {
+        for (tinobsy::chunk* c = this->chunks; c; c = c->next) {
+            for (size_t i = 0; i < CHUNK_SIZE; i++) c->d[i].flags &= ~MARKBIT;
+        }
+        this->marks_kept = false;
+    }
+    this->young_len = this->remembered_len = 0;
+    this->promoted = 0;
+}
+
+bool pvm::gc_step() {
+    uint64_t start = monotonic_ns();
+    if (this->gc_sweeping) {
+        this->sweep_chunks(start + this->gc_slice_ns, false);
+        this->record_pause(monotonic_ns() - start);
+        return true;
+    }
+    if (!this->gc_marking) {
+        if (this->allocations - this->allocations_at_gc < this->gc_budget()) return false;
+        this->forget_generations();
+        this->gc_marking = true;
+        this->mark_roots();
+    }
+    if (this->drain_grey(start + this->gc_slice_ns)) {
+        // Everything reachable from the roots as they were is marked, so what's left for this pause is
+        // rescanning the roots for anything new. The sweep is left to the next slices, which free the dead
+        // without uninterning them (and interning could find one before it is swept), so they're dropped now.
+        this->mark_globals();
+        this->clear_lookup_cache();
+        this->drop_unmarked_interns();
+        this->gc_marking = false;
+        this->gc_sweeping = true;
+        this->sweep_link = &this->chunks;
+        this->sweep_freed = 0;
+        // the free slots are all put back on the list as their chunks are swept
+        this->freelist = NULL;
+    }
+    this->record_pause(monotonic_ns() - start);
+    return true;
+}
+
+// ------------------------- STATISTICS -------------------------------
+
+#ifdef PICKLE_STATS
+
+vm_stats::~vm_stats() {
+    free(this->op_counts);
+    free(this->op_ns);
+}
+
+uint64_t vm_stats::allocations_of(const object_type* t) {
+    for (size_t i = 0; i < STATS_TYPES && this->alloc_types[i]; i++) {
+        if (this->alloc_types[i] == t) return this->alloc_counts[i];
+    }
+    return 0;
+}
+
+void vm_stats::reserve_ops(size_t n) {
+    if (n <= this->ops_cap) return;
+    this->op_counts = (uint64_t*)realloc(this->op_counts, n * sizeof(uint64_t));
+    this->op_ns = (uint64_t*)realloc(this->op_ns, n * sizeof(uint64_t));
+    memset(this->op_counts + this->ops_cap, 0, (n - this->ops_cap) * sizeof(uint64_t));
+    memset(this->op_ns + this->ops_cap, 0, (n - this->ops_cap) * sizeof(uint64_t));
+    this->ops_cap = n;
+}
+
+void vm_stats::reset() {
+    if (this->ops_cap) {
+        memset(this->op_counts, 0, this->ops_cap * sizeof(uint64_t));
+        memset(this->op_ns, 0, this->ops_cap * sizeof(uint64_t));
+    }
+    memset(this->alloc_counts, 0, sizeof(this->alloc_counts));
+    this->other_allocations = 0;
+    this->symbols = this->strings = this->ints = this->floats = this->funcs = this->bigints = intern_counts();
+    memset(this->pause_histogram, 0, sizeof(this->pause_histogram));
+    this->max_queue_length = this->queue_length;
+}
+
+static void json_string(sink* out, const char* s) {
+    out->put('"');
+    for (; *s; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out->put('\\');
+            out->put(c);
+        }
+        else if (c < 0x20) out->format("\\u%04x", c);
+        else out->put(c);
+    }
+    out->put('"');
+}
+
+#endif
+
+void pvm::reset_stats() {
+    STATS(this->stats.reset();)
+}
+
+void pvm::write_stats(sink* out) {
+    size_t queued = 0;
+    if (this->queue) {
+        object* cell = this->queue;
+        do {
+            queued++;
+            cell = cdr(cell);
+        } while (cell != this->queue);
+    }
+    #ifdef PICKLE_STATS
+    out->write("{\"enabled\": true,\n");
+    #else
+    out->write("{\"enabled\": false,\n");
+    #endif
+    out->format(" \"gc\": {\"collections\": %zu, \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 ", \"live_objects\": %zu",
+        this->gc_count, this->gc_total_ns, this->gc_max_ns, this->live_objects);
+    out->format(", \"minor\": {\"collections\": %zu, \"total_ns\": %" PRIu64 ", \"max_ns\": %" PRIu64 "}", this->gc_minor_count,
+        this->gc_minor_total_ns, this->gc_minor_max_ns);
+    #ifdef PICKLE_STATS
+    // keyed by the shortest pause in the bucket
+    out->write(", \"pause_histogram\": {");
+    const char* sep = "";
+    for (int i = 0; i < 64; i++) {
+        if (!this->stats.pause_histogram[i]) continue;
+        out->format("%s\"%" PRIu64 "\": %" PRIu64, sep, i ? (uint64_t)1 << i : (uint64_t)0, this->stats.pause_histogram[i]);
+        sep = ", ";
+    }
+    out->put('}');
+    #endif
+    out->write("},\n");
+    out->format(" \"threads\": {\"queued\": %zu, \"parked\": %zu", queued, this->num_parked);
+    STATS(out->format(", \"max_queued\": %zu", this->stats.max_queue_length);)
+    out->write("},\n");
+    out->format(" \"allocations\": {\"total\": %zu", this->allocations);
+    #ifdef PICKLE_STATS
+    out->write(", \"by_type\": {");
+    for (size_t i = 0; i < STATS_TYPES && this->stats.alloc_types[i]; i++) {
+        if (i) out->write(", ");
+        json_string(out, this->stats.alloc_types[i]->name);
+        out->format(": %" PRIu64, this->stats.alloc_counts[i]);
+    }
+    if (this->stats.other_allocations) out->format(", \"other\": %" PRIu64, this->stats.other_allocations);
+    out->write("}},\n");
+    out->write(" \"interning\": {");
+    const char* names[] = { "symbols", "strings", "ints", "floats", "funcs", "bigints" };
+    vm_stats::intern_counts* counts[] = { &this->stats.symbols, &this->stats.strings, &this->stats.ints,
+        &this->stats.floats, &this->stats.funcs, &this->stats.bigints };
+    for (int i = 0; i < 6; i++) {
+        out->format("%s\"%s\": {\"hits\": %" PRIu64 ", \"misses\": %" PRIu64 "}", i ? ", " : "", names[i],
+            counts[i]->hits, counts[i]->misses);
+    }
+    out->write("},\n");
+    // the registry is newest first, so sort the names by opcode first (only the ones that ran are listed)
+    out->write(" \"ops\": {");
+    object** by_number = (object**)calloc(this->num_opcodes + 1, sizeof(object*));
+    for (object* e = this->function_registry; e; e = cdr(e)) by_number[cdr(car(e))->as_big_int] = car(car(e));
+    sep = "";
+    for (size_t i = 0; i < this->num_opcodes; i++) {
+        if (!by_number[i] || !this->stats.op_counts[i]) continue;
+        out->write(sep);
+        json_string(out, this->stringof(by_number[i]));
+        out->format(": {\"count\": %" PRIu64 ", \"ns\": %" PRIu64 "}", this->stats.op_counts[i],
+            this->stats.op_ns[i]);
+        sep = ", ";
+    }
+    free(by_number);
+    out->write("}}\n");
+    #else
+    out->write("}}\n");
+    #endif
+}
+
+// ------------------------- PROFILER -------------------------------
+
+// the vm start_profile_timer() was called on, and the SIGPROF handler that was there before
+static pvm* timer_profiled = NULL;
+static struct sigaction previous_sigprof;
+
+void pvm::on_sigprof(int) {
+    pvm* vm = timer_profiled;
+    if (vm) vm->profile_ticked = 1;
+}
+
+void pvm::start_profile(size_t every) {
+    this->stop_profile();
+    if (!every) every = 1;
+    this->profiling = PROFILE_EVERY;
+    this->profile_every = every;
+    this->profile_countdown = every;
+}
+
+bool pvm::start_profile_timer(uint64_t interval_ns) {
+    if (timer_profiled && timer_profiled != this) return false;
+    this->stop_profile();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = pvm::on_sigprof;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGPROF, &sa, &previous_sigprof)) return false;
+    timer_profiled = this;
+    this->profiling = PROFILE_TIMER;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_ns / 1000000000;
+    timer.it_interval.tv_usec = (interval_ns % 1000000000) / 1000;
+    if (!timer.it_interval.tv_sec && !timer.it_interval.tv_usec) timer.it_interval.tv_usec = 1;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL)) {
+        this->stop_profile();
+        return false;
+    }
+    return true;
+}
+
+void pvm::stop_profile() {
+    if (timer_profiled == this) {
+        struct itimerval off;
+        memset(&off, 0, sizeof(off));
+        setitimer(ITIMER_PROF, &off, NULL);
+        sigaction(SIGPROF, &previous_sigprof, NULL);
+        timer_profiled = NULL;
+    }
+    this->profiling = PROFILE_OFF;
+    this->profile_ticked = 0;
+}
+
+void pvm::clear_profile() {
+    for (size_t i = 0; i < this->profile_cap; i++) free(this->profile[i].stack);
+    if (this->profile) memset(this->profile, 0, this->profile_cap * sizeof(profile_entry));
+    this->profile_len = 0;
+    this->profile_samples = 0;
+}
+
+// writes a name for a folded stack, where ; separates the frames and a line is one stack
+static void profile_name(pvm* vm, sink* out, object* name) {
+    if (!name || (name->type != &symbol_type && name->type != &string_type)) {
+        out->put('?');
+        return;
+    }
+    const char* chs = name->as_chars;
+    size_t len = vm->string_length(name);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = chs[i];
+        out->put(c == ';' ? ':' : c < 0x20 ? '?' : c);
+    }
+}
+
+static void profile_frame(pvm* vm, sink* out, object* op, object* type) {
+    profile_name(vm, out, car(op));
+    if (!type) return;
+    out->put('[');
+    profile_name(vm, out, type);
+    out->put(']');
+}
+
+void pvm::take_sample(thread_state* t, size_t depth, object* op, object* type) {
+    this->profile_countdown = this->profile_every;
+    this->profile_ticked = 0;
+    // stopped by the instruction
+    if (this->profiling == PROFILE_OFF) return;
+    sink* key = &this->profile_key;
+    key->clear();
+    // the instruction may have popped some of the ones it ran on top of
+    if (depth > t->insts_len) depth = t->insts_len;
+    size_t first = depth > PROFILE_MAX_DEPTH ? depth - PROFILE_MAX_DEPTH : 0;
+    if (first) key->write("...;");
+    for (size_t i = first; i < depth; i++) {
+        profile_frame(this, key, t->insts[i].opcode, t->insts[i].type);
+        key->put(';');
+    }
+    profile_frame(this, key, op, type);
+    const char* chs = key->data();
+    size_t len = key->size();
+    uint64_t hash = this->hash_bytes(chs, len);
+    if (this->profile_len * 2 >= this->profile_cap) {
+        size_t old_cap = this->profile_cap;
+        profile_entry* old = this->profile;
+        this->profile_cap = old_cap ? old_cap * 2 : 64;
+        this->profile = (profile_entry*)calloc(this->profile_cap, sizeof(profile_entry));
+        for (size_t i = 0; i < old_cap; i++) {
+            if (!old[i].stack) continue;
+            size_t j = old[i].hash & (this->profile_cap - 1);
+            while (this->profile[j].stack) j = (j + 1) & (this->profile_cap - 1);
+            this->profile[j] = old[i];
+        }
+        free(old);
+    }
+    size_t mask = this->profile_cap - 1;
+    size_t i = hash & mask;
+    for (; this->profile[i].stack; i = (i + 1) & mask) {
+        profile_entry* e = &this->profile[i];
+        if (e->hash == hash && e->len == len && !memcmp(e->stack, chs, len)) break;
+    }
+    profile_entry* e = &this->profile[i];
+    if (!e->stack) {
+        e->stack = (char*)malloc(len + 1);
+        memcpy(e->stack, chs, len + 1);
+        e->len = len;
+        e->hash = hash;
+        this->profile_len++;
+    }
+    e->count++;
+    this->profile_samples++;
+}
+
+static int compare_profile_entries(const void* a, const void* b) {
+    return strcmp((*(profile_entry* const*)a)->stack, (*(profile_entry* const*)b)->stack);
+}
+
+void pvm::write_profile(sink* out) {
+    // sorted, so profiles of the same program can be diffed
+    profile_entry** sorted = (profile_entry**)malloc((this->profile_len + 1) * sizeof(profile_entry*));
+    size_t n = 0;
+    for (size_t i = 0; i < this->profile_cap; i++) {
+        if (this->profile[i].stack) sorted[n++] = &this->profile[i];
+    }
+    qsort(sorted, n, sizeof(profile_entry*), compare_profile_entries);
+    for (size_t i = 0; i < n; i++) {
+        out->write(sorted[i]->stack, sorted[i]->len);
+        out->format(" %zu\n", sorted[i]->count);
+    }
+    free(sorted);
 }
 
 }
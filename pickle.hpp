@@ -6,40 +6,372 @@
 #include <ctype.h>
 #include <stdint.h>
 #include <string.h>
+#include <stdio.h>
+#include <signal.h>
 
 namespace pickle {
 
 using tinobsy::object;
 using tinobsy::object_type;
 
+// the worker threads of a parallel gc() (in pickle.cpp)
+struct gc_pool;
+
 // used for places where NULL would be ambiguous
 #define nil ((object*)NULL)
 
+// integers in this range are preboxed when the vm starts, so integer() never allocates for them
+#define SMALL_INT_MIN -128
+#define SMALL_INT_MAX 1023
+
+// number of entries in the inherited property lookup cache (power of 2)
+#define LOOKUP_CACHE_SIZE 1024
+// number of write counters the hashes are spread over to invalidate the lookup cache (power of 2)
+#define PROPERTY_EPOCHS 256
+
+// number of recent collection pauses kept in pvm::gc_pauses
+#define GC_PAUSE_LOG 1024
+// the furthest ahead pvm::gc_prefetch can prefetch
+#define GC_PREFETCH_MAX 16
+// the most threads pvm::gc_threads can use
+#define GC_THREADS_MAX 64
+
+// Building with -DPICKLE_STATS turns on the counters in pvm::stats (see vm_stats). Without it STATS(...)
+// expands to nothing, so the instrumented code is exactly what it would be without the counters.
+#ifdef PICKLE_STATS
+#define STATS(...) __VA_ARGS__
+#else
+#define STATS(...)
+#endif
+// number of object types vm_stats counts the allocations of separately
+#define STATS_TYPES 16
+
+// the most instructions of a thread's stack a profile sample keeps (the ones nearest the top)
+#define PROFILE_MAX_DEPTH 256
+
 class pvm;
 
 typedef object* (*func_ptr)(pvm* vm, object* cookie, object* inst_type);
 
-extern const object_type cons_type;
-extern const object_type obj_type;
-extern const object_type c_function_type;
-extern const object_type string_type;
-extern const object_type symbol_type;
-extern const object_type integer_type;
-extern const object_type float_type;
+// why run() or run_for() returned
+enum run_status {
+    RUN_IDLE, // there are no more threads to run (parked threads don't count)
+    RUN_OUT_OF_FUEL,
+    RUN_DEADLINE,
+    RUN_ERROR // a thread ended with an unhandled condition, see pvm::failed_thread
+};
+
+// Objects of different ranks are ordered by rank, and ones of the same rank by their type's compare function.
+enum type_rank {
+    RANK_NUMBER = 1, // ints, bigints and floats, by value
+    RANK_TEXT, // strings and ropes, by their chars
+    RANK_SYMBOL,
+    RANK_FUNCTION,
+    RANK_OPCODE,
+    RANK_IDENTITY // only equal to themselves, ordered by type and then address
+};
+
+// which of the vm's intern tables a type's objects are kept in
+enum intern_index {
+    NOT_INTERNED,
+    INTERNED_SYMBOLS,
+    INTERNED_STRINGS,
+    INTERNED_INTS,
+    INTERNED_FLOATS,
+    INTERNED_FUNCS,
+    INTERNED_BIGINTS,
+    NUM_INTERN_TABLES
+};
+
+// what types that are only equal to themselves use
+int compare_identity(object* a, object* b);
+bool equal_identity(object* a, object* b);
+uint64_t hash_identity(pvm* vm, object* o);
+
+// A tinobsy type with how its objects compare, test for equality and hash as property keys, so that eqcmp(),
+// assoc() and pvm::hash() get them in O(1) from the object. Everything a pvm allocates has one of these (pvm::alloc()
+// only takes these). compare and equal are given two objects of the same rank (not necessarily of the same type),
+// compare has to be a total order with equal exactly when it returns 0, and equal objects have to hash the same.
+// Made with only the tinobsy functions, a type is RANK_IDENTITY.
+class value_type : public object_type {
+    public:
+    typedef int (*compare_fun)(object* a, object* b);
+    typedef bool (*equal_fun)(object* a, object* b);
+    typedef uint64_t (*hash_fun)(pvm* vm, object* o);
+    const int rank;
+    const compare_fun compare;
+    const equal_fun equal;
+    const hash_fun hash;
+    // (only pickle's own types are interned)
+    const int intern_index;
+    value_type(const char* const name, const tinobsy::mark_fun mark, const tinobsy::free_fun free, const tinobsy::print_fun print,
+        int rank = RANK_IDENTITY, compare_fun compare = compare_identity, equal_fun equal = equal_identity,
+        hash_fun hash = hash_identity, int intern_index = NOT_INTERNED)
+    : object_type(name, mark, free, print), rank(rank), compare(compare), equal(equal), hash(hash), intern_index(intern_index) {}
+};
+
+inline const value_type* type_of(object* o) {
+    return static_cast<const value_type*>(o->type);
+}
+
+extern const value_type cons_type;
+extern const value_type obj_type;
+extern const value_type c_function_type;
+extern const value_type opcode_type;
+extern const value_type string_type;
+extern const value_type symbol_type;
+extern const value_type integer_type;
+extern const value_type float_type;
+extern const value_type bigint_type;
+extern const value_type stream_type;
+extern const value_type thread_type;
+extern const value_type rope_type;
+
+// an entry on a thread's instruction stack
+struct inst_record {
+    object* type;
+    object* opcode;
+    object* cookie;
+};
+
+// A thread object's car is the type of the next instruction to run, and as_ptr points to this.
+// Both stacks grow upwards, so the top is the last element.
+struct thread_state {
+    object** data;
+    size_t data_len;
+    size_t data_cap;
+    inst_record* insts;
+    size_t insts_len;
+    size_t insts_cap;
+};
+
+#define THREAD(t) ((thread_state*)(t)->as_ptr)
+
+// A string's or symbol's as_chars points just past this, and the chars are followed by a NUL
+// (so they can be used as a C string, unless they have NULs of their own)
+struct string_header {
+    uint64_t hash;
+    size_t len;
+};
+
+#define STRING_HEADER(s) ((pickle::string_header*)(s)->as_chars - 1)
+
+// A rope is what concat() makes out of long strings: an AVL tree whose leaves are strings,
+// so appending to one only makes O(log n) new nodes. as_ptr points to this.
+struct rope_node {
+    object* left;
+    object* right;
+    size_t len;
+    size_t height;
+    // the string it is equal to, once stringof() has needed it (left and right are kept, the node may be shared)
+    object* flat;
+};
+
+#define ROPE(r) ((pickle::rope_node*)(r)->as_ptr)
+// concat() results up to this long are plain strings
+#define ROPE_LEAF_MAX 128
+
+// how many tokens tokenize_stream() makes before it lets another thread run
+#define TOKENIZE_BATCH 256
+
+// slabs are this big and aligned to it, so a block's slab header is found by masking its address
+#define ARENA_SLAB_SIZE 65536
+// bigger blocks are malloc()ed (with the same header in front) instead of coming from a slab
+#define ARENA_MAX_SMALL 4096
+#define ARENA_CLASSES 16
+// segments start with this many slabs and double until they reach the max
+#define ARENA_FIRST_SEGMENT 4
+#define ARENA_MAX_SEGMENT 256
+
+struct arena_slab;
+
+// Where the variable-size payloads of objects (string chars, bigints, hashmap nodes, thread stacks) come from.
+// Small blocks are rounded up to a size class, and each slab only holds blocks of one class, so a heap
+// of similar objects ends up packed together instead of interleaved with everything else in malloc()'s heap.
+class arena {
+    public:
+    arena();
+    ~arena();
+
+    // never returns NULL
+    void* alloc(size_t size);
+    // like realloc(), except a block that still fits its size class stays where it is
+    void* resize(void* block, size_t size);
+    // frees a block from whichever arena it came from (NULL is ignored)
+    static void release(void* block);
+
+    // mmap() the segments with MADV_HUGEPAGE (if the kernel has transparent huge pages)
+    bool huge_pages = false;
+    // Empty slabs are kept for reuse until there are more than this many, then the pages of the
+    // ones over half of it are given back to the OS, so a heap that shrinks and grows again doesn't thrash.
+    size_t keep_empty = 32;
+
+    // bytes handed out (counting the rounding up to size classes) and in how many blocks
+    size_t bytes_in_use = 0;
+    size_t blocks_in_use = 0;
+    // bytes of address space mapped for slabs, slabs holding blocks, and slabs whose pages were given back
+    size_t bytes_mapped = 0;
+    size_t slabs_in_use = 0;
+    size_t slabs_released = 0;
+
+    private:
+    // slabs of each size class with at least one free block
+    arena_slab* partial[ARENA_CLASSES];
+    // empty slabs, the ones that still have their pages and the ones that don't
+    arena_slab* empty = NULL;
+    size_t num_empty = 0;
+    arena_slab* released = NULL;
+    // the rest of the newest segment
+    char* next_slab = NULL;
+    size_t slabs_left = 0;
+    size_t segment_slabs = ARENA_FIRST_SEGMENT;
+    // every segment mapped, to unmap them
+    struct segment {
+        void* base;
+        size_t size;
+    };
+    segment* segments = NULL;
+    size_t num_segments = 0;
+
+    arena_slab* new_slab(unsigned size_class);
+    void map_segment();
+    void unlink(arena_slab* s);
+    void slab_emptied(arena_slab* s);
+};
+
+// how much a file or fd sink holds before it writes it out
+#define SINK_BUFFER_SIZE 65536
+
+// Buffered output for dump(). A sink writes to a FILE*, a file descriptor, or (made with no
+// arguments) a growable memory buffer that can be read with data()/size() or taken with take().
+class sink {
+    public:
+    sink();
+    sink(FILE* f);
+    sink(int fd);
+    ~sink(); // flushes
+
+    inline void put(char c) {
+        if (this->len == this->cap) this->make_room(1);
+        this->buf[this->len++] = c;
+    }
+    void write(const char* s, size_t n);
+    void write(const char* s) { this->write(s, strlen(s)); }
+    void format(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+    // hands the buffered bytes to the file or fd (does nothing for a memory sink)
+    void flush();
+
+    // what a memory sink holds so far, NUL-terminated
+    const char* data();
+    size_t size() { return this->len; }
+    // the memory sink's buffer (NUL-terminated, caller frees it), and the sink starts over empty
+    char* take();
+    // drops what the sink holds without writing it anywhere
+    void clear() { this->len = 0; }
+
+    // set if a write to the file or fd failed, the output after that is dropped
+    bool failed = false;
+
+    private:
+    FILE* file = NULL;
+    int fd = -1;
+    char* buf;
+    size_t len = 0;
+    size_t cap;
+    void make_room(size_t n);
+    void write_out(const char* s, size_t n);
+};
+
+// one distinct stack of the sampling profiler, and how many samples had it
+struct profile_entry {
+    char* stack;
+    size_t len;
+    uint64_t hash;
+    size_t count;
+};
+
+#ifdef PICKLE_STATS
+// What the vm counts when it is built with PICKLE_STATS. Read it from pvm::stats, or export it with write_stats().
+struct vm_stats {
+    ~vm_stats();
+
+    // per opcode (indexed like pvm::opcodes): how many times it ran, and the ns spent in it
+    // (timing them reads the clock twice per instruction, which is most of what the counters cost)
+    uint64_t* op_counts = NULL;
+    uint64_t* op_ns = NULL;
+    size_t ops_cap = 0;
+
+    // allocations per type, in the order the types were first seen (any types after the first STATS_TYPES
+    // are counted together in other_allocations)
+    const object_type* alloc_types[STATS_TYPES] = {};
+    uint64_t alloc_counts[STATS_TYPES] = {};
+    uint64_t other_allocations = 0;
+
+    // lookups in each intern table that found the object (hits) or had to make a new one (misses)
+    struct intern_counts {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+    };
+    intern_counts symbols, strings, ints, floats, funcs, bigints;
+
+    // number of collection pauses (gc()s and gc_step() slices) between 2^n and 2^(n+1) ns long
+    uint64_t pause_histogram[64] = {};
+
+    // threads in the queue right now (not counting parked ones), and the most there have been
+    size_t queue_length = 0;
+    size_t max_queue_length = 0;
+
+    inline void count_alloc(const object_type* t) {
+        for (size_t i = 0; i < STATS_TYPES; i++) {
+            if (this->alloc_types[i] == t) {
+                this->alloc_counts[i]++;
+                return;
+            }
+            if (!this->alloc_types[i]) {
+                this->alloc_types[i] = t;
+                this->alloc_counts[i] = 1;
+                return;
+            }
+        }
+        this->other_allocations++;
+    }
+    // number of objects of the type allocated
+    uint64_t allocations_of(const object_type* t);
+    // makes room for the counters of n opcodes
+    void reserve_ops(size_t n);
+    // zeroes the counters (queue_length is left alone, max_queue_length starts over from it)
+    void reset();
+};
+#endif
+
+struct match_cache_set;
 
 class pvm : public tinobsy::vm {
     public:
     pvm();
+    ~pvm();
 
-    // round-robin queue of threads (circular list)
+    // round-robin queue of threads (circular list), pointing at the current thread
     object* queue = NULL;
 
+    // how many instructions a thread runs before the next thread gets a turn
+    size_t quantum = 1;
+    // if not 0, a thread also gets switched out once it has been running for this many nanoseconds
+    uint64_t time_slice = 0;
+
+    // number of threads that are parked
+    size_t num_parked = 0;
+
     // global scope
     object* globals = NULL;
 
-    // alist of all of the registered instructions
+    // alist of all of the registered instructions: (name . opcode)
     object* function_registry = NULL;
 
+    // dense table of instruction handlers, indexed by the number in each opcode object
+    func_ptr* opcodes = NULL;
+    size_t num_opcodes = 0;
+
     // pushes the thing onto the cons stack: stack = cons(thing, stack)
     inline void push(object* thing, object*& stack) {
         stack = this->cons(thing, stack);
@@ -56,11 +388,13 @@ class pvm : public tinobsy::vm {
     inline void push_data(object* thing) {
         object* ct = this->curr_thread();
         if (!ct) return;
-        this->push(thing, car(ct));
+        thread_state* t = THREAD(ct);
+        if (t->data_len == t->data_cap) this->grow_data(t);
+        t->data[t->data_len++] = thing;
     }
 
     // pushes the data to the current thread's instruction stack
-    // inst is the symbol name (to look up in function_registry), type is the kind of the function, cookie is optional
+    // inst is the symbol name (resolved to its opcode right now), type is the kind of the function, cookie is optional
     inline void push_inst(const char* inst, object* type = nil, object* cookie = nil) {
         this->push_inst(this->sym(inst), type, cookie);
     }
@@ -73,26 +407,46 @@ class pvm : public tinobsy::vm {
     inline void push_inst(object* inst, object* type = nil, object* cookie = nil) {
         object* ct = this->curr_thread();
         if (!ct) return;
-        this->push(this->cons(type, this->cons(inst, cookie)), cdr(cdr(ct)));
+        object* op = this->opcode(inst);
+        thread_state* t = THREAD(ct);
+        if (t->insts_len == t->insts_cap) this->grow_insts(t);
+        inst_record* r = &t->insts[t->insts_len++];
+        r->type = type;
+        r->opcode = op;
+        r->cookie = cookie;
     }
 
     // pops data from the current thread's data stack
     inline object* pop() {
-        object* curr_thread = this->curr_thread();
-        if (!curr_thread) return nil;
-        return this->pop(car(curr_thread));
+        object* ct = this->curr_thread();
+        if (!ct) return nil;
+        thread_state* t = THREAD(ct);
+        if (!t->data_len) return nil;
+        return t->data[--t->data_len];
     }
 
-    // adds a function to the function registry
+    // cons list views of a thread (top of the stack first), for dumping and for scripts that inspect stacks.
+    // Instructions are (type . (opcode . cookie)) and the whole thread is (data stack . (next type . instruction stack)).
+    object* data_stack(object* thread);
+    object* inst_stack(object* thread);
+    object* thread_as_list(object* thread);
+
+    // adds a function to the function registry, or replaces the existing one with that name
     inline void defop(const char* name, func_ptr fptr) {
-        this->push(this->cons(this->sym(name), this->func(fptr)), this->function_registry);
+        object* op = this->opcode(this->sym(name));
+        this->opcodes[op->as_big_int] = fptr;
     }
 
+    // returns the opcode object for the instruction name, allocating a new (empty) slot for it if needed
+    object* opcode(object* name);
+
     // unbox a function
     inline object* func(func_ptr f) {
-        INTERN(this, func_ptr, &c_function_type, f);
+        object** slot = this->intern_lookup(this->interned_funcs, this->hash_int((uintptr_t)f), (void*)f);
+        if (*slot) return *slot;
         object* o = this->alloc(&c_function_type);
         o->as_ptr = (void*)f;
+        this->intern_insert(this->interned_funcs, slot, o);
         return o;
     }
 
@@ -105,24 +459,76 @@ class pvm : public tinobsy::vm {
     // box a C string
     inline object* string(const char* chs) {
         ASSERT(chs != NULL);
-        INTERN_PTR(this, const char*, &string_type, chs, [](const char* a, const char* b) -> bool { return !strcmp(a, b); });
+        return this->string(chs, strlen(chs));
+    }
+
+    // box the first len chars of chs (which can include NULs)
+    inline object* string(const char* chs, size_t len) {
+        uint64_t hash = this->hash_bytes(chs, len);
+        object** slot = this->intern_lookup(this->interned_strings, hash, chs, len);
+        if (*slot) return *slot;
         object* o = this->alloc(&string_type);
-        o->as_chars = strdup(chs);
+        o->as_chars = this->copy_chars(chs, len, hash);
+        this->intern_insert(this->interned_strings, slot, o);
         return o;
     }
 
-    // unbox a C string or a symbol
+    // unbox a C string, a symbol or a rope (which is flattened the first time)
     inline const char* const stringof(object* s) {
-        ASSERT(s != nil && (s->type == &string_type || s->type == &symbol_type));
+        ASSERT(s != nil && (s->type == &string_type || s->type == &symbol_type || s->type == &rope_type));
+        if (s->type == &rope_type) s = this->flatten(s);
         return s->as_chars;
     }
 
+    // length of a string, symbol or rope in bytes, without looking at the chars
+    inline size_t string_length(object* s) {
+        ASSERT(s != nil && (s->type == &string_type || s->type == &symbol_type || s->type == &rope_type));
+        if (s->type == &rope_type) return ROPE(s)->len;
+        return STRING_HEADER(s)->len;
+    }
+
+    // the string a followed by b (strings or ropes): a string if it's short, otherwise a rope
+    object* concat(object* a, object* b);
+
+    // the string a rope is equal to (strings are returned as they are)
+    object* flatten(object* s);
+
     // create a symbol
     inline object* sym(const char* symbol) {
         ASSERT(symbol != NULL);
-        INTERN_PTR(this, const char*, &symbol_type, symbol, [](const char* a, const char* b) -> bool { return !strcmp(a, b); });
+        return this->sym(symbol, strlen(symbol));
+    }
+
+    // create a symbol from the first len chars of symbol (which can include NULs)
+    inline object* sym(const char* symbol, size_t len) {
+        uint64_t hash = this->hash_bytes(symbol, len);
+        object** slot = this->intern_lookup(this->interned_symbols, hash, symbol, len);
+        if (*slot) return *slot;
         object* o = this->alloc(&symbol_type);
-        o->as_chars = strdup(symbol);
+        o->as_chars = this->copy_chars(symbol, len, hash);
+        this->intern_insert(this->interned_symbols, slot, o);
+        return o;
+    }
+
+    // number of objects allocated so far
+    size_t allocations = 0;
+
+    // where the objects' payloads are allocated
+    arena payloads;
+
+    // allocates from the tinobsy heap, counting it
+    inline object* alloc(const value_type* t) {
+        this->allocations++;
+        STATS(this->stats.count_alloc(t);)
+        // a free slot in a swept chunk is used before tinobsy grows the heap
+        if (this->gc_sweeping && !this->freelist) this->sweep_chunks(0, true);
+        object* o = tinobsy::vm::alloc(t);
+        // objects allocated while a collection is marking survive it (they are marked once they're filled in)
+        if (this->gc_marking) this->shade(o);
+        if (this->generational_gc) {
+            if (this->young_len == this->young_cap) grow_list(&this->young, &this->young_cap);
+            this->young[this->young_len++] = o;
+        }
         return o;
     }
 
@@ -136,9 +542,12 @@ class pvm : public tinobsy::vm {
 
     // box an integer
     inline object* integer(int64_t x) {
-        INTERN(this, int64_t, &integer_type, x);
+        if (x >= SMALL_INT_MIN && x <= SMALL_INT_MAX) return this->small_ints[x - SMALL_INT_MIN];
+        object** slot = this->intern_lookup(this->interned_ints, this->hash_int(x), x);
+        if (*slot) return *slot;
         object* o = this->alloc(&integer_type);
         o->as_big_int = x;
+        this->intern_insert(this->interned_ints, slot, o);
         return o;
     }
 
@@ -148,11 +557,32 @@ class pvm : public tinobsy::vm {
         return x->as_big_int;
     }
 
+    // box an arbitrary precision integer from its magnitude (base 2^32 limbs, least significant first) and sign.
+    // If it fits in an int it returns an int instead, so every integer value has exactly one representation.
+    object* bigint(const uint32_t* limbs, size_t len, bool neg);
+
+    // parse an unsigned integer of any size from base 10 or 16 digits (without a prefix)
+    object* parse_integer(const char* digits, size_t len, int base = 10);
+
+    // integer arithmetic on ints and bigints, which only leaves the int64 fast path when the result overflows
+    object* int_add(object* a, object* b);
+    object* int_sub(object* a, object* b);
+    object* int_mul(object* a, object* b);
+    object* int_neg(object* a);
+
+    // write an int or bigint in base 10 (must be free()d)
+    char* int_to_string(object* x);
+
     // box a floating point number
     inline object* number(double x) {
-        INTERN(this, int64_t, &float_type, x);
+        // floats are interned by their bits, so -0.0 and 0.0 are different objects but NaN is only one
+        int64_t bits;
+        memcpy(&bits, &x, sizeof(bits));
+        object** slot = this->intern_lookup(this->interned_floats, this->hash_int(bits), bits);
+        if (*slot) return *slot;
         object* o = this->alloc(&float_type);
         o->as_double = x;
+        this->intern_insert(this->interned_floats, slot, o);
         return o;
     }
 
@@ -170,32 +600,373 @@ class pvm : public tinobsy::vm {
         return o;
     }
 
+    // Replaces the object's prototypes (a cons list), the only way to change them once the object exists, since
+    // it tells the lookup caches and the collector. The list itself mustn't be changed in place after this.
+    void set_prototypes(object* obj, object* prototypes);
+
+    // Seeded hash of a property key, from its type. Strings and symbols have it computed once when they are interned.
+    uint64_t hash(object* key);
+
+    // the seeded hashes hash() and the intern tables are made of, for value_type hash functions
+    uint64_t hash_bytes(const void* data, size_t len);
+    uint64_t hash_int(uint64_t x);
+    uint64_t bigint_hash(const uint32_t* limbs, size_t len, bool neg);
+
     // Looks up the property on the object, optionally recursing into prototypes if it's not found directly.
-    // If it is not found anywhere return nil.
-    object* get_property(object* obj, uint64_t hash, bool recurse = false);
+    // If it is not found anywhere return nil. Recursive lookups are cached until a property with the
+    // same hash is set or removed anywhere, or set_prototypes() is called on any object.
+    object* get_property(object* obj, object* key, bool recurse = false);
+
+    // statistics of the recursive get_property() cache
+    size_t lookup_cache_hits = 0;
+    size_t lookup_cache_misses = 0;
+    double lookup_cache_hit_rate();
+
+    // forgets all cached recursive lookups (and the pattern matcher's cache, which depends on prototypes too)
+    void clear_lookup_cache();
 
     // Sets the property directly on the object. Returns true if setting succeeded.
-    bool set_property(object* obj, object* key, uint64_t hash, object* value);
+    bool set_property(object* obj, object* key, object* value);
 
     // Sets the property directly on the object. Returns true if something was removed.
-    bool remove_property(object* obj, uint64_t hash);
+    bool remove_property(object* obj, object* key);
 
-    // execute one instruction on the current thread and go to the next thread
+    // Returns a new object with the same prototypes and properties as obj.
+    // The property map is shared copy-on-write, so this is O(1).
+    object* clone_object(object* obj);
+
+    // execute one instruction on the current thread, and go to the next thread if its time slice is used up
     void step();
 
-    // push a new empty thread to the thread queue
+    // execute up to fuel instructions, or as many as fit in ns nanoseconds (checked every few instructions).
+    // Returns early with RUN_ERROR if a thread finishes while its next instruction type isn't nil.
+    run_status run(size_t fuel = SIZE_MAX);
+    run_status run_for(uint64_t ns);
+
+    // the thread that made run() return RUN_ERROR, it has already been removed from the queue
+    object* failed_thread = NULL;
+
+    // push a new empty thread to the thread queue, it becomes the current thread
     void start_thread();
 
+    // takes the current thread out of the queue (so it costs nothing in step()) and returns it.
+    // Meant to be called by an instruction that has to wait for something.
+    object* park_thread();
+
+    // puts a parked thread back at the end of the queue, returns false if it wasn't parked
+    bool unpark_thread(object* thread);
+
     // write the object to stdout using srfi 38 write/ss alike formatting
     void dump(object*);
+    // same, but to the sink (which isn't flushed, so several dumps can share it)
+    void dump(object*, sink* out);
+
+    // Heap images, to start up from a saved heap instead of building it again. save_image() writes globals,
+    // the names in the function registry and (if with_threads) the queued and parked threads to the file,
+    // keeping shared and circular structure. load_image() maps the file, rebuilds the objects (interning
+    // the atoms again) and replaces globals (and adds the threads). c_functions are saved by the name they
+    // are registered under, so those functions have to be defop()ed before loading. Both return false
+    // if they can't: an object that can't be saved (a stream, another type, a c_function that isn't
+    // registered), an I/O error, or an image that is damaged or from another version.
+    bool save_image(const char* path, bool with_threads = false);
+    bool load_image(const char* path);
 
+    // Compiles a pattern (a list of pattern elements, see get_best_match()) into the vm's pattern set, and returns
+    // it, or nil if the elements aren't a valid pattern. When eval() picks it, the handler (an instruction
+    // name or opcode) is run with the captures on the data stack. Adding a pattern only touches the nodes on
+    // its own path through the set, so defining one costs the same however many there are.
+    object* define_pattern(object* elements, object* handler, int64_t precedence = 0);
+    // the compiled patterns (the root of a tree of pattern nodes, read only), and how many have been defined
+    object* patterns = NULL;
+    size_t num_patterns = 0;
 
+    // The pattern matcher's packrat cache: the places in the patterns (with the counts of the repetitions around
+    // them) whose rest has already failed to match from a token of a statement, known by its cons cell, so that
+    // backtracking tries each of them once per token instead of exponentially often, and eval() doesn't redo the
+    // ones for the tokens splice_match() kept. It has match_cache_size entries (0 turns it off) in sets of 4, each
+    // evicting the entry it used least recently. clear_lookup_cache() forgets it (a new size takes effect then),
+    // and so do a collection and set_prototypes(), but nothing else does, so statements mustn't be changed in place, and (matches)
+    // functions have to give the same answer for a token every time.
+    size_t match_cache_size = 16384;
+    size_t match_cache_hits = 0;
+    size_t match_cache_evictions = 0;
+    // the cache (read only), allocated when it is first used
+    match_cache_set* match_cache = NULL;
+    size_t match_cache_sets = 0;
+    // how many sequences and repetitions the matcher has gone into, to see how much backtracking it does
+    size_t match_steps = 0;
 
-    // overridden garbage collect
+
+    // overridden garbage collect (always the whole heap)
     size_t gc();
 
+    // Runs gc() only once more than max(gc_min_budget, live objects * gc_growth) objects have been allocated
+    // since the last one, so the cost of collecting stays proportional to the allocation rate instead of
+    // the whole heap being walked again for every handful of garbage. Returns whether it collected.
+    bool maybe_gc();
+    size_t gc_min_budget = 10000;
+    double gc_growth = 1.0;
+
+    // If true, run() calls maybe_gc() after each instruction, so anything the embedder holds on to
+    // across run() has to be reachable from the vm (globals, a thread, ...)
+    bool auto_gc = false;
+
+    // Generational collection: if set, maybe_gc() collects just the objects allocated since the last collection
+    // once there are gc_nursery of them (a minor collection), and the whole heap only once gc_budget() objects
+    // have survived minor collections since the last one that did. The heap isn't moved: an object that
+    // survives a collection is old from then on because it keeps its mark bit, so marking stops at it and
+    // only the young objects are swept. That makes write_barrier() necessary for every young object stored
+    // into an old one. gc() and gc_step() still collect the whole heap.
+    bool generational_gc = false;
+    size_t gc_nursery = 10000;
+    // the minor collections so far (they are in gc_count and the pauses too)
+    size_t gc_minor_count = 0;
+    uint64_t gc_minor_total_ns = 0;
+    uint64_t gc_minor_max_ns = 0;
+
+    // Incremental collection: if set, run() with auto_gc calls gc_step() instead of maybe_gc(), so a collection
+    // is spread over slices of at most gc_slice_ns between instructions, marking and then sweeping. The one pause
+    // that isn't bounded by gc_slice_ns ends the marking: it rescans the roots (the queued threads' stacks included)
+    // and drops the dead from the intern tables, so it grows with those and not with the heap.
+    bool incremental_gc = false;
+    // the most time a slice may take (0 marks the minimum of 64 objects per slice)
+    uint64_t gc_slice_ns = 100000;
+
+    // Starts a collection once maybe_gc() would have, then marks or sweeps for up to gc_slice_ns per call until
+    // the collection is done. Allocating while the sweep is unfinished sweeps just enough to find a free slot.
+    // Returns whether it did anything.
+    bool gc_step();
+
+    // How many objects ahead of marking the marker prefetches them (up to GC_PREFETCH_MAX, 0 = off).
+    // This is what lets it have several cache misses outstanding instead of waiting for each in turn, which
+    // pays off on scattered heaps but costs a little on lists that were allocated in order.
+    size_t gc_prefetch = 8;
+
+    // How many threads gc() marks and sweeps with, the calling one included (up to GC_THREADS_MAX). With more
+    // than one, the first gc() starts a pool of worker threads that lasts as long as the vm. They mark with
+    // atomic mark bits, each from its own stack, and take over half of another's stack when theirs runs out,
+    // then sweep a share of the chunks each. Calling the types' free functions (which unintern and release
+    // payloads) and relinking the free slots stays on the calling thread. gc_step() and the minor collections
+    // of generational_gc always run on the calling thread alone.
+    size_t gc_threads = 1;
+
+    // true between the gc_step() that starts a collection and the one that has marked everything (read only)
+    bool gc_marking = false;
+    // then true until gc_step() (or allocating, or gc()) has swept the last chunk (read only)
+    bool gc_sweeping = false;
+
+    // Has to be called with an object stored into an existing object with car() or cdr() while gc_marking or
+    // generational_gc, otherwise the collector could miss it. set_property() and the thread stacks don't need it.
+    inline void write_barrier(object* value) {
+        if (this->gc_marking) this->shade(value);
+        else if (this->generational_gc && value && !(value->flags & MARKBIT)) {
+            // (storing the same one over and over is common enough to be worth not repeating)
+            if (this->remembered_len && this->remembered[this->remembered_len - 1] == value) return;
+            if (this->remembered_len == this->remembered_cap) grow_list(&this->remembered, &this->remembered_cap);
+            this->remembered[this->remembered_len++] = value;
+        }
+    }
+
+    // queues the object to be marked (the mark functions use this instead of recursing)
+    inline void shade(object* o) {
+        if (!o) return;
+        if (this->marking_in_parallel) return this->shade_parallel(o);
+        if (this->grey_len == this->grey_cap) this->grow_grey();
+        this->grey[this->grey_len++] = o;
+    }
+
+    // statistics of the collections so far (the times include the gc_step() slices)
+    size_t gc_count = 0;
+    uint64_t gc_total_ns = 0;
+    uint64_t gc_max_ns = 0;
+    // number of objects that survived the last gc()
+    size_t live_objects = 0;
+    // the most recent pauses (gc()s and gc_step() slices) in ns, the nth one is at gc_pauses[n % GC_PAUSE_LOG]
+    uint64_t gc_pauses[GC_PAUSE_LOG];
+    size_t gc_pause_count = 0;
+
+    // removes a swept object from its intern table (called by the types' free functions during gc())
+    void unintern(object* o);
+
+    #ifdef PICKLE_STATS
+    vm_stats stats;
+    #endif
+    // Writes the statistics as a JSON object: the gc numbers above and the thread counts, and when built
+    // with PICKLE_STATS everything in stats too (per opcode by name, allocations by type name).
+    void write_stats(sink* out);
+    // zeroes stats (does nothing without PICKLE_STATS)
+    void reset_stats();
+
+    // Sampling profiler. While it is on, run() records the current thread's instruction stack every so often:
+    // start_profile() every n instructions, start_profile_timer() every interval_ns of CPU time (that uses
+    // SIGPROF, so only one vm can have it at a time; it returns false if another one does). Starting it from
+    // inside an instruction takes effect from the next step() or run(). A sample is taken just after an
+    // instruction returns, with that instruction as the leaf and the instructions below it on the stack as
+    // its callers. write_profile() writes the samples as folded stacks, one "bottom;...;leaf count" line per
+    // distinct stack (what flamegraph.pl takes), with typed instructions as name[type].
+    void start_profile(size_t every);
+    bool start_profile_timer(uint64_t interval_ns = 1000000);
+    void stop_profile();
+    void write_profile(sink* out);
+    // forgets the samples so far
+    void clear_profile();
+    // number of samples taken since the last clear_profile()
+    size_t profile_samples = 0;
 
     private:
+    // where the allocation counter was at the end of the last gc(), and how many objects have been freed altogether
+    size_t allocations_at_gc = 0;
+    size_t freed_total = 0;
+    // objects that still have to be marked
+    object** grey = NULL;
+    size_t grey_len = 0;
+    size_t grey_cap = 0;
+    void grow_grey();
+    // doubles the capacity of one of the object lists here
+    static void grow_list(object*** items, size_t* cap);
+    // With generational_gc, the objects allocated since the last collection, and the ones write_barrier() has
+    // seen stored (parked threads too), which the next minor collection marks from as well as the roots.
+    object** young = NULL;
+    size_t young_len = 0;
+    size_t young_cap = 0;
+    object** remembered = NULL;
+    size_t remembered_len = 0;
+    size_t remembered_cap = 0;
+    // how many objects have become old since the last collection of the whole heap
+    size_t promoted = 0;
+    // whether the objects that survived the last collection are still marked
+    bool marks_kept = false;
+    void minor_gc();
+    void major_gc();
+    // clears the marks the generations are made of, before the whole heap is marked from scratch
+    void forget_generations();
+    // the allocation count maybe_gc() waits for
+    size_t gc_budget();
+    // shades the roots and rescans the threads, which are stored into without a write barrier
+    void mark_roots();
+    void rescan_thread(object* thread);
+    // marks until nothing is left or the deadline (0 = none) passes, returns whether it finished
+    bool drain_grey(uint64_t deadline);
+    void record_pause(uint64_t ns);
+    // the counters once a collection has swept everything
+    void collected(size_t freed);
+    // The lazy sweep of gc_step(): the link to the next chunk to look at, and the objects freed so far.
+    // The chunks are only ever added in front of the first one, and not while it is sweeping (see alloc()).
+    // major_gc() sweeps with it too, but keeping the survivors' marks.
+    tinobsy::chunk** sweep_link = NULL;
+    size_t sweep_freed = 0;
+    bool sweep_keeps_marks = false;
+    // sweeps until the deadline (0 = none) passes, or with until_free until there's a free slot, and
+    // returns whether it finished (it always does at least one chunk)
+    bool sweep_chunks(uint64_t deadline, bool until_free);
+    // the sweep doesn't unintern what it frees, so the dead are taken out of the intern tables before it starts
+    void drop_unmarked_interns();
+    // gc() with gc_threads > 1: the pool is started by the first one, and while its workers are marking,
+    // shade() pushes onto the stack of the worker it's called on
+    friend struct gc_pool;
+    gc_pool* pool = NULL;
+    bool marking_in_parallel = false;
+    void shade_parallel(object* o);
+    void mark_parallel();
+    size_t sweep_parallel();
+
+    // the cell of the queue just before the current one, so threads can be added and removed in O(1)
+    object* queue_tail = NULL;
+    // instructions the current thread has run in this time slice, and when the slice started
+    size_t slice_used = 0;
+    uint64_t slice_start = 0;
+    // hashmap of the parked threads (to themselves)
+    object* parked = NULL;
+    // adds the thread to the end of the queue
+    void enqueue(object* thread);
+    // removes the current thread from the queue
+    void dequeue();
+    // the dispatch loop behind step(), run() and run_for(), a deadline of 0 is none
+    run_status run_until(size_t fuel, uint64_t deadline);
+    // each way of profiling gets its own copy of the loop, so it costs nothing while it's off
+    enum profile_mode { PROFILE_OFF, PROFILE_EVERY, PROFILE_TIMER };
+    template <profile_mode mode> run_status run_loop(size_t fuel, uint64_t deadline);
+
+    profile_mode profiling = PROFILE_OFF;
+    // with PROFILE_EVERY, the instructions between samples and until the next one
+    size_t profile_every = 0;
+    size_t profile_countdown = 0;
+    // with PROFILE_TIMER, set by the SIGPROF handler and cleared by the sample
+    volatile sig_atomic_t profile_ticked = 0;
+    // the distinct folded stacks sampled so far, an open-addressed hash table
+    profile_entry* profile = NULL;
+    size_t profile_cap = 0;
+    size_t profile_len = 0;
+    // where the folded stack of a sample is put together
+    sink profile_key;
+    // records the stack of the thread as it was when the instruction (op, type) was called with depth instructions under it
+    void take_sample(thread_state* t, size_t depth, object* op, object* type);
+    static void on_sigprof(int);
+
+    // allocated length of opcodes
+    size_t opcodes_cap = 0;
+
+    // open-addressed (linear probing) hash set of the objects of one interned type.
+    // Objects are removed from it by unintern() when gc() sweeps them, or all at once before gc_step() sweeps.
+    struct intern_table {
+        object** slots = NULL;
+        size_t capacity = 0; // always a power of 2
+        size_t used = 0; // live entries + tombstones
+        size_t live = 0;
+        STATS(vm_stats::intern_counts* counts = NULL;)
+    };
+    intern_table interned_symbols;
+    intern_table interned_strings;
+    intern_table interned_ints;
+    intern_table interned_floats;
+    intern_table interned_funcs;
+    intern_table interned_bigints;
+    // the tables above by value_type::intern_index (NULL for NOT_INTERNED)
+    intern_table* intern_tables[NUM_INTERN_TABLES];
+
+    // the preboxed small integers (not in interned_ints, they are always marked instead)
+    object* small_ints[SMALL_INT_MAX - SMALL_INT_MIN + 1];
+
+    // copies the chars for a string or symbol, with the hash stored in front of them
+    char* copy_chars(const char* chs, size_t len, uint64_t hash);
+
+    // finds the slot holding the matching object, or the empty slot it should be inserted into
+    object** intern_lookup(intern_table& t, uint64_t hash, const char* chs, size_t len);
+    object** intern_lookup(intern_table& t, uint64_t hash, int64_t x);
+    object** intern_lookup(intern_table& t, uint64_t hash, void* ptr);
+    object** intern_lookup(intern_table& t, uint64_t hash, const uint32_t* limbs, size_t len, bool neg);
+    // fills the slot returned by intern_lookup() (must be called before anything else touches the table)
+    void intern_insert(intern_table& t, object** slot, object* o);
+    // rebuilds the table with twice the capacity if it is getting full, dropping tombstones
+    void intern_reserve(intern_table& t);
+
+    // the slow path of int_add() and int_sub()
+    object* bigint_add(object* a, object* b, bool negate_b);
+
+    // Remembers where recursive get_property() found (or didn't find) a property, and which object it was on.
+    // The entry is valid as long as the write counter for its hash is still the same as when it was stored,
+    // and no object's prototypes have been replaced since.
+    struct lookup_cache_entry {
+        object* obj;
+        object* key;
+        object* holder;
+        object* value;
+        uint32_t epoch;
+        uint32_t generation;
+    };
+    lookup_cache_entry lookup_cache[LOOKUP_CACHE_SIZE];
+    uint32_t property_epochs[PROPERTY_EPOCHS];
+    // bumped by set_prototypes(), which may change what any recursive lookup finds
+    uint32_t lookup_generation = 0;
+    // forgets the pattern matcher's cache
+    void drop_match_cache();
+    // how many places in the patterns have been numbered for the packrat cache
+    uint32_t match_points = 0;
+
+    // the uncached prototype chain search, stores the object the property was found on in *holder
+    object* find_property(object* obj, object* key, uint64_t hash, object** holder);
+    object* get_own_property(object* obj, object* key, uint64_t hash);
+
     // marks reachable objects
     void mark_globals();
 
@@ -205,21 +976,27 @@ class pvm : public tinobsy::vm {
         return car(this->queue);
     }
 
-    // gets the next instruction from the current thread or nil if no thread
-    inline object* pop_inst() {
-        object* curr_thread = this->curr_thread();
-        if (!curr_thread) return nil;
-        return this->pop(cdr(cdr(curr_thread)));
-    }
+    // doubles the space for the stacks
+    void grow_data(thread_state* t);
+    void grow_insts(thread_state* t);
 
-    int hash_seed;
+    // 128 bits from the kernel's random number generator
+    uint64_t hash_key[2];
 };
 
 
 // Helper functions.
 
-// Returns 0 if equal, or nonzero if not equal. Doesn't work on compound or user types
-int eqcmp(object*, object*);
+// Compares two objects: negative if a comes first, 0 if they are equal, positive if b comes first.
+// nil comes first, then the ranks in order (see type_rank). Numbers compare by value (an int before a float
+// with the same value, NaN after everything), strings and ropes by their chars, conses and objects by address.
+int eqcmp(object* a, object* b);
+// Whether eqcmp() would return 0, but quicker
+inline bool equal(object* a, object* b) {
+    if (a == b) return true;
+    if (!a || !b || type_of(a)->rank != type_of(b)->rank) return false;
+    return type_of(a)->equal(a, b);
+}
 // Returns the pair in the assoc list that has the same key, or NULL if not found.
 object* assoc(object*, object*);
 // Removes the key/value pair from the list and returns it, or returns NULL if the pair never existed.
@@ -227,8 +1004,45 @@ object* delassoc(object**, object*);
 
 namespace parser {
 object* tokenize(pvm* vm, object* cookie, object* inst_type);
+
+// Source streams for tokenize_stream(), which pops one off the data stack and reads it chunk_size bytes at a time.
+// open_stream() doesn't take ownership of the fd; map_file() returns nil if the file can't be opened.
+// If a read fails (other than with EINTR, which is retried) the thread gets the condition error,
+// with ("read failed in tokenize_stream()" errno) on the data stack.
+object* open_stream(pvm* vm, int fd, size_t chunk_size = 65536);
+object* map_file(pvm* vm, const char* path, size_t chunk_size = 65536);
+object* tokenize_stream(pvm* vm, object* cookie, object* inst_type);
 }
 
+// where get_best_match() found a pattern in a statement
+struct pattern_match {
+    object* pattern;
+    object* handler;
+    // alist of (capture name . what it captured): the token for a capture of one token test, otherwise the list of tokens
+    object* bindings;
+    // the tokens it matched are from start up to end (indexes into the statement, counting space tokens)
+    size_t start;
+    size_t end;
+};
+
+// Finds the best match of the vm's patterns anywhere in the statement (a list of tokens), and returns the pattern,
+// or nil if none matched. The elements of a pattern are:
+//   a token (anything but a cons)    the token, by equal()
+//   (any)                            any one token
+//   (is type)                        a token that is the object type or inherits from it, or whose type is named by the symbol type
+//   (matches function)               a token the c_function returns non-nil for (it gets the token as its cookie)
+//   (capture name element...)        what the elements match, bound to the symbol name
+//   (repeat min max element...)      the elements min to max times (max nil is no limit), as many as possible
+//   (lazy min max element...)        the same, but as few as possible
+//   (alt (element...) ...)           the first of the alternatives that lets the whole pattern match
+// Space tokens are skipped over (so they can't be matched), newlines aren't. A pattern that matches no tokens
+// doesn't count. The best match is the one with the highest precedence, then the most specific pattern (counting
+// the tokens it has to match twice and the type tests once), then the leftmost, then the latest defined.
+object* get_best_match(pvm* vm, object* statement, pattern_match* m);
+
+// Rewrites the statement on top of the data stack until no pattern matches it, then leaves it there. The best match's
+// handler is called with its bindings on the data stack and has to leave what replaces the matched tokens (nil
+// to just remove them). Both of these have to be defop()ed as "eval" and "splice_match", since eval() pushes them by name.
 object* eval(pvm* vm, object* cookie, object* inst_type);
 object* splice_match(pvm* vm, object* cookie, object* inst_type);
 }
@@ -0,0 +1,1272 @@
+#include "pickle.hpp"
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <initializer_list>
+
+using pickle::pvm;
+using pickle::object;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ------------------------- reporting -------------------------
+
+// Everything a benchmark reports is kept, for --json and --baseline. Timed loops are in ns/op (with
+// ops/sec and object allocations per op alongside), anything else is a metric with its own unit.
+struct result {
+    char name[64];
+    const char* unit;
+    double value;
+    double ops_per_sec;
+    double allocs_per_op;
+};
+
+static result* results = NULL;
+static size_t num_results = 0, results_cap = 0;
+
+static void add_result(const char* name, const char* unit, double value, double ops_per_sec, double allocs_per_op) {
+    if (num_results == results_cap) {
+        results_cap = results_cap ? results_cap * 2 : 64;
+        results = (result*)realloc(results, results_cap * sizeof(result));
+    }
+    result* r = &results[num_results++];
+    // the indented names are details of the line above them
+    while (*name == ' ') name++;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->unit = unit;
+    r->value = value;
+    r->ops_per_sec = ops_per_sec;
+    r->allocs_per_op = allocs_per_op;
+}
+
+// n operations took secs, and allocated that many objects
+static void report(const char* what, double n, double secs, size_t allocations) {
+    printf("%-44s %12.0f ops/sec %10.2f ns/op %8.3f allocs/op\n", what, n / secs, secs * 1e9 / n, allocations / n);
+    add_result(what, "ns/op", secs * 1e9 / n, n / secs, allocations / n);
+}
+
+static void metric(const char* what, double value, const char* unit) {
+    printf("%-44s %12.2f %s\n", what, value, unit);
+    add_result(what, unit, value, 0, 0);
+}
+
+// which way is an improvement, for comparing with a baseline
+static bool higher_is_better(const char* unit) {
+    return !strcmp(unit, "MB/s") || !strcmp(unit, "x");
+}
+
+// The worst cases (a p99 or max) hang on a single slow moment, like a page fault or being scheduled out,
+// so they're shown against the baseline but don't count as regressions
+static bool is_tail(const char* name) {
+    size_t len = strlen(name);
+    return (len >= 4 && !strcmp(name + len - 4, " max")) || (len >= 4 && !strcmp(name + len - 4, " p99"));
+}
+
+static void write_json_string(FILE* f, const char* s) {
+    fputc('"', f);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\') fputc('\\', f);
+        fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// one result per line, so the baseline can be read back without a JSON parser
+static bool write_json(const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return false;
+    fprintf(f, "{\n  \"results\": [\n");
+    for (size_t i = 0; i < num_results; i++) {
+        result* r = &results[i];
+        fprintf(f, "    {\"name\": ");
+        write_json_string(f, r->name);
+        fprintf(f, ", \"unit\": \"%s\", \"value\": %.6g", r->unit, r->value);
+        if (r->ops_per_sec) fprintf(f, ", \"ops_per_sec\": %.6g, \"allocs_per_op\": %.6g", r->ops_per_sec, r->allocs_per_op);
+        fprintf(f, "}%s\n", i + 1 < num_results ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+    return fclose(f) == 0;
+}
+
+// Prints how every result changed since the baseline (a file --json wrote), and returns how many
+// got worse by more than threshold percent (not counting worst cases).
+static size_t compare_with(const char* path, double threshold) {
+    FILE* f = fopen(path, "r");
+    if (!f) {
+        printf("can't read baseline %s\n", path);
+        return 0;
+    }
+    printf("\n%-44s %12s %12s %8s\n", path, "baseline", "now", "change");
+    size_t worse = 0;
+    char line[512], name[64];
+    while (fgets(line, sizeof(line), f)) {
+        const char* p = strstr(line, "\"name\": \"");
+        const char* v = strstr(line, "\"value\": ");
+        if (!p || !v) continue;
+        size_t len = 0;
+        for (p += 9; *p && *p != '"' && len + 1 < sizeof(name); p++) {
+            if (*p == '\\') p++;
+            name[len++] = *p;
+        }
+        name[len] = 0;
+        double before = strtod(v + 9, NULL);
+        for (size_t i = 0; i < num_results; i++) {
+            result* r = &results[i];
+            if (strcmp(r->name, name) || !before) continue;
+            double change = (r->value - before) / before * 100;
+            bool regressed = higher_is_better(r->unit) ? change < -threshold : change > threshold;
+            const char* note = !regressed ? "" : is_tail(name) ? "  (worst case, not counted)" : "  <-- worse";
+            if (!is_tail(name)) worse += regressed;
+            printf("%-44s %12.2f %12.2f %+7.1f%% %s%s\n", name, before, r->value, change, r->unit, note);
+        }
+    }
+    fclose(f);
+    return worse;
+}
+
+static uint64_t splitmix(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static object* nop(pvm* vm, object* cookie, object* inst_type) {
+    return inst_type;
+}
+
+// ------------------------- instruction dispatch -------------------------
+
+static void bench_dispatch(size_t num_ops) {
+    const size_t batch = 1000, rounds = 1000;
+    pvm vm;
+    char name[64];
+    // the op that runs is registered first so the old alist lookup would have to walk past all of the others
+    vm.defop("bench_nop", nop);
+    for (size_t i = 1; i < num_ops; i++) {
+        snprintf(name, sizeof(name), "nop_%zu", i);
+        vm.defop(name, nop);
+    }
+    object* inst = vm.sym("bench_nop");
+    double elapsed = 0;
+    size_t allocations = 0;
+    for (size_t r = 0; r < rounds; r++) {
+        vm.start_thread();
+        for (size_t i = 0; i < batch; i++) vm.push_inst(inst);
+        size_t before = vm.allocations;
+        double start = now();
+        while (vm.queue) vm.step();
+        elapsed += now() - start;
+        allocations += vm.allocations - before;
+        vm.gc();
+    }
+    snprintf(name, sizeof(name), "step() with %zu ops", num_ops);
+    report(name, (double)(batch * rounds), elapsed, allocations);
+
+    // What every step() used to pay before it could even call the function
+    allocations = vm.allocations;
+    double start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < batch * rounds / 10; i++) found += pickle::assoc(vm.function_registry, inst) != nil;
+    elapsed = now() - start;
+    snprintf(name, sizeof(name), "  old assoc() lookup with %zu ops", num_ops);
+    report(name, (double)found, elapsed, vm.allocations - allocations);
+}
+
+static void bench_run() {
+    const size_t batch = 1000, rounds = 1000;
+    pvm vm;
+    vm.defop("bench_nop", nop);
+    object* inst = vm.sym("bench_nop");
+    for (int use_run = 0; use_run < 2; use_run++) {
+        double elapsed = 0;
+        size_t allocations = 0;
+        for (size_t r = 0; r < rounds; r++) {
+            vm.start_thread();
+            for (size_t i = 0; i < batch; i++) vm.push_inst(inst);
+            size_t before = vm.allocations;
+            double start = now();
+            if (use_run) vm.run();
+            else while (vm.queue) vm.step();
+            elapsed += now() - start;
+            allocations += vm.allocations - before;
+            vm.gc();
+        }
+        report(use_run ? "run()" : "while (queue) step()", (double)(batch * rounds), elapsed, allocations);
+    }
+}
+
+static object* spin(pvm* vm, object* cookie, object* inst_type) {
+    vm->push_inst("spin");
+    return nil;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// how far past the deadline run_for() returns
+static void bench_run_for(uint64_t budget_ns) {
+    const size_t n = 1000;
+    pvm vm;
+    vm.defop("spin", spin);
+    vm.start_thread();
+    vm.push_inst("spin");
+    double* over = (double*)malloc(n * sizeof(double));
+    for (size_t i = 0; i < n; i++) {
+        double start = now();
+        vm.run_for(budget_ns);
+        over[i] = (now() - start) * 1e9 - budget_ns;
+        if (i % 64 == 0) vm.gc();
+    }
+    qsort(over, n, sizeof(double), compare_doubles);
+    char name[64];
+    snprintf(name, sizeof(name), "run_for(%" PRIu64 " ns) overshoot p50", budget_ns);
+    metric(name, over[n / 2], "ns");
+    snprintf(name, sizeof(name), "run_for(%" PRIu64 " ns) overshoot p99", budget_ns);
+    metric(name, over[n * 99 / 100], "ns");
+    snprintf(name, sizeof(name), "run_for(%" PRIu64 " ns) overshoot max", budget_ns);
+    metric(name, over[n - 1], "ns");
+    free(over);
+}
+
+// what sampling costs a thread that spins on top of a few instructions that never run, best of 3:
+// mode 0 is without the profiler, 1 samples at 1 kHz of CPU time, 2 every 1000 instructions
+static double bench_profile(int mode) {
+    const size_t n = 5000000;
+    pvm vm;
+    vm.defop("spin", spin);
+    vm.defop("bench_nop", nop);
+    vm.start_thread();
+    for (int i = 0; i < 16; i++) vm.push_inst("bench_nop", "error");
+    vm.push_inst("spin");
+    if (mode == 1) vm.start_profile_timer(1000000);
+    if (mode == 2) vm.start_profile(1000);
+    double best = 1e9;
+    size_t allocations = vm.allocations;
+    for (int i = 0; i < 3; i++) {
+        double start = now();
+        vm.run(n);
+        double elapsed = now() - start;
+        if (elapsed < best) best = elapsed;
+    }
+    vm.stop_profile();
+    const char* names[] = { "run() without profiling", "run() profiling at 1 kHz", "run() profiling every 1000 insts" };
+    report(names[mode], (double)n, best, (vm.allocations - allocations) / 3);
+    return best;
+}
+
+// ------------------------- scheduler -------------------------
+
+static void bench_threads(size_t quantum) {
+    const size_t num_threads = 100000, insts = 10;
+    pvm vm;
+    vm.defop("bench_nop", nop);
+    vm.quantum = quantum;
+    object* inst = vm.sym("bench_nop");
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t i = 0; i < num_threads; i++) {
+        vm.start_thread();
+        for (size_t j = 0; j < insts; j++) vm.push_inst(inst);
+    }
+    double spawned = now();
+    char name[64];
+    snprintf(name, sizeof(name), "spawn thread + %zu insts, quantum %zu", insts, quantum);
+    report(name, (double)num_threads, spawned - start, vm.allocations - allocations);
+    allocations = vm.allocations;
+    size_t steps = 0;
+    while (vm.queue) vm.step(), steps++;
+    // every thread retires when its last instruction has run
+    snprintf(name, sizeof(name), "  step() until retired, quantum %zu", quantum);
+    report(name, (double)steps, now() - spawned, vm.allocations - allocations);
+}
+
+static object* park(pvm* vm, object* cookie, object* inst_type) {
+    vm->park_thread();
+    return nil;
+}
+
+// the stacks should be warm after the first round, so pushing and popping never allocates
+static void bench_stacks() {
+    const size_t depth = 64, rounds = 100000;
+    pvm vm;
+    vm.defop("bench_nop", nop);
+    object* inst = vm.sym("bench_nop");
+    object* x = vm.integer(7);
+    vm.start_thread();
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < depth; i++) vm.push_data(x);
+        for (size_t i = 0; i < depth; i++) vm.pop();
+    }
+    double elapsed = now() - start;
+    report("push_data() + pop()", (double)(depth * rounds), elapsed, vm.allocations - allocations);
+    allocations = vm.allocations;
+    // keep the thread alive with something at the bottom of its instruction stack
+    vm.push_inst("park");
+    start = now();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < depth; i++) vm.push_inst(inst);
+        vm.run(depth);
+    }
+    elapsed = now() - start;
+    report("push_inst() + run()", (double)(depth * rounds), elapsed, vm.allocations - allocations);
+}
+
+static void bench_parked(size_t num_parked) {
+    const size_t n = 1000000;
+    pvm vm;
+    vm.defop("bench_nop", nop);
+    vm.defop("park", park);
+    for (size_t i = 0; i < num_parked; i++) {
+        vm.start_thread();
+        vm.push_inst("park");
+    }
+    while (vm.queue) vm.step();
+    object* inst = vm.sym("bench_nop");
+    vm.start_thread();
+    for (size_t i = 0; i < n; i++) vm.push_inst(inst);
+    size_t allocations = vm.allocations;
+    double start = now();
+    while (vm.queue) vm.step();
+    char name[64];
+    snprintf(name, sizeof(name), "step() with %zu parked threads", vm.num_parked);
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+}
+
+// ------------------------- gc -------------------------
+
+// makes a short list, and keeps one in 64 of them around for a while
+static object* churn(pvm* vm, object* cookie, object* inst_type) {
+    object* list = nil;
+    for (int i = 0; i < 16; i++) vm->push(vm->integer(i), list);
+    static size_t n = 0;
+    object* ring = car(vm->globals);
+    if (!(n++ & 63)) {
+        // the ring is old by now, which the generational collector has to be told about
+        car(ring) = list;
+        vm->write_barrier(list);
+        car(vm->globals) = cdr(ring);
+    }
+    vm->push_inst("churn");
+    return nil;
+}
+
+// the minor and major collections of generational_gc
+static void report_generations(pvm* vm, const char* what) {
+    char name[64];
+    size_t majors = vm->gc_count - vm->gc_minor_count;
+    printf("  %zu minor, %zu major collections\n", vm->gc_minor_count, majors);
+    snprintf(name, sizeof(name), "  %s: minor pause avg", what);
+    metric(name, vm->gc_minor_count ? vm->gc_minor_total_ns / 1e3 / vm->gc_minor_count : 0.0, "us");
+    snprintf(name, sizeof(name), "  %s: minor pause max", what);
+    metric(name, vm->gc_minor_max_ns / 1e3, "us");
+    snprintf(name, sizeof(name), "  %s: major pause avg", what);
+    metric(name, majors ? (vm->gc_total_ns - vm->gc_minor_total_ns) / 1e3 / majors : 0.0, "us");
+}
+
+// mode 0 = gc() after every step() (like pickle_test does), 1 = gc() every 1000 steps, 2 = auto_gc,
+// 3 = auto_gc with generational_gc
+static void bench_gc(int mode) {
+    // collecting every step is so slow it gets fewer steps
+    const size_t n = mode ? 200000 : 2000;
+    pvm vm;
+    vm.defop("churn", churn);
+    // a long-lived heap that every full collection has to walk
+    object* old = nil;
+    for (size_t i = 0; i < 100000; i++) vm.push(vm.integer(i), old);
+    object* ring = vm.cons(nil, nil);
+    cdr(ring) = ring;
+    for (size_t i = 0; i < 1000; i++) ring = cdr(ring) = vm.cons(nil, cdr(ring));
+    vm.globals = vm.cons(ring, old);
+    vm.gc();
+    vm.gc_count = vm.gc_total_ns = vm.gc_max_ns = 0;
+    vm.auto_gc = mode >= 2;
+    vm.generational_gc = mode == 3;
+    vm.start_thread();
+    vm.push_inst("churn");
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        vm.run(1);
+        if (mode == 0 || (mode == 1 && i % 1000 == 999)) vm.gc();
+    }
+    double elapsed = now() - start;
+    const char* names[] = { "gc() every step", "gc() every 1000 steps", "auto_gc", "auto_gc, generational" };
+    char name[64];
+    report(names[mode], (double)n, elapsed, vm.allocations - allocations);
+    if (mode == 3) {
+        report_generations(&vm, names[mode]);
+        return;
+    }
+    printf("  %zu collections\n", vm.gc_count);
+    snprintf(name, sizeof(name), "  %s: pause avg", names[mode]);
+    metric(name, vm.gc_count ? vm.gc_total_ns / 1e3 / vm.gc_count : 0.0, "us");
+    snprintf(name, sizeof(name), "  %s: pause max", names[mode]);
+    metric(name, vm.gc_max_ns / 1e3, "us");
+}
+
+static int compare_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+// the same heap collected all at once, by gc_step(), or by generation
+enum { STOP_THE_WORLD, INCREMENTAL, GENERATIONAL };
+
+static void bench_incremental_gc(int mode) {
+    const size_t n = 200000;
+    pvm vm;
+    vm.defop("churn", churn);
+    // a million conses that every collection has to mark
+    object* old = nil;
+    for (size_t i = 0; i < 1000000; i++) vm.push(vm.integer(i & 1023), old);
+    object* ring = vm.cons(nil, nil);
+    cdr(ring) = ring;
+    for (size_t i = 0; i < 1000; i++) ring = cdr(ring) = vm.cons(nil, cdr(ring));
+    vm.globals = vm.cons(ring, old);
+    vm.gc();
+    vm.gc_count = vm.gc_pause_count = 0;
+    vm.gc_growth = 0.25;
+    vm.auto_gc = true;
+    vm.incremental_gc = mode == INCREMENTAL;
+    vm.generational_gc = mode == GENERATIONAL;
+    vm.start_thread();
+    vm.push_inst("churn");
+    size_t allocations = vm.allocations;
+    double start = now();
+    vm.run(n);
+    double elapsed = now() - start;
+    size_t pauses = vm.gc_pause_count < GC_PAUSE_LOG ? vm.gc_pause_count : GC_PAUSE_LOG;
+    uint64_t sorted[GC_PAUSE_LOG];
+    memcpy(sorted, vm.gc_pauses, pauses * sizeof(uint64_t));
+    qsort(sorted, pauses, sizeof(uint64_t), compare_u64);
+    const char* names[] = { "auto_gc, 1M heap", "auto_gc, incremental, 1M heap", "auto_gc, generational, 1M heap" };
+    const char* what = names[mode];
+    char name[64];
+    report(what, (double)n, elapsed, vm.allocations - allocations);
+    printf("  %zu collections in %zu pauses\n", vm.gc_count, vm.gc_pause_count);
+    snprintf(name, sizeof(name), "  %s: pause p50", what);
+    metric(name, pauses ? sorted[pauses / 2] / 1e3 : 0.0, "us");
+    snprintf(name, sizeof(name), "  %s: pause p99", what);
+    metric(name, pauses ? sorted[pauses * 99 / 100] / 1e3 : 0.0, "us");
+    snprintf(name, sizeof(name), "  %s: pause max", what);
+    metric(name, pauses ? sorted[pauses - 1] / 1e3 : 0.0, "us");
+}
+
+static void bench_mark(bool tree, size_t prefetch, size_t threads = 1) {
+    const size_t n = 10000000;
+    pvm vm;
+    object** cells = (object**)malloc(n * sizeof(object*));
+    for (size_t i = 0; i < n; i++) cells[i] = vm.cons(nil, nil);
+    if (tree) {
+        // a binary tree with the cells in random order, so every child is a cache miss
+        uint64_t seed = 1;
+        for (size_t i = n - 1; i > 0; i--) {
+            size_t j = splitmix(&seed) % (i + 1);
+            object* t = cells[i];
+            cells[i] = cells[j];
+            cells[j] = t;
+        }
+        for (size_t i = 0; i < n; i++) {
+            if (2 * i + 1 < n) car(cells[i]) = cells[2 * i + 1];
+            if (2 * i + 2 < n) cdr(cells[i]) = cells[2 * i + 2];
+        }
+    } else {
+        for (size_t i = 0; i + 1 < n; i++) cdr(cells[i]) = cells[i + 1];
+    }
+    vm.globals = cells[0];
+    free(cells);
+    vm.gc_prefetch = prefetch;
+    vm.gc_threads = threads;
+    size_t allocations = vm.allocations;
+    double start = now();
+    vm.gc();
+    double elapsed = now() - start;
+    char name[64];
+    if (threads > 1) snprintf(name, sizeof(name), "gc() 10M %s, prefetch %zu, %zu threads", tree ? "tree" : "list", prefetch, threads);
+    else snprintf(name, sizeof(name), "gc() 10M %s, prefetch %zu", tree ? "tree" : "list", prefetch);
+    report(name, (double)n, elapsed, vm.allocations - allocations);
+}
+
+// ------------------------- payload allocation -------------------------
+
+static size_t rss_bytes() {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = 0;
+        fclose(f);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+static void bench_payloads(bool use_arena) {
+    // in a child process, so the RSS doesn't include whatever the other benchmarks left behind,
+    // which sends back the number of operations, the time and the RSS at the peak and at the end
+    const char* what = use_arena ? "payloads from the arena" : "payloads from malloc()";
+    double measured[4];
+    int fds[2];
+    if (pipe(fds) < 0) return;
+    fflush(stdout);
+    pid_t child = fork();
+    if (child) {
+        close(fds[1]);
+        bool ok = read(fds[0], measured, sizeof(measured)) == sizeof(measured);
+        close(fds[0]);
+        waitpid(child, NULL, 0);
+        if (!ok) return;
+        char name[64];
+        report(what, measured[0], measured[1], 0);
+        snprintf(name, sizeof(name), "  %s: peak RSS", what);
+        metric(name, measured[2], "KB");
+        snprintf(name, sizeof(name), "  %s: RSS after freeing 99%%", what);
+        metric(name, measured[3], "KB");
+        return;
+    }
+    close(fds[0]);
+    const size_t n = 1000000, rounds = 4;
+    pickle::arena a;
+    void** blocks = (void**)malloc(n * sizeof(void*));
+    uint64_t seed = 1;
+    size_t base = rss_bytes();
+    double start = now();
+    // string and hashmap node sized blocks, replaced at random a few times over, except for the first 1%
+    // which stay around for good
+    const size_t keep = n / 100;
+    for (size_t i = 0; i < n; i++) {
+        size_t size = 16 + splitmix(&seed) % 240;
+        blocks[i] = use_arena ? a.alloc(size) : malloc(size);
+        *(char*)blocks[i] = 1;
+    }
+    for (size_t r = 0; r < rounds * n; r++) {
+        size_t i = keep + splitmix(&seed) % (n - keep), size = 16 + splitmix(&seed) % 240;
+        if (use_arena) pickle::arena::release(blocks[i]);
+        else free(blocks[i]);
+        blocks[i] = use_arena ? a.alloc(size) : malloc(size);
+        *(char*)blocks[i] = 1;
+    }
+    double elapsed = now() - start;
+    size_t peak = rss_bytes() - base;
+    // then everything else goes away
+    for (size_t i = keep; i < n; i++) {
+        if (use_arena) pickle::arena::release(blocks[i]);
+        else free(blocks[i]);
+    }
+    size_t after = rss_bytes() - base;
+    measured[0] = (double)(n + 2 * rounds * n);
+    measured[1] = elapsed;
+    measured[2] = peak / 1024.0;
+    measured[3] = after / 1024.0;
+    if (write(fds[1], measured, sizeof(measured)) < 0) _exit(1);
+    _exit(0);
+}
+
+// ------------------------- interning -------------------------
+
+static void bench_intern(size_t heap_size) {
+    const size_t n = 1000000;
+    pvm vm;
+    // keep a bunch of other interned objects alive so the old linear search would have had to look through them
+    object* keep = nil;
+    char name[64];
+    for (size_t i = 0; i < heap_size; i++) {
+        snprintf(name, sizeof(name), "filler_%zu", i);
+        vm.push(vm.sym(name), keep);
+        vm.push(vm.integer(i + 1000000), keep);
+    }
+    vm.globals = keep;
+    object* syms[16];
+    for (size_t i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "sym_%zu", i);
+        syms[i] = vm.sym(name);
+    }
+    size_t allocations = vm.allocations;
+    double start = now();
+    size_t hits = 0;
+    for (size_t i = 0; i < n; i++) {
+        snprintf(name, sizeof(name), "sym_%zu", i & 15);
+        hits += vm.sym(name) == syms[i & 15];
+        hits += vm.intof(vm.integer(i & 1023)) == (int64_t)(i & 1023);
+    }
+    double elapsed = now() - start;
+    snprintf(name, sizeof(name), "sym()+integer() with %zu live", heap_size * 2);
+    report(name, (double)hits, elapsed, vm.allocations - allocations);
+}
+
+static char* make_source(size_t bytes) {
+    const char* words[] = { "lambda", " ", "x", "\n", "    ", "foo", "123", "bar", "456.5", "(", "+", ")", "[", "]", "_ident_", "9" };
+    char* src = (char*)malloc(bytes + 16);
+    size_t len = 0;
+    unsigned r = 12345;
+    while (len < bytes) {
+        r = r * 1103515245 + 12345;
+        const char* w = words[(r >> 16) & 15];
+        size_t wl = strlen(w);
+        memcpy(src + len, w, wl);
+        len += wl;
+    }
+    src[len] = 0;
+    return src;
+}
+
+// ------------------------- strings -------------------------
+
+static void bench_append(size_t n, bool use_ropes) {
+    pvm vm;
+    char piece[32];
+    object* s = vm.string("");
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t i = 0; i < n; i++) {
+        snprintf(piece, sizeof(piece), "%zu,", i);
+        if (use_ropes) {
+            s = vm.concat(s, vm.string(piece));
+            continue;
+        }
+        // what appending had to do without ropes: copy the whole string every time
+        size_t len = vm.string_length(s), plen = strlen(piece);
+        char* buf = (char*)malloc(len + plen);
+        memcpy(buf, vm.stringof(s), len);
+        memcpy(buf + len, piece, plen);
+        s = vm.string(buf, len + plen);
+        free(buf);
+    }
+    double appended = now() - start;
+    allocations = vm.allocations - allocations;
+    size_t len = strlen(vm.stringof(s));
+    double flattened = now() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "%zu appends, %s", n, use_ropes ? "concat()" : "copying");
+    report(name, (double)n, appended, allocations);
+    printf("  %zu chars\n", len);
+    snprintf(name, sizeof(name), "  %zu appends, %s: stringof() after", n, use_ropes ? "concat()" : "copying");
+    metric(name, (flattened - appended) * 1e3, "ms");
+}
+
+// The tokenizer as it was before it scanned spans of the source, kept to show what the rewrite bought:
+// every token's text went through asprintf(), and numbers through sscanf(), which strlen()s the whole
+// rest of the source each time, so it gets slower per byte as the source gets longer.
+static void old_bufcat(char** b, const char* c, int n) {
+    char* ob = *b;
+    if (asprintf(b, "%s%.*s", *b ? *b : "", n, c) < 0) *b = NULL;
+    free(ob);
+}
+
+static object* old_next_token(pvm* vm, const char* data, size_t* i, size_t len) {
+    char c = data[*i];
+    char* b = NULL;
+    object* result = nil;
+    if (isalpha(c) || c == '_') {
+        size_t p = *i;
+        while (*i < len && (isalpha(data[*i]) || isdigit(data[*i]) || data[*i] == '_')) ++*i;
+        old_bufcat(&b, data + p, *i - p);
+        result = vm->sym(b);
+    }
+    else if (isdigit(c)) {
+        double d;
+        int64_t n;
+        int num;
+        if (sscanf(data + *i, "%lg%n", &d, &num) == 1) result = vm->number(d);
+        else if (sscanf(data + *i, "%" SCNi64 "%n", &n, &num) == 1) result = vm->integer(n);
+        else num = 1;
+        *i += num;
+    }
+    else if (c == '\n' || c == '\r') {
+        while (data[*i] == '\n' || data[*i] == '\r') ++*i;
+        result = vm->sym("NEWLINE");
+    }
+    else if (isspace(c)) {
+        size_t p = *i;
+        while (*i < len && isspace(data[*i]) && data[*i] != '\n' && data[*i] != '\r') ++*i;
+        old_bufcat(&b, data + p, *i - p);
+        result = vm->sym(b);
+    }
+    else if (ispunct(c)) {
+        ++*i;
+        old_bufcat(&b, &c, 1);
+        result = vm->sym(b);
+    }
+    else ++*i;
+    free(b);
+    return result;
+}
+
+static object* old_tokenize(pvm* vm, object* cookie, object* inst_type) {
+    (void)cookie;
+    (void)inst_type;
+    const char* str = vm->stringof(vm->pop());
+    size_t i = 0, len = strlen(str);
+    object* result = nil;
+    object** tail = &result;
+    do {
+        *tail = vm->cons(old_next_token(vm, str, &i, len), nil);
+        tail = &cdr(*tail);
+    } while (i < len);
+    vm->push_data(result);
+    return nil;
+}
+
+static double bench_tokenize(size_t bytes, bool old) {
+    pvm vm;
+    vm.defop("tokenize", old ? old_tokenize : pickle::parser::tokenize);
+    char* src = make_source(bytes);
+    vm.start_thread();
+    vm.push_inst("tokenize");
+    vm.push_data(vm.string(src));
+    double start = now();
+    while (vm.queue) vm.step();
+    double elapsed = now() - start;
+    char name[64];
+    if (bytes >= 1000000) snprintf(name, sizeof(name), "tokenize() %zu MB%s", bytes / 1000000, old ? ", old tokenizer" : "");
+    else snprintf(name, sizeof(name), "tokenize() %zu KB%s", bytes / 1000, old ? ", old tokenizer" : "");
+    metric(name, bytes / elapsed / 1e6, "MB/s");
+    free(src);
+    return bytes / elapsed / 1e6;
+}
+
+static void bench_tokenize_stream(size_t bytes, bool mapped) {
+    pvm vm;
+    vm.defop("tokenize_stream", pickle::parser::tokenize_stream);
+    char* src = make_source(bytes);
+    char path[] = "/tmp/picklebenchXXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, src, strlen(src)) < 0) return;
+    lseek(fd, 0, SEEK_SET);
+    vm.start_thread();
+    vm.push_inst("tokenize_stream");
+    vm.push_data(mapped ? pickle::parser::map_file(&vm, path) : pickle::parser::open_stream(&vm, fd));
+    size_t steps = 0;
+    double start = now();
+    while (vm.queue) vm.step(), steps++;
+    double elapsed = now() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "tokenize_stream() %zu MB %s", bytes / 1000000, mapped ? "mmap" : "read");
+    metric(name, bytes / elapsed / 1e6, "MB/s");
+    printf("  %zu steps\n", steps);
+    close(fd);
+    unlink(path);
+    free(src);
+}
+
+// ------------------------- object properties -------------------------
+
+
+static void bench_properties(size_t num_props) {
+    const size_t lookups = 2000000;
+    pvm vm;
+    object** keys = (object**)malloc(num_props * sizeof(object*));
+    uint64_t seed = 42;
+    for (size_t i = 0; i < num_props; i++) keys[i] = vm.integer(splitmix(&seed));
+    // Filling one object takes next to no time with a few properties, so as many fresh objects are filled
+    // as take at least 1 ms, and the last one is what gets looked up in
+    size_t rounds = 1, allocations, set_allocations;
+    double start, set_time;
+    object** objs = NULL;
+    for (;; rounds *= 2) {
+        objs = (object**)realloc(objs, rounds * sizeof(object*));
+        for (size_t r = 0; r < rounds; r++) objs[r] = vm.newobject();
+        allocations = vm.allocations;
+        start = now();
+        for (size_t r = 0; r < rounds; r++) {
+            for (size_t i = 0; i < num_props; i++) vm.set_property(objs[r], keys[i], objs[r]);
+        }
+        set_time = now() - start;
+        set_allocations = vm.allocations - allocations;
+        if (set_time >= 1e-3) break;
+    }
+    object* obj = objs[rounds - 1];
+    vm.globals = obj;
+    free(objs);
+    size_t depth = 0, bytes = 0;
+    pickle::hashmap::measure(cdr(obj), 0, &depth, &bytes);
+    allocations = vm.allocations;
+    start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < lookups; i++) found += vm.get_property(obj, keys[splitmix(&seed) % num_props]) != nil;
+    double get_time = now() - start;
+    size_t get_allocations = vm.allocations - allocations;
+    printf("%zu properties: depth %zu, %.1f bytes/property\n", num_props, depth, (double)bytes / num_props);
+    char name[64];
+    snprintf(name, sizeof(name), "  set_property(), %zu properties", num_props);
+    report(name, (double)(num_props * rounds), set_time, set_allocations);
+    snprintf(name, sizeof(name), "  get_property(), %zu properties", num_props);
+    report(name, (double)found, get_time, get_allocations);
+    allocations = vm.allocations;
+    start = now();
+    for (size_t i = 0; i < lookups / 10; i++) vm.clone_object(obj);
+    snprintf(name, sizeof(name), "  clone_object(), %zu properties", num_props);
+    report(name, (double)(lookups / 10), now() - start, vm.allocations - allocations);
+    free(keys);
+}
+
+static void bench_inheritance() {
+    const size_t lookups = 2000000;
+    // Error -> LookupError -> KeyError -> AttributeError
+    pvm vm;
+    object* error = vm.newobject();
+    object* lookup_error = vm.newobject(vm.cons(error, nil));
+    object* key_error = vm.newobject(vm.cons(lookup_error, nil));
+    object* attribute_error = vm.newobject(vm.cons(key_error, nil));
+    vm.globals = attribute_error;
+    object* keys[64];
+    char name[16];
+    for (size_t i = 0; i < 64; i++) {
+        snprintf(name, sizeof(name), "attr_%zu", i);
+        keys[i] = vm.sym(name);
+        vm.set_property(error, keys[i], error);
+    }
+    size_t allocations = vm.allocations;
+    double start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < lookups; i++) found += vm.get_property(attribute_error, keys[i & 63], true) != nil;
+    report("inherited get_property() 4 levels deep", (double)found, now() - start, vm.allocations - allocations);
+    printf("  lookup cache hit rate %.4f\n", vm.lookup_cache_hit_rate());
+}
+
+// mixed-type keys, so assoc() goes through eqcmp()'s type dispatch rather than its identity fast path
+static void bench_assoc(size_t num_keys) {
+    const size_t lookups = 2000000;
+    pvm vm;
+    object** keys = (object**)malloc(num_keys * sizeof(object*));
+    object* list = nil;
+    uint64_t seed = 5;
+    char text[32];
+    uint32_t limbs[3];
+    for (size_t i = 0; i < num_keys; i++) {
+        uint64_t r = splitmix(&seed);
+        snprintf(text, sizeof(text), "key_%zu", i);
+        switch (i % 5) {
+            case 0: keys[i] = vm.integer((int64_t)(r >> 1)); break;
+            case 1: limbs[0] = (uint32_t)r, limbs[1] = (uint32_t)(r >> 32), limbs[2] = (uint32_t)i + 1, keys[i] = vm.bigint(limbs, 3, r & 1); break;
+            case 2: keys[i] = vm.number((double)r / 3); break;
+            case 3: keys[i] = vm.string(text); break;
+            case 4: keys[i] = vm.sym(text); break;
+        }
+        list = vm.cons(vm.cons(keys[i], nil), list);
+    }
+    vm.globals = list;
+    size_t allocations = vm.allocations;
+    double start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < lookups / num_keys; i++) {
+        for (size_t j = 0; j < num_keys; j++) found += pickle::assoc(list, keys[splitmix(&seed) % num_keys]) != NULL;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "assoc(), %zu mixed keys", num_keys);
+    report(name, (double)found, now() - start, vm.allocations - allocations);
+    free(keys);
+}
+
+// ------------------------- bigints -------------------------
+
+static void bench_bigint(size_t bits) {
+    pvm vm;
+    // about 3.32 bits per decimal digit
+    size_t ndigits = bits * 1000 / 3322 + 1;
+    char* digits = (char*)malloc(ndigits + 1);
+    uint64_t seed = bits;
+    for (size_t i = 0; i < ndigits; i++) digits[i] = '1' + splitmix(&seed) % 9;
+    digits[ndigits] = 0;
+    size_t n = bits <= 1024 ? 200000 : 20;
+    char name[64];
+    size_t allocations = vm.allocations;
+    double start = now();
+    object* a = nil;
+    for (size_t i = 0; i < n; i++) a = vm.parse_integer(digits, ndigits);
+    snprintf(name, sizeof(name), "parse_integer() %zu bits", bits);
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+    digits[0] = '9';
+    object* b = vm.parse_integer(digits, ndigits);
+    vm.globals = vm.cons(a, b);
+    allocations = vm.allocations;
+    start = now();
+    for (size_t i = 0; i < n; i++) vm.int_add(a, b);
+    snprintf(name, sizeof(name), "int_add() %zu bits", bits);
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+    allocations = vm.allocations;
+    start = now();
+    for (size_t i = 0; i < n; i++) vm.int_mul(a, b);
+    snprintf(name, sizeof(name), "int_mul() %zu bits", bits);
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+    allocations = vm.allocations;
+    start = now();
+    for (size_t i = 0; i < n; i++) free(vm.int_to_string(a));
+    snprintf(name, sizeof(name), "int_to_string() %zu bits", bits);
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+    free(digits);
+}
+
+static void bench_int_fast_path() {
+    const size_t n = 10000000;
+    pvm vm;
+    object* one = vm.integer(1);
+    size_t sum = 0;
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t i = 0; i < n; i++) sum += vm.int_add(vm.integer(i & 511), one) != nil;
+    report("int_add() of small ints", (double)sum, now() - start, vm.allocations - allocations);
+}
+
+// ------------------------- pattern matching -------------------------
+
+static object* list_of(pvm* vm, std::initializer_list<object*> items) {
+    object* list = nil;
+    for (const object* const* i = items.end(); i != items.begin();) vm->push((object*)*--i, list);
+    return list;
+}
+
+static object* numbered(pvm* vm, const char* prefix, size_t i) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s%zu", prefix, i);
+    return vm->sym(name);
+}
+
+// The shapes of pattern a prelude is made of, each with its own keyword or operator: a keyword and a typed
+// capture, a keyword with an optional word and two captures, an operator between two type tests (which all
+// share the type test edge), and an alternation of two keywords (indexed by both). Statements match a random
+// one of them, or (one in ten) none, so trying every pattern would be linear in the number of patterns.
+static void bench_patterns(size_t num_patterns) {
+    const size_t num_statements = 100000;
+    pvm vm;
+    #define L(...) list_of(&vm, {__VA_ARGS__})
+    #define S(name) vm.sym(name)
+    object* source = nil;
+    for (size_t i = 0; i < num_patterns; i++) {
+        object* kw = numbered(&vm, "kw", i);
+        object* elements;
+        switch (i % 4) {
+            case 0: elements = L(kw, L(S("capture"), S("x"), L(S("is"), S("int")))); break;
+            case 1: elements = L(kw, L(S("repeat"), vm.integer(0), vm.integer(1), S("the")), L(S("capture"), S("x"), L(S("any"))), S("to"), L(S("capture"), S("y"), L(S("any")))); break;
+            case 2: elements = L(L(S("capture"), S("a"), L(S("is"), S("int"))), kw, L(S("capture"), S("b"), L(S("is"), S("int")))); break;
+            default: elements = L(L(S("alt"), L(kw), L(numbered(&vm, "alias", i))), L(S("capture"), S("rest"), L(S("repeat"), vm.integer(1), nil, L(S("any"))))); break;
+        }
+        vm.push(elements, source);
+    }
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (object* e = source; e; e = cdr(e)) vm.define_pattern(car(e), S("handler"));
+    char name[64];
+    snprintf(name, sizeof(name), "define_pattern(), %zu patterns", num_patterns);
+    report(name, (double)num_patterns, now() - start, vm.allocations - allocations);
+    uint64_t seed = 11;
+    object* statements = nil;
+    for (size_t i = 0; i < num_statements; i++) {
+        size_t j = splitmix(&seed) % num_patterns;
+        object* kw = numbered(&vm, "kw", j);
+        object* statement;
+        if (i % 10 == 9) statement = L(S("nothing"), S(" "), S("to"), S(" "), S("see"), vm.integer(1), S("here"));
+        else switch (j % 4) {
+            case 0: statement = L(kw, S(" "), vm.integer(42)); break;
+            case 1: statement = L(kw, S(" "), S("the"), S(" "), S("a"), S(" "), S("to"), S(" "), S("b")); break;
+            case 2: statement = L(vm.integer(1), S(" "), kw, S(" "), vm.integer(2)); break;
+            default: statement = L(numbered(&vm, "alias", j), S(" "), S("x"), S(" "), S("y")); break;
+        }
+        vm.push(statement, statements);
+    }
+    vm.globals = statements;
+    allocations = vm.allocations;
+    start = now();
+    size_t found = 0;
+    pickle::pattern_match m;
+    for (object* s = statements; s; s = cdr(s)) found += pickle::get_best_match(&vm, car(s), &m) != nil;
+    double secs = now() - start;
+    snprintf(name, sizeof(name), "get_best_match(), %zu patterns", num_patterns);
+    report(name, (double)num_statements, secs, vm.allocations - allocations);
+    printf("  %zu of %zu statements matched\n", found, num_statements);
+    #undef L
+    #undef S
+}
+
+// (a+)+b on statements of len as and no b, which backtracking takes exponential time to give up on
+// without the packrat cache
+static void bench_backtracking(size_t len) {
+    const size_t num_statements = 1000000 / len;
+    pvm vm;
+    #define L(...) list_of(&vm, {__VA_ARGS__})
+    #define S(name) vm.sym(name)
+    vm.define_pattern(L(L(S("repeat"), vm.integer(1), nil, L(S("repeat"), vm.integer(1), nil, S("a"))), S("b")), S("handler"));
+    object* statements = nil;
+    for (size_t i = 0; i < num_statements; i++) {
+        object* statement = nil;
+        for (size_t j = 0; j < len; j++) vm.push(S("a"), statement);
+        vm.push(statement, statements);
+    }
+    vm.globals = statements;
+    size_t allocations = vm.allocations;
+    double start = now();
+    pickle::pattern_match m;
+    for (object* s = statements; s; s = cdr(s)) pickle::get_best_match(&vm, car(s), &m);
+    double secs = now() - start;
+    char name[64];
+    snprintf(name, sizeof(name), "get_best_match(), (a+)+b on %zu as", len);
+    report(name, (double)num_statements, secs, vm.allocations - allocations);
+    printf("  %.1f matcher steps per token\n", (double)vm.match_steps / (num_statements * len));
+    #undef L
+    #undef S
+}
+
+// ------------------------- dumping -------------------------
+
+// a list of n small ints (every 1000th one shared with the previous element, so there are labels
+// to look up), or n conses nested in their cars
+static void bench_dump(size_t n, bool deep) {
+    pvm vm;
+    object* list = nil;
+    for (size_t i = 0; i < n; i++) {
+        if (deep) list = vm.cons(list, nil);
+        else if (i % 1000 == 1) list = vm.cons(car(list), list);
+        else list = vm.cons(vm.integer(i & 1023), list);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "dump() %zu %s, memory", n, deep ? "deep" : "long");
+    pickle::sink out;
+    size_t allocations = vm.allocations;
+    double start = now();
+    vm.dump(list, &out);
+    double elapsed = now() - start;
+    report(name, (double)n, elapsed, vm.allocations - allocations);
+    printf("  %zu bytes\n", out.size());
+    int fd = open("/dev/null", O_WRONLY);
+    snprintf(name, sizeof(name), "dump() %zu %s, fd", n, deep ? "deep" : "long");
+    allocations = vm.allocations;
+    start = now();
+    {
+        pickle::sink to_fd(fd);
+        vm.dump(list, &to_fd);
+    }
+    report(name, (double)n, now() - start, vm.allocations - allocations);
+    close(fd);
+}
+
+// ------------------------- heap images -------------------------
+
+// keeps what tokenize() left on the data stack
+static object* keep(pvm* vm, object* cookie, object* inst_type) {
+    vm->push(vm->pop(), vm->globals);
+    return nil;
+}
+
+static void define_ops(pvm* vm) {
+    vm->defop("nop", nop);
+    vm->defop("keep", keep);
+    vm->defop("tokenize", pickle::parser::tokenize);
+}
+
+// What starting up has to do without an image: tokenize the prelude's source and make an object
+// for every definition, with its name and its body (every 8 tokens are one definition).
+static void load_prelude(pvm* vm, const char* src) {
+    vm->start_thread();
+    vm->push_inst("keep");
+    vm->push_inst("tokenize");
+    vm->push_data(vm->string(src));
+    vm->run();
+    object* tokens = car(vm->globals);
+    object* defs = vm->newobject();
+    object* definition = vm->newobject();
+    object* body_key = vm->sym("body");
+    object* name_key = vm->sym("__name__");
+    char name[32];
+    for (size_t i = 0; tokens; i++) {
+        object* def = vm->newobject(vm->cons(definition, nil));
+        snprintf(name, sizeof(name), "def_%zu", i);
+        object* sym = vm->sym(name);
+        vm->set_property(def, name_key, sym);
+        object* body = nil;
+        for (int j = 0; j < 8 && tokens; j++, tokens = cdr(tokens)) vm->push(car(tokens), body);
+        vm->set_property(def, body_key, body);
+        vm->set_property(defs, sym, def);
+    }
+    vm->globals = defs;
+}
+
+static void bench_image(size_t source_bytes) {
+    char path[] = "/tmp/pickle_benchXXXXXX";
+    close(mkstemp(path));
+    char* src = make_source(source_bytes);
+    const int reps = 5;
+    double cold = 1e9, warm = 1e9;
+    size_t objects = 0, image_bytes = 0;
+    for (int i = 0; i < reps; i++) {
+        double start = now();
+        {
+            pvm vm;
+            define_ops(&vm);
+            load_prelude(&vm, src);
+            double elapsed = now() - start;
+            if (elapsed < cold) cold = elapsed;
+            vm.gc();
+            objects = vm.live_objects;
+            if (i == 0) vm.save_image(path);
+        }
+        start = now();
+        {
+            pvm vm;
+            define_ops(&vm);
+            if (!vm.load_image(path)) {
+                printf("load_image() failed\n");
+                break;
+            }
+            double elapsed = now() - start;
+            if (elapsed < warm) warm = elapsed;
+        }
+    }
+    struct stat st;
+    if (stat(path, &st) == 0) image_bytes = st.st_size;
+    metric("start up from the prelude's source", cold * 1e3, "ms");
+    metric("start up from a heap image", warm * 1e3, "ms");
+    metric("  heap image speedup", cold / warm, "x");
+    printf("  %zu live objects, %zu byte image\n", objects, image_bytes);
+    unlink(path);
+    free(src);
+}
+
+// ------------------------- allocation -------------------------
+
+static void bench_cons(size_t n) {
+    pvm vm;
+    object* list = nil;
+    size_t allocations = vm.allocations;
+    double start = now();
+    for (size_t i = 0; i < n; i++) list = vm.cons(nil, list);
+    report("cons() onto a growing heap", (double)n, now() - start, vm.allocations - allocations);
+    // the same again once those are garbage, so the cells come from the free list
+    list = nil;
+    vm.gc();
+    allocations = vm.allocations;
+    start = now();
+    for (size_t i = 0; i < n; i++) list = vm.cons(nil, list);
+    report("cons() reusing swept cells", (double)n, now() - start, vm.allocations - allocations);
+}
+
+// Usage: picklebench [--filter TEXT] [--json FILE] [--baseline FILE] [--threshold PERCENT]
+// --filter runs only the groups with TEXT in their name, --json writes all of the results to FILE, and
+// --baseline compares them with a file --json wrote before, exiting with 1 if any of them got worse by
+// more than the threshold (10% by default), worst cases (p99 and max) aside.
+static const char* filter = NULL;
+
+static bool group(const char* name) {
+    if (filter && !strstr(name, filter)) return false;
+    printf("\n== %s ==\n", name);
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const char* json = NULL;
+    const char* baseline = NULL;
+    double threshold = 10;
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 < argc && !strcmp(argv[i], "--filter")) filter = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--json")) json = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--baseline")) baseline = argv[++i];
+        else if (i + 1 < argc && !strcmp(argv[i], "--threshold")) threshold = atof(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--filter TEXT] [--json FILE] [--baseline FILE] [--threshold PERCENT]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (group("allocation")) {
+        bench_cons(1000000);
+    }
+    if (group("dispatch")) {
+        bench_dispatch(10);
+        bench_dispatch(100);
+        bench_dispatch(1000);
+        bench_run();
+        bench_run_for(10000);
+        bench_run_for(1000000);
+    }
+    if (group("profiler")) {
+        double off = bench_profile(0);
+        metric("profiler overhead at 1 kHz", (bench_profile(1) / off - 1) * 100, "%");
+        bench_profile(2);
+    }
+    if (group("threads")) {
+        bench_stacks();
+        bench_threads(1);
+        bench_threads(16);
+        bench_parked(0);
+        bench_parked(100000);
+    }
+    if (group("gc")) {
+        bench_gc(0);
+        bench_gc(1);
+        bench_gc(2);
+        bench_gc(3);
+        bench_incremental_gc(STOP_THE_WORLD);
+        bench_incremental_gc(INCREMENTAL);
+        bench_incremental_gc(GENERATIONAL);
+        for (size_t prefetch = 0; prefetch <= 8; prefetch = prefetch ? prefetch * 2 : 2) bench_mark(true, prefetch);
+        bench_mark(false, 0);
+        bench_mark(false, 8);
+        // the same heaps marked and swept by gc_threads threads
+        for (size_t threads = 2; threads <= 8; threads *= 2) bench_mark(true, 8, threads);
+        for (size_t threads = 2; threads <= 8; threads *= 2) bench_mark(false, 8, threads);
+    }
+    if (group("payloads")) {
+        bench_payloads(false);
+        bench_payloads(true);
+    }
+    if (group("interning")) {
+        bench_intern(100);
+        bench_intern(10000);
+        bench_intern(100000);
+    }
+    if (group("strings")) {
+        bench_append(20000, false);
+        bench_append(20000, true);
+        bench_append(1000000, true);
+    }
+    if (group("tokenize")) {
+        // the same source both ways, small enough that the old tokenizer's sscanf() doesn't take minutes
+        double old = bench_tokenize(250000, true);
+        metric("  speedup over the old tokenizer", bench_tokenize(250000, false) / old, "x");
+        bench_tokenize(4000000, false);
+        bench_tokenize_stream(4000000, false);
+        bench_tokenize_stream(4000000, true);
+    }
+    if (group("integers")) {
+        bench_int_fast_path();
+        bench_bigint(64);
+        bench_bigint(1024);
+        bench_bigint(100000);
+    }
+    if (group("properties")) {
+        bench_properties(10);
+        bench_properties(1000);
+        bench_properties(100000);
+        bench_inheritance();
+        bench_assoc(10);
+        bench_assoc(100);
+    }
+    if (group("patterns")) {
+        bench_patterns(1000);
+        bench_patterns(10000);
+        bench_patterns(100000);
+        bench_backtracking(100);
+        bench_backtracking(1000);
+    }
+    if (group("dump")) {
+        bench_dump(1000000, false);
+        bench_dump(100000, true);
+    }
+    if (group("image")) {
+        bench_image(200000);
+    }
+    if (json && !write_json(json)) {
+        fprintf(stderr, "can't write %s\n", json);
+        return 2;
+    }
+    if (baseline && compare_with(baseline, threshold)) return 1;
+    return 0;
+}
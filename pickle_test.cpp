@@ -1,7 +1,13 @@
 #define TINOBSY_DEBUG
 
 #include "pickle.hpp"
+#include <string>
+#include <algorithm>
+#include <initializer_list>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define CHECK(cond) do { \
     if (!(cond)) { \
@@ -28,6 +34,132 @@ object* test_test(pvm* vm, object* cookie, object* inst_type) {
     return vm->sym(d ? "debug" : "error");
 }
 
+// the thread is gone once it runs out of instructions, so this moves its data stack somewhere the test can see it
+object* results = NULL;
+object* collect(pvm* vm, object* cookie, object* inst_type) {
+    for (object* d = vm->pop(); d; d = vm->pop()) vm->push(d, results);
+    return nil;
+}
+
+// records the order instructions ran in
+object* record(pvm* vm, object* cookie, object* inst_type) {
+    vm->push(cookie, results);
+    return nil;
+}
+
+// waits until the test unparks it
+object* parked_thread = NULL;
+object* park(pvm* vm, object* cookie, object* inst_type) {
+    parked_thread = vm->park_thread();
+    return nil;
+}
+
+static size_t count(object* list) {
+    size_t n = 0;
+    for (; list; list = cdr(list)) n++;
+    return n;
+}
+
+// makes garbage, n times
+object* churn(pvm* vm, object* cookie, object* inst_type) {
+    object* list = nil;
+    for (int i = 0; i < 10; i++) vm->push(vm->integer(i), list);
+    int64_t n = vm->intof(cookie);
+    if (n) vm->push_inst("churn", nil, vm->integer(n - 1));
+    return nil;
+}
+
+// runs forever
+object* spin(pvm* vm, object* cookie, object* inst_type) {
+    vm->push_inst("spin");
+    return nil;
+}
+
+object* fail(pvm* vm, object* cookie, object* inst_type) {
+    return vm->sym("error");
+}
+
+// a user type of boxed numbers, where boxes with the same number are equal
+static int compare_boxes(object* a, object* b) {
+    return (a->as_big_int > b->as_big_int) - (a->as_big_int < b->as_big_int);
+}
+static bool equal_boxes(object* a, object* b) {
+    return a->as_big_int == b->as_big_int;
+}
+static uint64_t hash_box(pvm* vm, object* o) {
+    return vm->hash_int(o->as_big_int);
+}
+const pickle::value_type box_type("box", NULL, NULL, NULL, pickle::RANK_IDENTITY + 1, compare_boxes, equal_boxes, hash_box);
+
+static int sign(int x) {
+    return (x > 0) - (x < 0);
+}
+
+static object* list_of(pvm* vm, std::initializer_list<object*> items) {
+    object* list = nil;
+    for (const object* const* i = items.end(); i != items.begin();) vm->push((object*)*--i, list);
+    return list;
+}
+
+// pattern handlers for the eval test, which replace the matched tokens with the result
+object* add_handler(pvm* vm, object* cookie, object* inst_type) {
+    object* bindings = vm->pop();
+    vm->push_data(vm->int_add(cdr(pickle::assoc(bindings, vm->sym("a"))), cdr(pickle::assoc(bindings, vm->sym("b")))));
+    return nil;
+}
+object* mul_handler(pvm* vm, object* cookie, object* inst_type) {
+    object* bindings = vm->pop();
+    vm->push_data(vm->int_mul(cdr(pickle::assoc(bindings, vm->sym("a"))), cdr(pickle::assoc(bindings, vm->sym("b")))));
+    return nil;
+}
+
+// a (matches) predicate
+object* is_even(pvm* vm, object* token, object* inst_type) {
+    return token && token->type == &pickle::integer_type && !(vm->intof(token) & 1) ? token : nil;
+}
+
+// a pattern handler that leaves nothing in place of the match
+object* drop_handler(pvm* vm, object* cookie, object* inst_type) {
+    vm->pop();
+    vm->push_data(nil);
+    return nil;
+}
+
+// patterns that backtracking alone takes exponential time to fail with, on a run of as; *last is what ends a match
+#define PATHOLOGICAL 7
+static object* pathological(pvm* vm, int which, object** last) {
+    object* a = vm->sym("a");
+    object* zero = vm->integer(0);
+    object* one = vm->integer(1);
+    object* repeat = vm->sym("repeat");
+    object* alt = vm->sym("alt");
+    *last = vm->sym(which == 2 ? "c" : "b");
+    object* body;
+    switch (which) {
+        // (a+)+
+        case 0: body = list_of(vm, {repeat, one, nil, list_of(vm, {repeat, one, nil, a})}); break;
+        // (a|a)*
+        case 1: body = list_of(vm, {repeat, zero, nil, list_of(vm, {alt, list_of(vm, {a}), list_of(vm, {a})})}); break;
+        // (a|aa)*
+        case 2: body = list_of(vm, {repeat, zero, nil, list_of(vm, {alt, list_of(vm, {a}), list_of(vm, {a, a})})}); break;
+        // (a*)*, whose inner repetition can match nothing
+        case 3: body = list_of(vm, {repeat, zero, nil, list_of(vm, {repeat, zero, nil, a})}); break;
+        // (a+?)+?
+        case 4: body = list_of(vm, {vm->sym("lazy"), one, nil, list_of(vm, {vm->sym("lazy"), one, nil, a})}); break;
+        // (x: a+ a*)+
+        case 5: body = list_of(vm, {repeat, one, nil, list_of(vm, {vm->sym("capture"), vm->sym("x"), list_of(vm, {repeat, one, nil, a}), list_of(vm, {repeat, zero, nil, a})})}); break;
+        // (.+){2,5}
+        default: body = list_of(vm, {repeat, vm->integer(2), vm->integer(5), list_of(vm, {repeat, one, nil, list_of(vm, {vm->sym("any")})})}); break;
+    }
+    return list_of(vm, {body, *last});
+}
+
+// n tokens in front of the list
+static object* run_of(pvm* vm, object* token, size_t n, object* list) {
+    for (size_t i = 0; i < n; i++) vm->push(token, list);
+    return list;
+}
+
 const char* test = R"=(
 
 [(+ 1 2)
@@ -79,11 +211,53 @@ int main() {
     }
     SEPARATOR;
 
+    printf("streaming tokenizer test\n");
+    vm.defop("tokenize_stream", pickle::parser::tokenize_stream);
+    vm.defop("collect", collect);
+    FILE* f = tmpfile();
+    fputs(test, f);
+    fflush(f);
+    rewind(f);
+    vm.start_thread();
+    vm.push_inst("collect");
+    vm.push_inst("tokenize_stream");
+    // tiny chunks so that lots of tokens straddle chunk boundaries
+    vm.push_data(pickle::parser::open_stream(&vm, fileno(f), 5));
+    vm.start_thread();
+    vm.push_inst("collect");
+    vm.push_inst("tokenize");
+    vm.push_data(vm.string(test));
+    size_t steps = 0;
+    while (vm.queue) vm.step(), steps++;
+    fclose(f);
+    printf("took %zu steps\n", steps);
+    CHECK(steps > 2);
+    // the streaming thread finishes last
+    object* streamed = car(results);
+    object* whole = cadr(results);
+    results = nil;
+    CHECK(streamed && whole);
+    for (; streamed && whole; streamed = cdr(streamed), whole = cdr(whole)) if (car(streamed) != car(whole)) break;
+    CHECK(streamed == nil && whole == nil);
+    // reading a directory fails with EISDIR, which isn't the end of the file
+    int dir = open(".", O_RDONLY);
+    vm.start_thread();
+    vm.push_inst("collect");
+    vm.push_inst("tokenize_stream");
+    vm.push_data(pickle::parser::open_stream(&vm, dir, 5));
+    CHECK(vm.run() == pickle::RUN_ERROR);
+    close(dir);
+    CHECK(car(vm.failed_thread) == vm.sym("error") && results == nil);
+    object* condition = car(vm.data_stack(vm.failed_thread));
+    CHECK(vm.stringof(car(condition)) == std::string("read failed in tokenize_stream()"));
+    CHECK(cadr(condition) == vm.integer(EISDIR));
+    SEPARATOR;
+
     printf("hashmap test\n");
     auto foo = vm.newobject();
     for (size_t i = 0; i < 10; i++) {
         printf("Insert %zu\n", i);
-        vm.set_property(foo, vm.integer(i), i, foo);
+        vm.set_property(foo, vm.integer(i), foo);
         printf("Dump of object: ");
         vm.dump(foo);
         putchar('\n');
@@ -91,7 +265,7 @@ int main() {
     putchar('\n');
     for (size_t i = 0; i < 10; i += 2) {
         printf("Remove %zu\n", i);
-        vm.remove_property(foo, i);
+        vm.remove_property(foo, vm.integer(i));
         printf("Dump of object: ");
         vm.dump(foo);
         putchar('\n');
@@ -99,13 +273,13 @@ int main() {
     putchar('\n');
     for (size_t i = 0; i < 10; i += 2) {
         printf("Insert %zu\n", i);
-        vm.set_property(foo, vm.integer(i), i, vm.integer(i));
+        vm.set_property(foo, vm.integer(i), vm.integer(i));
         printf("Dump of object: ");
         vm.dump(foo);
         putchar('\n');
     }
     putchar('\n');
-    auto hash0 = vm.get_property(foo, 0);
+    auto hash0 = vm.get_property(foo, vm.integer(0));
     printf("Get hash 0: ");
     CHECK(hash0 != nil);
     vm.dump(hash0);
@@ -115,8 +289,1007 @@ int main() {
     auto bar = vm.newobject(vm.cons(foo, nil));
     vm.dump(bar);
     printf("\nGet property 0 with inheritance and without\n");
-    CHECK(vm.get_property(bar, 0, false) == nil);
-    CHECK(vm.get_property(bar, 0, true) != nil);
+    CHECK(vm.get_property(bar, vm.integer(0), false) == nil);
+    CHECK(vm.get_property(bar, vm.integer(0), true) != nil);
+    printf("\nChange inherited property after it was cached\n");
+    vm.set_property(foo, vm.integer(0), vm.integer(50));
+    CHECK(vm.intof(vm.get_property(bar, vm.integer(0), true)) == 50);
+    vm.remove_property(foo, vm.integer(0));
+    CHECK(vm.get_property(bar, vm.integer(0), true) == nil);
+    vm.set_property(foo, vm.integer(0), vm.integer(0));
+    CHECK(vm.get_property(bar, vm.integer(0), true) == vm.get_property(bar, vm.integer(0), true));
+    CHECK(vm.lookup_cache_hits > 0);
+    printf("\nReparent an object after a cached lookup\n");
+    auto other = vm.newobject();
+    vm.set_property(other, vm.integer(0), vm.integer(7));
+    auto child = vm.newobject(vm.cons(bar, nil));
+    CHECK(vm.intof(vm.get_property(child, vm.integer(0), true)) == 0);
+    CHECK(vm.get_property(child, vm.sym("late"), true) == nil);
+    vm.set_prototypes(bar, vm.cons(other, nil));
+    CHECK(vm.intof(vm.get_property(child, vm.integer(0), true)) == 7);
+    vm.set_prototypes(child, nil);
+    CHECK(vm.get_property(child, vm.integer(0), true) == nil);
+    vm.set_property(other, vm.sym("late"), vm.integer(1));
+    vm.set_prototypes(child, vm.cons(other, nil));
+    CHECK(vm.intof(vm.get_property(child, vm.sym("late"), true)) == 1);
+    vm.set_prototypes(bar, vm.cons(foo, nil));
+    printf("\nClone object and change the clone\n");
+    auto baz = vm.clone_object(foo);
+    vm.set_property(baz, vm.integer(0), vm.integer(100));
+    vm.remove_property(baz, vm.integer(2));
+    vm.set_property(baz, vm.integer(10), vm.integer(10));
+    vm.dump(baz);
+    putchar('\n');
+    CHECK(vm.intof(vm.get_property(foo, vm.integer(0))) == 0);
+    CHECK(vm.intof(vm.get_property(baz, vm.integer(0))) == 100);
+    CHECK(vm.get_property(foo, vm.integer(2)) != nil);
+    CHECK(vm.get_property(baz, vm.integer(2)) == nil);
+    CHECK(vm.get_property(foo, vm.integer(10)) == nil);
+    CHECK(vm.get_property(baz, vm.integer(10)) != nil);
+    printf("\nDifferent keys with the same hash\n");
+    auto qux = vm.newobject();
+    for (size_t i = 0; i < 5; i++) pickle::hashmap::set(&vm, &cdr(qux), vm.integer(i), 12345, vm.integer(i));
+    pickle::hashmap::set(&vm, &cdr(qux), vm.integer(5), 12345 + 32, vm.integer(5));
+    vm.dump(qux);
+    putchar('\n');
+    CHECK(pickle::hashmap::get(cdr(qux), vm.integer(3), 12345)->value == vm.integer(3));
+    CHECK(pickle::hashmap::get(cdr(qux), vm.integer(5), 12345) == NULL);
+    CHECK(pickle::hashmap::remove(&vm, &cdr(qux), vm.integer(3), 12345));
+    CHECK(pickle::hashmap::get(cdr(qux), vm.integer(3), 12345) == NULL);
+    CHECK(pickle::hashmap::get(cdr(qux), vm.integer(4), 12345)->value == vm.integer(4));
+    CHECK(pickle::hashmap::get(cdr(qux), vm.integer(5), 12345 + 32)->value == vm.integer(5));
+    printf("\nEvery vm has its own random hash key, which doesn't come from rand()\n");
+    {
+        srand(1);
+        int first = rand();
+        srand(1);
+        pvm other;
+        CHECK(rand() == first);
+        CHECK(other.hash(other.string("some key")) != vm.hash(vm.string("some key")));
+    }
+    SEPARATOR;
+
+    printf("intern test\n");
+    CHECK(vm.sym("foo") == vm.sym("foo"));
+    CHECK(vm.string("foo") != vm.sym("foo"));
+    CHECK(vm.number(1.5) != vm.number(1.7));
+    CHECK(vm.integer(-7) == vm.integer(-7));
+    CHECK(vm.integer(1000000) == vm.integer(1000000));
+    CHECK(vm.intof(vm.integer(SMALL_INT_MIN)) == SMALL_INT_MIN);
+    CHECK(vm.intof(vm.integer(SMALL_INT_MAX + 1)) == SMALL_INT_MAX + 1);
+    for (size_t i = 0; i < 1000; i++) vm.integer(i * 1000);
+    vm.gc();
+    CHECK(vm.intof(vm.integer(3)) == 3);
+    vm.gc();
+    CHECK(vm.integer(999000) == vm.integer(999000));
+    CHECK(vm.intof(vm.integer(999000)) == 999000);
+    SEPARATOR;
+
+    printf("bigint test\n");
+    object* int_max = vm.integer(INT64_MAX);
+    object* big = vm.int_add(int_max, vm.integer(1));
+    CHECK(big->type == &pickle::bigint_type);
+    CHECK(big == vm.parse_integer("9223372036854775808", 19));
+    CHECK(vm.int_sub(big, vm.integer(1)) == int_max);
+    CHECK(vm.int_neg(big) == vm.integer(INT64_MIN));
+    CHECK(vm.int_mul(vm.integer(0), big) == vm.integer(0));
+    object* neg_big = vm.int_neg(vm.int_mul(big, big));
+    CHECK(vm.int_sub(neg_big, neg_big) == vm.integer(0));
+    CHECK(vm.int_add(neg_big, vm.int_neg(neg_big)) == vm.integer(0));
+    CHECK(vm.int_add(vm.int_sub(neg_big, neg_big), vm.integer(1)) == vm.integer(1));
+    // (10^600 - 1)^2 = 999...998000...001, big enough to go through Karatsuba
+    std::string nines(600, '9');
+    object* n = vm.parse_integer(nines.c_str(), nines.size());
+    char* square = vm.int_to_string(vm.int_mul(n, n));
+    CHECK(square == std::string(599, '9') + "8" + std::string(599, '0') + "1");
+    free(square);
+    vm.start_thread();
+    vm.push_inst("collect");
+    vm.push_inst("tokenize");
+    vm.push_data(vm.string("123456789012345678901234567890 0x10000000000000000"));
+    while (vm.queue) vm.step();
+    object* tokens = car(results);
+    results = nil;
+    vm.dump(tokens);
+    putchar('\n');
+    CHECK(car(tokens) == vm.parse_integer("123456789012345678901234567890", 30));
+    CHECK(car(cddr(tokens)) == vm.parse_integer("10000000000000000", 17, 16));
+    // bytes >= 0x80 (negative chars) right after 0x and after hex digits
+    vm.start_thread();
+    vm.push_inst("collect");
+    vm.push_inst("tokenize");
+    vm.push_data(vm.string("0x1f\xc3\xa9 0x\xff"));
+    while (vm.queue) vm.step();
+    tokens = car(results);
+    results = nil;
+    vm.dump(tokens);
+    putchar('\n');
+    CHECK(car(tokens) == vm.integer(31));
+    SEPARATOR;
+
+    printf("scheduler test\n");
+    vm.defop("record", record);
+    vm.defop("park", park);
+    vm.quantum = 2;
+    // two instructions per turn, and a parks itself after a2 until it is unparked below
+    for (const char* name = "ab"; *name; name++) {
+        vm.start_thread();
+        for (int i = 3; i >= 0; i--) {
+            char tag[3] = { *name, (char)('0' + i), 0 };
+            vm.push_inst("record", nil, vm.sym(tag));
+            if (*name == 'a' && i == 3) vm.push_inst("park");
+        }
+    }
+    // b was started last, so it is current and goes first
+    vm.push_inst("record", nil, vm.sym("b_"));
+    while (vm.queue) vm.step();
+    CHECK(vm.num_parked == 1);
+    CHECK(vm.unpark_thread(parked_thread));
+    CHECK(!vm.unpark_thread(parked_thread));
+    // the parked thread has to survive a gc while it's out of the queue
+    vm.globals = results;
+    vm.gc();
+    while (vm.queue) vm.step();
+    vm.globals = nil;
+    std::string order;
+    for (object* r = results; r; r = cdr(r)) order = std::string(vm.stringof(car(r))) + " " + order;
+    results = nil;
+    printf("ran %s\n", order.c_str());
+    CHECK(order == "b_ b0 a0 a1 b1 b2 a2 b3 a3 ");
+    vm.quantum = 1;
+    SEPARATOR;
+
+    printf("run loop test\n");
+    vm.defop("spin", spin);
+    vm.defop("fail", fail);
+    vm.start_thread();
+    for (int i = 0; i < 5; i++) vm.push_inst("record");
+    CHECK(vm.run(3) == pickle::RUN_OUT_OF_FUEL);
+    CHECK(count(results) == 3);
+    CHECK(vm.run() == pickle::RUN_IDLE);
+    CHECK(count(results) == 5);
+    results = nil;
+    vm.start_thread();
+    vm.push_inst("record");
+    vm.push_inst("fail");
+    CHECK(vm.run() == pickle::RUN_ERROR);
+    CHECK(car(vm.failed_thread) == vm.sym("error"));
+    CHECK(results == nil);
+    vm.start_thread();
+    vm.push_inst("spin");
+    CHECK(vm.run_for(1000000) == pickle::RUN_DEADLINE);
+    // put it somewhere it won't be run again
+    CHECK(vm.park_thread() != nil);
+    CHECK(vm.queue == nil);
+    SEPARATOR;
+
+    printf("thread stack test\n");
+    vm.start_thread();
+    // only the stack holds these, small integers would be preboxed and survive anyway
+    std::string item_text[100];
+    for (int i = 0; i < 100; i++) {
+        item_text[i] = "item " + std::to_string(i);
+        object* s = vm.string(item_text[i].c_str());
+        object* b = vm.int_add(vm.integer(INT64_MAX), vm.integer(i + 1));
+        vm.push_data(i % 3 == 0 ? s : i % 3 == 1 ? b : vm.cons(s, b));
+    }
+    object* view = vm.data_stack(car(vm.queue));
+    CHECK(count(view) == 100 && vm.stringof(car(view)) == item_text[99]);
+    vm.push_inst("record", "error", vm.sym("cookie"));
+    view = vm.inst_stack(car(vm.queue));
+    CHECK(caar(view) == vm.sym("error") && cddar(view) == vm.sym("cookie"));
+    // the stacks are marked, not just the list views
+    view = nil;
+    vm.globals = nil;
+    vm.gc();
+    for (int i = 99; i >= 0; i--) {
+        object* x = vm.pop();
+        object* s = i % 3 == 1 ? NULL : i % 3 == 0 ? x : car(x);
+        object* b = i % 3 == 0 ? NULL : i % 3 == 1 ? x : cdr(x);
+        if (s && (s->type != &pickle::string_type || vm.stringof(s) != item_text[i])) CHECK(!"string lost");
+        if (b && (b->type != &pickle::bigint_type || vm.int_sub(b, vm.integer(INT64_MAX)) != vm.integer(i + 1))) CHECK(!"bigint lost");
+    }
+    size_t before = vm.allocations;
+    for (int i = 0; i < 1000; i++) vm.push_data(vm.integer(i & 255));
+    for (int i = 0; i < 1000; i++) vm.pop();
+    CHECK(vm.allocations == before);
+    CHECK(vm.pop() == nil);
+    CHECK(vm.park_thread() != nil);
+    SEPARATOR;
+
+    printf("gc scheduling test\n");
+    vm.defop("churn", churn);
+    vm.gc();
+    size_t live = vm.live_objects, collections = vm.gc_count;
+    vm.gc_min_budget = 1000;
+    vm.auto_gc = true;
+    vm.start_thread();
+    vm.push_inst("churn", nil, vm.integer(1000));
+    CHECK(vm.run() == pickle::RUN_IDLE);
+    vm.auto_gc = false;
+    printf("%zu collections, %zu live objects\n", vm.gc_count - collections, vm.live_objects);
+    // 10000 conses made, but never more than a budget's worth of them at once
+    CHECK(vm.gc_count - collections >= 5);
+    CHECK(vm.live_objects < live + 2 * vm.gc_min_budget);
+    CHECK(!vm.maybe_gc());
+    SEPARATOR;
+
+    printf("generational gc test\n");
+    {
+        pvm g;
+        g.defop("park", park);
+        g.defop("tokenize", pickle::parser::tokenize);
+        g.defop("tokenize_stream", pickle::parser::tokenize_stream);
+        object* old = nil;
+        char text[32];
+        for (int i = 0; i < 5000; i++) {
+            snprintf(text, sizeof(text), "old %d", i);
+            g.push(g.string(text), old);
+        }
+        object* props = g.newobject();
+        g.globals = g.cons(old, props);
+        g.gc();
+        size_t live = g.live_objects;
+        g.generational_gc = true;
+        g.gc_nursery = 1000;
+        g.gc_min_budget = 1000000;
+        for (int i = 0; i < 999; i++) g.cons(nil, nil);
+        CHECK(!g.maybe_gc());
+        g.cons(nil, nil);
+        // the first minor collection marks everything, and after that the old objects stay marked
+        CHECK(g.maybe_gc() && g.gc_minor_count == 1);
+        CHECK(g.live_objects == live);
+        // young objects stored into old ones survive, through the barrier
+        object* last = old;
+        while (cdr(last)) last = cdr(last);
+        cdr(last) = g.cons(g.string("young"), nil);
+        g.write_barrier(cdr(last));
+        g.set_property(props, g.sym("young"), g.string("property"));
+        // and so does a parked thread's stack, which isn't rescanned like the queue's are
+        g.start_thread();
+        for (int i = 0; i < 999; i++) g.cons(nil, nil);
+        g.maybe_gc();
+        g.push_data(g.string("parked"));
+        object* thread = g.park_thread();
+        for (int i = 0; i < 1000; i++) g.cons(nil, nil);
+        CHECK(g.maybe_gc() && g.gc_minor_count == 3);
+        CHECK(g.stringof(cadr(last)) == std::string("young") && count(old) == 5001);
+        CHECK(g.stringof(g.get_property(props, g.sym("young"))) == std::string("property"));
+        CHECK(g.stringof(car(g.data_stack(thread))) == std::string("parked"));
+        // the garbage in the nursery went, but old garbage waits for a collection of the whole heap
+        g.globals = g.cons(nil, props);
+        g.unpark_thread(thread);
+        g.park_thread();
+        for (int i = 0; i < 1000; i++) g.cons(nil, nil);
+        g.maybe_gc();
+        CHECK(g.gc_minor_count == 4 && g.live_objects > 5000);
+        g.gc_min_budget = 0;
+        g.gc_growth = 0;
+        for (int i = 0; i < 1000; i++) g.cons(nil, nil);
+        size_t collections = g.gc_count;
+        g.maybe_gc();
+        CHECK(g.gc_minor_count == 4 && g.gc_count == collections + 1);
+        // (5000 strings and the list of them)
+        CHECK(g.live_objects + 9900 < live);
+        CHECK(g.stringof(g.get_property(props, g.sym("young"))) == std::string("property"));
+        // the streaming tokenizer appends to a list it made before it yielded, which is old by then
+        std::string source;
+        for (int i = 0; i < 20; i++) source += test;
+        FILE* f = tmpfile();
+        fputs(source.c_str(), f);
+        fflush(f);
+        rewind(f);
+        g.gc_nursery = 50;
+        g.gc_min_budget = 1000000;
+        g.auto_gc = true;
+        g.start_thread();
+        g.push_inst("park");
+        g.push_inst("tokenize_stream");
+        g.push_data(pickle::parser::open_stream(&g, fileno(f), 64));
+        CHECK(g.run() == pickle::RUN_IDLE);
+        g.auto_gc = false;
+        fclose(f);
+        printf("%zu minor collections\n", g.gc_minor_count);
+        CHECK(g.gc_minor_count > 6);
+        object* streamed = car(g.data_stack(parked_thread));
+        g.start_thread();
+        g.push_inst("park");
+        g.push_inst("tokenize");
+        g.push_data(g.string(source.c_str()));
+        CHECK(g.run() == pickle::RUN_IDLE);
+        object* whole = car(g.data_stack(parked_thread));
+        CHECK(count(streamed) == count(whole));
+        for (; streamed && whole; streamed = cdr(streamed), whole = cdr(whole)) if (car(streamed) != car(whole)) break;
+        CHECK(streamed == nil && whole == nil);
+        parked_thread = nil;
+    }
+    SEPARATOR;
+
+    printf("incremental gc test\n");
+    {
+        // big enough that marking it takes many slices
+        object* big = nil;
+        for (int64_t i = 0; i < 20000; i++) vm.push(vm.integer(i), big);
+        object* props = vm.newobject();
+        vm.set_property(props, vm.sym("first"), vm.integer(1));
+        vm.globals = vm.cons(big, props);
+        vm.gc();
+        // slices of 64 objects: after 100 of them props and its hashmap are marked but the end of big isn't,
+        // so moving its last cell over to props needs the write barrier
+        vm.gc_min_budget = 0;
+        vm.gc_growth = 0;
+        vm.gc_slice_ns = 0;
+        vm.string("doomed");
+        for (int i = 0; i < 100; i++) vm.gc_step();
+        CHECK(vm.gc_marking);
+        object* before_last = big;
+        while (cddr(before_last)) before_last = cdr(before_last);
+        object* last = cdr(before_last);
+        cdr(before_last) = nil;
+        vm.set_property(props, vm.sym("moved"), last);
+        while (vm.gc_marking) vm.gc_step();
+        // the sweep is spread over slices too, and interning in the meantime mustn't find what it is about to free
+        CHECK(vm.gc_sweeping);
+        object* doomed = vm.string("doomed");
+        size_t collections = vm.gc_count, sweep_slices = 0;
+        while (vm.gc_sweeping) vm.gc_step(), sweep_slices++;
+        CHECK(sweep_slices > 10 && vm.gc_count == collections + 1);
+        CHECK(doomed->type == &pickle::string_type && vm.stringof(doomed) == std::string("doomed"));
+        CHECK(count(big) == 19999);
+        // a vm can be destroyed in the middle of a collection, the objects it had already marked are freed too
+        {
+            pvm dying;
+            object* strings = nil;
+            char text[32];
+            for (int i = 0; i < 20000; i++) {
+                snprintf(text, sizeof(text), "string %d", i);
+                dying.push(dying.string(text), strings);
+            }
+            dying.globals = dying.cons(strings, dying.newobject());
+            dying.set_property(cdr(dying.globals), dying.sym("big"), dying.parse_integer("123456789012345678901234567890", 30));
+            dying.gc_min_budget = 0;
+            dying.gc_growth = 0;
+            dying.gc_slice_ns = 0;
+            for (int i = 0; i < 100; i++) dying.gc_step();
+            CHECK(dying.gc_marking);
+        }
+        CHECK(vm.intof(car(big)) == 19999);
+        CHECK(last->type == &pickle::cons_type);
+        CHECK(vm.get_property(props, vm.sym("moved")) == last && vm.intof(car(last)) == 0);
+
+        // and the pauses while running with it
+        size_t first_pause = vm.gc_pause_count;
+        collections = vm.gc_count;
+        vm.gc_min_budget = 1000;
+        vm.gc_growth = 0.05;
+        vm.gc_slice_ns = 10000;
+        vm.auto_gc = vm.incremental_gc = true;
+        vm.start_thread();
+        vm.push_inst("churn", nil, vm.integer(1000));
+        CHECK(vm.run() == pickle::RUN_IDLE);
+        vm.auto_gc = vm.incremental_gc = false;
+        vm.gc_growth = 1.0;
+        size_t n = vm.gc_pause_count - first_pause;
+        printf("%zu collections in %zu pauses\n", vm.gc_count - collections, n);
+        CHECK(vm.gc_count - collections >= 1);
+        CHECK(n > 4 * (vm.gc_count - collections));
+        CHECK(count(big) == 19999);
+        // the distribution of the pauses, the final gc()s included
+        if (n > GC_PAUSE_LOG) n = GC_PAUSE_LOG;
+        uint64_t* pauses = (uint64_t*)malloc(n * sizeof(uint64_t));
+        for (size_t i = 0; i < n; i++) pauses[i] = vm.gc_pauses[(vm.gc_pause_count - n + i) % GC_PAUSE_LOG];
+        std::sort(pauses, pauses + n);
+        uint64_t p50 = pauses[n / 2], p99 = pauses[n * 99 / 100], max = pauses[n - 1];
+        printf("pauses: p50 %" PRIu64 "ns, p99 %" PRIu64 "ns, max %" PRIu64 "ns\n", p50, p99, max);
+        CHECK(p50 < 1000000);
+        free(pauses);
+        vm.globals = nil;
+    }
+    SEPARATOR;
+
+    printf("deep list gc test\n");
+    {
+        // nested through the car, which the marker used to recurse into, so this would overflow the C stack
+        const size_t depth = 200000;
+        object* deep = nil;
+        for (size_t i = 0; i < depth; i++) deep = vm.cons(deep, vm.integer(i & 7));
+        vm.globals = deep;
+        vm.gc();
+        size_t n = 0;
+        for (object* o = deep; o; o = car(o)) n++;
+        CHECK(n == depth);
+        // and the same without prefetching, where the cdrs are followed directly
+        vm.gc_prefetch = 0;
+        vm.gc();
+        vm.gc_prefetch = 8;
+        CHECK(car(deep)->type == &pickle::cons_type);
+        // nested through hashmap nodes, each object holding the next one in a property
+        object* next = vm.sym("next");
+        deep = nil;
+        for (size_t i = 0; i < depth; i++) {
+            object* o = vm.newobject();
+            vm.set_property(o, next, deep);
+            deep = o;
+        }
+        vm.globals = deep;
+        vm.gc();
+        vm.gc_prefetch = 0;
+        vm.gc();
+        vm.gc_prefetch = 8;
+        n = 0;
+        for (object* o = deep; o; o = vm.get_property(o, next)) n++;
+        CHECK(n == depth);
+        // and through threads, each with the next one on its data stack (the finished threads are dropped
+        // from the queue by run(), so only the stacks hold them)
+        deep = nil;
+        for (size_t i = 0; i < depth; i++) {
+            vm.start_thread();
+            if (deep) vm.push_data(deep);
+            deep = car(vm.queue);
+        }
+        vm.globals = deep;
+        CHECK(vm.run(1) == pickle::RUN_IDLE && !vm.queue);
+        vm.gc();
+        n = 0;
+        for (object* o = deep; o; o = vm.data_stack(o) ? car(vm.data_stack(o)) : nil) n++;
+        CHECK(n == depth && deep->type == &pickle::thread_type);
+        vm.globals = nil;
+    }
+    SEPARATOR;
+
+    printf("parallel gc test\n");
+    {
+        // strings (freed on the calling thread), conses, a property chain and a thread, with garbage of each
+        // in between, collected by one thread and then by four
+        object* next = vm.sym("next");
+        object* strings = nil;
+        object* chain = nil;
+        char text[32];
+        vm.start_thread();
+        for (int i = 0; i < 50000; i++) {
+            snprintf(text, sizeof(text), "kept %d", i);
+            vm.push(vm.string(text), strings);
+            snprintf(text, sizeof(text), "dropped %d", i);
+            vm.string(text);
+            object* o = vm.newobject();
+            vm.set_property(o, next, chain);
+            chain = o;
+            vm.set_property(vm.newobject(), next, chain);
+            if (!(i & 1023)) vm.push_data(vm.int_add(vm.integer(INT64_MAX), vm.integer(i)));
+        }
+        object* thread = vm.park_thread();
+        vm.globals = vm.cons(strings, chain);
+        vm.gc();
+        size_t live = vm.live_objects;
+        for (int i = 0; i < 50000; i++) {
+            snprintf(text, sizeof(text), "dropped %d", i);
+            vm.string(text);
+            vm.set_property(vm.newobject(), next, chain);
+        }
+        vm.gc_threads = 4;
+        vm.gc();
+        CHECK(vm.live_objects == live);
+        // the free slots are all on the freelist again
+        size_t free_slots = 0;
+        for (object* o = vm.freelist; o && !o->type; o = cdr(o)) free_slots++;
+        CHECK(free_slots == vm.freespace);
+        size_t n = 0;
+        for (object* o = strings; o; o = cdr(o), n++) {
+            snprintf(text, sizeof(text), "kept %zu", 49999 - n);
+            // the string is still interned, and the dropped ones aren't
+            if (vm.string(text) != car(o)) CHECK(!"string lost");
+        }
+        CHECK(n == 50000);
+        n = 0;
+        for (object* o = chain; o; o = vm.get_property(o, next)) n++;
+        CHECK(n == 50000);
+        CHECK(vm.unpark_thread(thread));
+        object* b = vm.pop();
+        CHECK(b->type == &pickle::bigint_type && vm.int_sub(b, vm.integer(INT64_MAX)) == vm.integer(49152));
+        // and nesting deep enough that only one worker has anything to mark for most of it
+        object* deep = nil;
+        for (size_t i = 0; i < 200000; i++) deep = vm.cons(deep, nil);
+        vm.globals = deep;
+        vm.gc();
+        n = 0;
+        for (object* o = deep; o; o = car(o)) n++;
+        CHECK(n == 200000);
+        vm.globals = nil;
+        vm.gc();
+        CHECK(vm.live_objects < live);
+        vm.gc_threads = 1;
+        while (vm.pop());
+        CHECK(vm.run(1) == pickle::RUN_IDLE);
+    }
+    SEPARATOR;
+
+    printf("string test\n");
+    {
+        object* nul = vm.string("a\0b", 3);
+        CHECK(vm.string_length(nul) == 3 && nul != vm.string("a") && nul == vm.string("a\0b", 3));
+        // short concatenations are plain strings
+        CHECK(vm.concat(vm.string("foo"), vm.string("bar")) == vm.string("foobar"));
+        // appending and prepending many pieces makes balanced ropes
+        std::string expected;
+        object* appended = vm.string("");
+        object* prepended = vm.string("");
+        char piece[32];
+        for (int i = 0; i < 10000; i++) {
+            snprintf(piece, sizeof(piece), "%d,", i);
+            appended = vm.concat(appended, vm.string(piece));
+            expected += piece;
+        }
+        for (int i = 9999; i >= 0; i--) {
+            snprintf(piece, sizeof(piece), "%d,", i);
+            prepended = vm.concat(vm.string(piece), prepended);
+        }
+        vm.globals = vm.cons(appended, prepended);
+        vm.gc();
+        printf("%zu chars, heights %zu and %zu\n", vm.string_length(appended), ROPE(appended)->height, ROPE(prepended)->height);
+        CHECK(appended->type == &pickle::rope_type && vm.string_length(appended) == expected.size());
+        CHECK(ROPE(appended)->height < 20 && ROPE(prepended)->height < 20);
+        CHECK(!pickle::eqcmp(appended, prepended));
+        CHECK(ROPE(appended)->flat == nil);
+        CHECK(vm.stringof(appended) == expected);
+        CHECK(ROPE(appended)->flat == vm.string(expected.c_str()));
+        CHECK(!pickle::eqcmp(prepended, vm.string(expected.c_str())) && vm.hash(prepended) == vm.hash(appended));
+        // flattening a node that other ropes share leaves it a node, so joining them can still rotate through it
+        object* sub = ROPE(prepended)->left;
+        std::string sub_text = vm.stringof(sub);
+        CHECK(ROPE(sub)->flat != nil && ROPE(sub)->height > 1 && ROPE(sub)->left != nil && ROPE(sub)->right != nil);
+        std::string grown_text = expected;
+        std::string around_text = sub_text;
+        object* grown = prepended;
+        object* around = sub;
+        for (int i = 0; i < 2000; i++) {
+            snprintf(piece, sizeof(piece), "<%d>", i);
+            grown = vm.concat(vm.string(piece), grown);
+            grown_text = piece + grown_text;
+            around = vm.concat(around, vm.concat(vm.string(piece), sub));
+            around_text += piece + sub_text;
+        }
+        vm.globals = vm.cons(grown, around);
+        vm.gc();
+        CHECK(ROPE(grown)->height < 25 && vm.stringof(grown) == grown_text && vm.stringof(around) == around_text);
+        vm.globals = nil;
+    }
+    SEPARATOR;
+
+    printf("arena test\n");
+    {
+        pickle::arena a;
+        a.keep_empty = 2;
+        char* small = (char*)a.alloc(10);
+        void* other = a.alloc(16);
+        void* bigger = a.alloc(100);
+        CHECK(small != other && a.bytes_in_use == 16 + 16 + 128 && a.slabs_in_use == 2);
+        // a size class has its own slabs
+        CHECK((uintptr_t)small / ARENA_SLAB_SIZE == (uintptr_t)other / ARENA_SLAB_SIZE);
+        CHECK((uintptr_t)small / ARENA_SLAB_SIZE != (uintptr_t)bigger / ARENA_SLAB_SIZE);
+        // resizing within the size class stays put, and moving keeps the contents
+        memcpy(small, "0123456789abcdef", 16);
+        CHECK(a.resize(small, 16) == small);
+        small = (char*)a.resize(small, 1000);
+        CHECK(memcmp(small, "0123456789abcdef", 16) == 0);
+        char* huge = (char*)a.resize(small, 100000);
+        CHECK(memcmp(huge, "0123456789abcdef", 16) == 0 && a.bytes_in_use == 16 + 128 + 100000);
+        pickle::arena::release(huge);
+        pickle::arena::release(other);
+        pickle::arena::release(bigger);
+        CHECK(a.bytes_in_use == 0 && a.blocks_in_use == 0 && a.slabs_in_use == 0);
+        // empty all of 10 slabs: one is kept, the rest give their pages back
+        void* blocks[150];
+        for (int i = 0; i < 150; i++) blocks[i] = a.alloc(4000);
+        CHECK(a.slabs_in_use == 10);
+        for (int i = 0; i < 150; i++) pickle::arena::release(blocks[i]);
+        printf("%zu slabs released, %zu bytes mapped\n", a.slabs_released, a.bytes_mapped);
+        CHECK(a.slabs_released >= 9);
+        // and they are reused
+        size_t mapped = a.bytes_mapped;
+        for (int i = 0; i < 150; i++) blocks[i] = a.alloc(4000);
+        CHECK(a.bytes_mapped == mapped);
+        for (int i = 0; i < 150; i++) pickle::arena::release(blocks[i]);
+    }
+    SEPARATOR;
+
+    printf("compare test\n");
+    {
+        object* big = vm.parse_integer("9223372036854775808", 19);
+        object* long_text = vm.string(std::string(300, 'x').c_str());
+        object* rope = vm.concat(vm.string(std::string(150, 'x').c_str()), vm.string(std::string(150, 'x').c_str()));
+        // these used to be truncated to an int
+        CHECK(pickle::eqcmp(vm.integer(1LL << 32), vm.integer(0)) > 0);
+        CHECK(pickle::eqcmp(vm.number(0.5), vm.number(0.7)) < 0);
+        // numbers are in order of value whatever their type
+        CHECK(pickle::eqcmp(vm.integer(INT64_MAX), big) < 0 && pickle::eqcmp(vm.int_neg(vm.int_add(big, vm.integer(1))), vm.integer(INT64_MIN)) < 0);
+        CHECK(pickle::eqcmp(vm.integer(1), vm.number(1.5)) < 0 && pickle::eqcmp(vm.integer(2), vm.number(1.5)) > 0);
+        CHECK(pickle::eqcmp(big, vm.number(1e19)) < 0 && pickle::eqcmp(big, vm.number(9e18)) > 0);
+        CHECK(pickle::eqcmp(vm.integer(1), vm.number(1.0)) < 0 && !pickle::equal(vm.integer(1), vm.number(1.0)));
+        CHECK(pickle::eqcmp(vm.number(NAN), vm.number(INFINITY)) > 0);
+        CHECK(pickle::equal(long_text, rope) && !pickle::equal(vm.string("x"), vm.sym("x")));
+        object* b1 = vm.alloc(&box_type);
+        object* b2 = vm.alloc(&box_type);
+        b1->as_big_int = b2->as_big_int = 42;
+        CHECK(pickle::equal(b1, b2) && pickle::eqcmp(vm.cons(nil, nil), b1) < 0);
+        object* keys[] = { nil, vm.number(-2.5), vm.integer(3), big, vm.string("b"), rope, vm.sym("a"), vm.func(collect), vm.opcode(vm.sym("collect")), vm.cons(nil, nil), b1 };
+        size_t n = sizeof(keys) / sizeof(keys[0]);
+        bool antisymmetric = true, ordered = true;
+        for (size_t i = 0; i < n; i++) {
+            for (size_t j = 0; j < n; j++) {
+                int c = pickle::eqcmp(keys[i], keys[j]);
+                antisymmetric = antisymmetric && sign(c) == -sign(pickle::eqcmp(keys[j], keys[i]));
+                // the keys are listed in order
+                ordered = ordered && sign(c) == sign((int)i - (int)j);
+            }
+        }
+        CHECK(antisymmetric && ordered);
+        object* alist = nil;
+        for (size_t i = 0; i < n; i++) vm.push(vm.cons(keys[i], vm.integer(i)), alist);
+        CHECK(cdr(pickle::assoc(alist, long_text)) == vm.integer(5));
+        CHECK(cdr(pickle::assoc(alist, b2)) == vm.integer(10) && cdr(pickle::assoc(alist, vm.sym("a"))) == vm.integer(6));
+        CHECK(pickle::assoc(alist, vm.sym("b")) == NULL && pickle::assoc(alist, vm.integer(4)) == NULL);
+        CHECK(cdr(pickle::delassoc(&alist, b2)) == vm.integer(10) && pickle::assoc(alist, b1) == NULL);
+        // equal keys are the same property
+        object* props = vm.newobject();
+        vm.set_property(props, b1, vm.integer(1));
+        vm.set_property(props, long_text, vm.integer(2));
+        CHECK(vm.get_property(props, b2) == vm.integer(1) && vm.get_property(props, rope) == vm.integer(2));
+    }
+    SEPARATOR;
+
+    printf("pattern test\n");
+    {
+        pvm p;
+        #define L(...) list_of(&p, {__VA_ARGS__})
+        #define S(name) p.sym(name)
+        pickle::pattern_match m;
+        object* foo = p.newobject();
+        object* baz = p.newobject(p.cons(foo, nil));
+        object* qux = p.newobject();
+        p.globals = L(baz, qux);
+        // bar (the):? [x is Foo]
+        object* bar = p.define_pattern(L(S("bar"), L(S("repeat"), p.integer(0), p.integer(1), S("the")), L(S("capture"), S("x"), L(S("is"), foo))), S("bar"));
+        CHECK(bar != nil && p.num_patterns == 1);
+        CHECK(pickle::get_best_match(&p, L(S("bar"), baz), &m) == bar && cdr(pickle::assoc(m.bindings, S("x"))) == baz && m.start == 0 && m.end == 2);
+        // spaces are skipped, and the statement doesn't have to start with the match
+        CHECK(pickle::get_best_match(&p, L(S("so"), S(" "), S("bar"), S(" "), S("the"), S("\t"), foo, S(" "), S("then")), &m) == bar && m.start == 2 && m.end == 7);
+        CHECK(pickle::get_best_match(&p, L(S("bar"), S("the"), qux), &m) == nil && m.bindings == nil);
+        CHECK(pickle::get_best_match(&p, L(S("bar"), S("NEWLINE"), foo), &m) == nil);
+        CHECK(pickle::get_best_match(&p, nil, &m) == nil);
+
+        // precedence, then specificity, then leftmost, then latest
+        object* add = p.define_pattern(L(L(S("capture"), S("a"), L(S("is"), S("int"))), S("+"), L(S("capture"), S("b"), L(S("is"), S("int")))), S("add"), 1);
+        object* mul = p.define_pattern(L(L(S("capture"), S("a"), L(S("is"), S("int"))), S("*"), L(S("capture"), S("b"), L(S("is"), S("int")))), S("mul"), 2);
+        object* anything = p.define_pattern(L(L(S("capture"), S("a"), L(S("any"))), S("+"), L(S("capture"), S("b"), L(S("any")))), S("anything"), 1);
+        CHECK(pickle::get_best_match(&p, L(p.integer(1), S("+"), p.integer(2), S("*"), p.integer(3)), &m) == mul && m.start == 2 && m.end == 5);
+        CHECK(cdr(pickle::assoc(m.bindings, S("a"))) == p.integer(2) && cdr(pickle::assoc(m.bindings, S("b"))) == p.integer(3));
+        CHECK(pickle::get_best_match(&p, L(p.integer(1), S("+"), p.integer(2), S("+"), p.integer(3)), &m) == add && m.start == 0);
+        CHECK(pickle::get_best_match(&p, L(S("x"), S("+"), p.integer(2)), &m) == anything && m.handler == S("anything"));
+        object* add2 = p.define_pattern(L(L(S("capture"), S("a"), L(S("is"), S("int"))), S("+"), L(S("capture"), S("b"), L(S("is"), S("int")))), S("add2"), 1);
+        CHECK(pickle::get_best_match(&p, L(p.integer(1), S("+"), p.integer(2)), &m) == add2);
+
+        // greedy and lazy repetition
+        object* greedy = p.define_pattern(L(S("g"), L(S("capture"), S("w"), L(S("repeat"), p.integer(1), nil, L(S("any")))), L(S("capture"), S("rest"), L(S("repeat"), p.integer(0), nil, L(S("any"))))), S("g"));
+        object* lazy = p.define_pattern(L(S("l"), L(S("capture"), S("w"), L(S("lazy"), p.integer(1), nil, L(S("any")))), L(S("capture"), S("rest"), L(S("repeat"), p.integer(0), nil, L(S("any"))))), S("l"));
+        CHECK(pickle::get_best_match(&p, L(S("g"), S("a"), S("b"), S("c")), &m) == greedy && count(cdr(pickle::assoc(m.bindings, S("w")))) == 3 && cdr(pickle::assoc(m.bindings, S("rest"))) == nil);
+        CHECK(pickle::get_best_match(&p, L(S("l"), S("a"), S("b"), S("c")), &m) == lazy && count(cdr(pickle::assoc(m.bindings, S("w")))) == 1 && count(cdr(pickle::assoc(m.bindings, S("rest")))) == 2);
+        object* bounded = p.define_pattern(L(S("rep"), L(S("repeat"), p.integer(2), p.integer(3), S("x")), S("!")), S("rep"));
+        CHECK(pickle::get_best_match(&p, L(S("rep"), S("x"), S("!")), &m) == nil);
+        CHECK(pickle::get_best_match(&p, L(S("rep"), S("x"), S("x"), S("x"), S("!")), &m) == bounded && m.end == 5);
+        CHECK(pickle::get_best_match(&p, L(S("rep"), S("x"), S("x"), S("x"), S("x"), S("!")), &m) == nil);
+        // a repetition can go around once for every token of a long statement (it backtracks without the C stack)
+        object* along = p.define_pattern(L(S("long"), L(S("repeat"), p.integer(0), nil, L(S("any"))), S("done")), S("along"));
+        object* very_long = p.cons(S("long"), run_of(&p, S("x"), 200000, p.cons(S("done"), nil)));
+        CHECK(pickle::get_best_match(&p, very_long, &m) == along && m.start == 0 && m.end == 200002);
+        CHECK(pickle::get_best_match(&p, p.cons(S("long"), run_of(&p, S("x"), 200000, nil)), &m) == nil);
+
+        // alternation (indexed by the tokens it can start with), backtracking into it
+        object* alt = p.define_pattern(L(L(S("alt"), L(S("yes")), L(S("ok"), S("please"))), L(S("capture"), S("v"), L(S("any")))), S("alt"));
+        CHECK(pickle::get_best_match(&p, L(S("ok"), S("please"), p.integer(5)), &m) == alt && cdr(pickle::assoc(m.bindings, S("v"))) == p.integer(5));
+        CHECK(pickle::get_best_match(&p, L(S("ok"), p.integer(5)), &m) == nil);
+        object* backtrack = p.define_pattern(L(L(S("alt"), L(S("a")), L(S("a"), S("b"))), S("c")), S("backtrack"));
+        CHECK(pickle::get_best_match(&p, L(S("a"), S("b"), S("c")), &m) == backtrack && m.end == 3);
+
+        // predicates
+        object* even = p.define_pattern(L(S("even"), L(S("capture"), S("n"), L(S("matches"), p.func(is_even)))), S("even"));
+        CHECK(pickle::get_best_match(&p, L(S("even"), p.integer(4)), &m) == even && pickle::get_best_match(&p, L(S("even"), p.integer(3)), &m) == nil);
+
+        // things that aren't patterns
+        size_t defined = p.num_patterns;
+        CHECK(p.define_pattern(nil, S("h")) == nil);
+        CHECK(p.define_pattern(L(S("a"), L(S("repeat"), p.integer(2), p.integer(1), S("x"))), S("h")) == nil);
+        CHECK(p.define_pattern(L(L(S("is"), p.integer(5))), S("h")) == nil);
+        CHECK(p.define_pattern(L(L(S("capture"), S("x"))), S("h")) == nil);
+        CHECK(p.define_pattern(L(L(S("unknown"), S("x"))), S("h")) == nil);
+        CHECK(p.define_pattern(L(S("a")), p.integer(1)) == nil);
+        CHECK(p.num_patterns == defined);
+
+        // the patterns are kept by the vm, and new ones are added to the tree as it is
+        p.gc();
+        CHECK(pickle::get_best_match(&p, L(S("bar"), baz), &m) == bar && pickle::get_best_match(&p, L(S("ok"), S("please"), S("x")), &m) == alt);
+        object* later = p.define_pattern(L(S("bar"), S("the"), S("end")), S("later"));
+        CHECK(pickle::get_best_match(&p, L(S("bar"), S("the"), S("end")), &m) == later);
+
+        // eval() rewrites the statement with the handlers until nothing matches
+        p.defop("tokenize", pickle::parser::tokenize);
+        p.defop("eval", pickle::eval);
+        p.defop("splice_match", pickle::splice_match);
+        p.defop("collect", collect);
+        p.defop("add2", add_handler);
+        p.defop("mul", mul_handler);
+        p.start_thread();
+        p.push_inst("collect");
+        p.push_inst("eval");
+        p.push_inst("tokenize");
+        p.push_data(p.string("1 + 2 * 3 + 4 * 5"));
+        CHECK(p.run() == pickle::RUN_IDLE);
+        CHECK(results && count(car(results)) == 1 && caar(results) == p.integer(27));
+        results = nil;
+        #undef L
+        #undef S
+    }
+    SEPARATOR;
+
+    printf("pattern cache test\n");
+    {
+        // without the cache each of these would take more than 2^40 steps to fail on 40 as
+        for (int which = 0; which < PATHOLOGICAL; which++) {
+            pvm p;
+            pickle::pattern_match m;
+            object* last;
+            object* pattern = p.define_pattern(pathological(&p, which, &last), p.sym("h"));
+            size_t steps[2];
+            for (int i = 0; i < 2; i++) {
+                p.match_steps = 0;
+                CHECK(pickle::get_best_match(&p, run_of(&p, p.sym("a"), 40 << i, nil), &m) == nil);
+                steps[i] = p.match_steps;
+            }
+            // and twice the tokens is about twice the work (it would be four times if it was quadratic)
+            CHECK(steps[0] > 40 && 4 * steps[1] <= 9 * steps[0]);
+            CHECK(pickle::get_best_match(&p, run_of(&p, p.sym("a"), 40, p.cons(last, nil)), &m) == pattern && m.start == 0 && m.end == 41);
+        }
+
+        // the same matches and captures with a cache that keeps evicting, and without one
+        {
+            pvm small, none;
+            small.match_cache_size = 8;
+            none.match_cache_size = 0;
+            small.clear_lookup_cache();
+            none.clear_lookup_cache();
+            pickle::pattern_match m1, m2;
+            object* last;
+            small.define_pattern(pathological(&small, 5, &last), small.sym("h"));
+            none.define_pattern(pathological(&none, 5, &last), none.sym("h"));
+            // a a a ... c a a a ... b
+            object* s1 = run_of(&small, small.sym("a"), 12, small.cons(small.sym("c"), run_of(&small, small.sym("a"), 6, small.cons(small.sym("b"), nil))));
+            object* s2 = run_of(&none, none.sym("a"), 12, none.cons(none.sym("c"), run_of(&none, none.sym("a"), 6, none.cons(none.sym("b"), nil))));
+            CHECK(pickle::get_best_match(&small, s1, &m1) != nil && pickle::get_best_match(&none, s2, &m2) != nil);
+            CHECK(m1.start == 13 && m1.start == m2.start && m1.end == 20 && m1.end == m2.end);
+            CHECK(count(m1.bindings) == count(m2.bindings) && count(cdr(pickle::assoc(m1.bindings, small.sym("x")))) == count(cdr(pickle::assoc(m2.bindings, none.sym("x")))));
+            CHECK(small.match_cache_evictions > 0 && none.match_cache_hits == 0);
+        }
+
+        // eval() matches again after every splice, and the tokens after the match are kept, so what has failed
+        // from them isn't tried again
+        {
+            pvm p;
+            pickle::pattern_match m;
+            object* last;
+            p.define_pattern(pathological(&p, 0, &last), p.sym("h"));
+            p.define_pattern(list_of(&p, {p.sym("x")}), p.sym("drop"));
+            object* statement = run_of(&p, p.sym("a"), 40, nil);
+            for (int i = 0; i < 10; i++) p.push(p.sym("x"), statement);
+            p.match_steps = 0;
+            CHECK(pickle::get_best_match(&p, statement, &m) != nil && m.start == 0 && m.end == 1);
+            size_t once = p.match_steps;
+            p.clear_lookup_cache();
+            p.match_steps = p.match_cache_hits = 0;
+            p.defop("eval", pickle::eval);
+            p.defop("splice_match", pickle::splice_match);
+            p.defop("collect", collect);
+            p.defop("drop", drop_handler);
+            p.start_thread();
+            p.push_inst("collect");
+            p.push_inst("eval");
+            p.push_data(statement);
+            CHECK(p.run() == pickle::RUN_IDLE);
+            CHECK(results && count(car(results)) == 40);
+            CHECK(p.match_steps < once + 40 && p.match_cache_hits >= 10 * 40);
+            results = nil;
+        }
+    }
+    SEPARATOR;
+
+    printf("dump test\n");
+    {
+        pickle::sink out;
+        object* x = vm.cons(vm.integer(1), vm.cons(vm.string("a\nb"), nil));
+        vm.dump(vm.cons(x, vm.cons(x, nil)), &out);
+        CHECK(std::string(out.data()) == "(#1=(1 \"a\\nb\") #1#)");
+        char* text = out.take();
+        CHECK(out.size() == 0);
+        free(text);
+        object* circle = vm.cons(vm.integer(1), vm.cons(vm.sym("two"), nil));
+        cdr(cdr(circle)) = circle;
+        vm.dump(circle, &out);
+        CHECK(std::string(out.data()) == "#1=(1 :two . #1#)");
+        free(out.take());
+        // a shared tail that is reached first as a tail gets its number there
+        vm.dump(vm.cons(vm.cons(vm.integer(0), x), x), &out);
+        CHECK(std::string(out.data()) == "((0 . #1=(1 \"a\\nb\")) . #1#)");
+        free(out.take());
+        // nesting that deep would have overflowed the C stack
+        size_t depth = 100000;
+        object* deep = nil;
+        for (size_t i = 0; i < depth; i++) deep = vm.cons(deep, nil);
+        vm.dump(deep, &out);
+        CHECK(out.size() == depth * 2 + 3 && std::string(out.data() + depth - 1, 5) == "(NIL)");
+        free(out.take());
+        // file sinks write through their buffer
+        FILE* f = tmpfile();
+        {
+            pickle::sink to_file(f);
+            vm.dump(deep, &to_file);
+            vm.dump(circle, &to_file);
+        }
+        CHECK((size_t)ftell(f) == depth * 2 + 3 + 17);
+        fclose(f);
+    }
+    SEPARATOR;
+
+    printf("heap image test\n");
+    {
+        char path[] = "/tmp/pickle_imageXXXXXX";
+        close(mkstemp(path));
+        std::string long_string(1000, 'x');
+        {
+            pvm a;
+            a.defop("test_test", test_test);
+            a.defop("collect", collect);
+            object* proto = a.newobject();
+            a.set_property(proto, a.sym("__name__"), a.sym("thing"));
+            object* g = a.newobject(a.cons(proto, nil));
+            object* circle = a.cons(a.integer(1), a.cons(a.string("two"), a.cons(a.number(3.5), nil)));
+            cdr(cddr(circle)) = circle;
+            object* x = a.cons(a.sym("x"), nil);
+            a.set_property(g, a.sym("list"), circle);
+            a.set_property(g, a.sym("x1"), x);
+            a.set_property(g, a.sym("x2"), x);
+            a.set_property(g, a.sym("self"), g);
+            a.set_property(g, a.sym("big"), a.parse_integer("123456789012345678901234567890", 30));
+            a.set_property(g, a.sym("nul"), a.string("a\0b", 3));
+            a.set_property(g, a.sym("fn"), a.func(collect));
+            a.set_property(g, a.sym("op"), a.opcode(a.sym("test_test")));
+            a.set_property(g, a.sym("rope"), a.concat(a.string(long_string.c_str()), a.string(long_string.c_str())));
+            a.set_property(g, x, a.integer(-5));
+            a.globals = g;
+            a.start_thread();
+            a.push_inst("collect");
+            a.push_data(a.integer(5));
+            a.push_data(x);
+            CHECK(a.save_image(path, true));
+            // things that can't be saved
+            a.globals = a.func(churn);
+            CHECK(!a.save_image(path));
+            a.globals = pickle::parser::open_stream(&a, 0);
+            CHECK(!a.save_image(path));
+        }
+        {
+            pvm b;
+            b.defop("collect", collect);
+            CHECK(b.load_image(path));
+            object* g = b.globals;
+            CHECK(g->type == &pickle::obj_type && b.get_property(g, b.sym("self")) == g);
+            CHECK(b.get_property(car(car(g)), b.sym("__name__")) == b.sym("thing"));
+            object* circle = b.get_property(g, b.sym("list"));
+            CHECK(car(circle) == b.integer(1) && cadr(circle) == b.string("two") && caddr(circle) == b.number(3.5));
+            CHECK(cdr(cddr(circle)) == circle);
+            object* x = b.get_property(g, b.sym("x1"));
+            CHECK(x == b.get_property(g, b.sym("x2")) && car(x) == b.sym("x") && b.get_property(g, x) == b.integer(-5));
+            CHECK(b.get_property(g, b.sym("big")) == b.parse_integer("123456789012345678901234567890", 30));
+            CHECK(b.get_property(g, b.sym("nul")) == b.string("a\0b", 3));
+            CHECK(b.get_property(g, b.sym("fn")) == b.func(collect));
+            CHECK(b.get_property(g, b.sym("op")) == b.opcode(b.sym("test_test")));
+            CHECK(b.stringof(b.get_property(g, b.sym("rope"))) == long_string + long_string);
+            // the thread runs where it left off
+            results = NULL;
+            CHECK(b.run() == pickle::RUN_IDLE);
+            CHECK(count(results) == 2 && car(results) == b.integer(5) && cadr(results) == x);
+            results = NULL;
+        }
+        {
+            // the c_function in it isn't registered
+            pvm c;
+            CHECK(!c.load_image(path) && c.globals == nil && c.queue == nil);
+        }
+        {
+            pvm d;
+            d.defop("collect", collect);
+            CHECK(truncate(path, 100) == 0);
+            CHECK(!d.load_image(path) && d.globals == nil);
+        }
+        unlink(path);
+    }
+    SEPARATOR;
+
+    printf("stats test\n");
+    {
+        pvm s;
+        s.defop("record", record);
+        s.sym("foo");
+        s.sym("foo");
+        for (int i = 0; i < 2; i++) {
+            s.start_thread();
+            for (int j = 0; j < 3; j++) s.push_inst("record", nil, s.integer(j));
+        }
+        results = NULL;
+        CHECK(s.run() == pickle::RUN_IDLE);
+        results = NULL;
+        s.gc();
+        pickle::sink out;
+        s.write_stats(&out);
+        printf("%s", out.data());
+        std::string json(out.data());
+        CHECK(json.find("\"threads\": {\"queued\": 0, \"parked\": 0") != std::string::npos);
+        #ifdef PICKLE_STATS
+        CHECK(json.find("\"record\": {\"count\": 6, ") != std::string::npos);
+        CHECK(s.stats.op_counts[s.opcode(s.sym("record"))->as_big_int] == 6);
+        CHECK(s.stats.max_queue_length == 2 && s.stats.queue_length == 0);
+        CHECK(s.stats.allocations_of(&pickle::integer_type) == SMALL_INT_MAX - SMALL_INT_MIN + 1);
+        CHECK(s.stats.allocations_of(&pickle::thread_type) == 2);
+        CHECK(s.stats.symbols.hits >= 1 && s.stats.symbols.misses >= 2);
+        uint64_t pauses = 0;
+        for (int i = 0; i < 64; i++) pauses += s.stats.pause_histogram[i];
+        CHECK(pauses == s.gc_pause_count);
+        s.reset_stats();
+        CHECK(s.stats.op_counts[s.opcode(s.sym("record"))->as_big_int] == 0 && s.stats.allocations_of(&pickle::thread_type) == 0);
+        #else
+        CHECK(json.find("{\"enabled\": false,") == 0);
+        #endif
+    }
+    SEPARATOR;
+
+    printf("profiler test\n");
+    {
+        pvm p;
+        p.defop("record", record);
+        p.defop("spin", spin);
+        p.start_profile(1);
+        p.start_thread();
+        // skipped (nothing fails), but it is under the other two while they run
+        p.push_inst("record", "error");
+        p.push_inst("record");
+        p.push_inst("record");
+        CHECK(p.run() == pickle::RUN_IDLE);
+        pickle::sink out;
+        p.write_profile(&out);
+        printf("%s", out.data());
+        CHECK(std::string(out.data()) == "record[error];record 1\nrecord[error];record;record 1\n");
+        // deep stacks keep the top
+        p.clear_profile();
+        p.start_thread();
+        for (int i = 0; i < PROFILE_MAX_DEPTH + 10; i++) p.push_inst("record");
+        CHECK(p.run() == pickle::RUN_IDLE);
+        CHECK(p.profile_samples == PROFILE_MAX_DEPTH + 10);
+        out.clear();
+        p.write_profile(&out);
+        CHECK(std::string(out.data()).find("...;record;") == 0);
+        results = NULL;
+        // every millisecond of CPU time
+        p.clear_profile();
+        CHECK(p.start_profile_timer(1000000));
+        pvm other;
+        CHECK(!other.start_profile_timer(1000000));
+        p.start_thread();
+        p.push_inst("spin");
+        p.run_for(100000000);
+        p.stop_profile();
+        out.clear();
+        p.write_profile(&out);
+        printf("%s", out.data());
+        CHECK(p.profile_samples > 0 && std::string(out.data()).find("spin ") == 0);
+        CHECK(other.start_profile_timer(1000000));
+    }
     SEPARATOR;
 
     printf("all done -- cleaning up\n");